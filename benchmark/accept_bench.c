@@ -0,0 +1,204 @@
+// Connection storm over loopback: PD_OP_LISTEN (accept() + one result per
+// connection) vs. PD_OP_LISTEN_BATCH (accept4() + one result per batch).
+//
+//   cmake --build <build dir> --target accept_bench
+//   ./accept_bench [connections] [client threads] [accept budget]
+//
+// Poller thread CPU time is read with CLOCK_THREAD_CPUTIME_ID from inside
+// the callbacks, which run on the poller thread. For syscall counts, run
+// under `strace -c -f`.
+//
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "poller.h"
+
+struct __bench_ctx
+{
+    size_t target;
+    size_t accepted;
+    size_t results;
+    struct timespec cpu_begin;
+    struct timespec cpu_end;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+struct __bench_client
+{
+    struct sockaddr_in addr;
+    size_t count;
+};
+
+static double __bench_elapsed(const struct timespec *begin, const struct timespec *end)
+{
+    return (end->tv_sec - begin->tv_sec) + (end->tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+static void __bench_accepted(struct __bench_ctx *ctx, size_t n)
+{
+    if(ctx->accepted == 0)
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ctx->cpu_begin);
+
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->accepted += n;
+    if(ctx->accepted >= ctx->target)
+    {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ctx->cpu_end);
+        pthread_cond_signal(&ctx->cond);
+    }
+
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+static void *__bench_accept(const struct sockaddr *addr, socklen_t addrlen,
+                            int sockfd, void *context)
+{
+    close(sockfd);
+    __bench_accepted((struct __bench_ctx *)context, 1);
+    return context;
+}
+
+static void *__bench_accept_batch(const struct poller_accepted *acc, int n,
+                                  void *context)
+{
+    int i;
+
+    for(i = 0; i < n; i++)
+        close(acc[i].sockfd);
+
+    __bench_accepted((struct __bench_ctx *)context, n);
+    return context;
+}
+
+static void __bench_callback(struct poller_result *res, void *context)
+{
+    struct __bench_ctx *ctx = (struct __bench_ctx *)res->data.context;
+
+    if(res->state == PR_ST_SUCCESS)
+        ctx->results++;
+
+    poller_free_result(res, *(poller_t **)context);
+}
+
+static void *__bench_client_routine(void *arg)
+{
+    struct __bench_client *client = (struct __bench_client *)arg;
+    size_t i;
+    int fd;
+
+    for(i = 0; i < client->count; i++)
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd < 0 || connect(fd, (struct sockaddr *)&client->addr,
+                             sizeof client->addr) < 0)
+        {
+            perror("connect");
+            exit(1);
+        }
+
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static void __bench_run(int operation, size_t n, int nthreads, int budget)
+{
+    struct poller_params params = {
+        .max_open_files = 65536,
+        .callback       = __bench_callback,
+        .accept_budget  = budget,
+    };
+    struct __bench_client client;
+    struct __bench_ctx ctx;
+    struct poller_data data;
+    struct timespec begin, end;
+    socklen_t addrlen = sizeof client.addr;
+    pthread_t tids[64];
+    poller_t *poller;
+    int fd;
+    int i;
+
+    memset(&ctx, 0, sizeof ctx);
+    ctx.target = n / nthreads * nthreads;
+    pthread_mutex_init(&ctx.mutex, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+
+    params.context = &poller;
+    poller = poller_create(&params);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&client.addr, 0, sizeof client.addr);
+    client.addr.sin_family = AF_INET;
+    client.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(!poller || fd < 0 ||
+        bind(fd, (struct sockaddr *)&client.addr, sizeof client.addr) < 0 ||
+        getsockname(fd, (struct sockaddr *)&client.addr, &addrlen) < 0 ||
+        listen(fd, 4096) < 0 || poller_start(poller) < 0)
+    {
+        perror("setup");
+        exit(1);
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    memset(&data, 0, sizeof data);
+    data.operation = operation;
+    data.fd = fd;
+    data.context = &ctx;
+    if(operation == PD_OP_LISTEN)
+        data.accept = __bench_accept;
+    else
+        data.accept_batch = __bench_accept_batch;
+
+    if(poller_add(&data, -1, poller) < 0)
+    {
+        perror("poller_add");
+        exit(1);
+    }
+
+    client.count = n / nthreads;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for(i = 0; i < nthreads; i++)
+        pthread_create(&tids[i], NULL, __bench_client_routine, &client);
+
+    for(i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+
+    pthread_mutex_lock(&ctx.mutex);
+    while(ctx.accepted < ctx.target)
+        pthread_cond_wait(&ctx.cond, &ctx.mutex);
+    pthread_mutex_unlock(&ctx.mutex);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%-12s %zu conns, %.0f conns/s, poller cpu %.1f us/conn, %.1f conns/result\n",
+           operation == PD_OP_LISTEN ? "listen" : "listen_batch", ctx.accepted,
+           ctx.accepted / __bench_elapsed(&begin, &end),
+           __bench_elapsed(&ctx.cpu_begin, &ctx.cpu_end) * 1e6 / ctx.accepted,
+           (double)ctx.accepted / ctx.results);
+
+    poller_stop(poller);
+    poller_destroy(poller);
+    close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    int nthreads = argc > 2 ? atoi(argv[2]) : 8;
+    int budget = argc > 3 ? atoi(argv[3]) : 0;
+
+    if(nthreads < 1 || nthreads > 64)
+        nthreads = 8;
+
+    __bench_run(PD_OP_LISTEN, n, nthreads, budget);
+    __bench_run(PD_OP_LISTEN_BATCH, n, nthreads, budget);
+    return 0;
+}
@@ -0,0 +1,208 @@
+// Delimiter search and framing: libc memmem() and a hand-written append()
+// built on it, against poller_find_*() and the framers of
+// poller_framing.h.
+//
+//   cmake --build <build dir> --target framing_bench
+//   ./framing_bench [total MB per case]
+//
+// Search cases place one delimiter at the very end of inputs from 64B to
+// 1MB. The pipelined case splits a 256KB read of small HTTP/1.1 requests
+// the way the poller's read loop does: append() until it completes a
+// message, the rest of the read going to the next message. The baseline
+// append() scans the new bytes with memmem(), seam included, and copies
+// them in one go, which is what a careful hand-written one does.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "poller_framing.h"
+
+#define BENCH_READ      (256 * 1024)
+
+static volatile size_t __bench_sink;
+
+static double __bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *__bench_memmem_header_end(const char *p, size_t n)
+{
+    const char *found = (const char *)memmem(p, n, "\r\n\r\n", 4);
+
+    return found ? found + 4 : NULL;
+}
+
+static const char *__bench_memmem_crlf(const char *p, size_t n)
+{
+    return (const char *)memmem(p, n, "\r\n", 2);
+}
+
+static void __bench_search(size_t size, size_t total)
+{
+    char *buf = (char *)malloc(size);
+    size_t iters = total / size + 1;
+    double t[5];
+    size_t i;
+
+    memset(buf, 'a', size);
+    memcpy(buf + size - 4, "\r\n\r\n", 4);
+
+    t[0] = __bench_now();
+    for(i = 0; i < iters; i++)
+        __bench_sink += (size_t)__bench_memmem_crlf(buf, size);
+
+    t[1] = __bench_now();
+    for(i = 0; i < iters; i++)
+        __bench_sink += (size_t)poller_find_crlf(buf, size);
+
+    t[2] = __bench_now();
+    for(i = 0; i < iters; i++)
+        __bench_sink += (size_t)__bench_memmem_header_end(buf, size);
+
+    t[3] = __bench_now();
+    for(i = 0; i < iters; i++)
+        __bench_sink += (size_t)poller_find_http_header_end(buf, size);
+
+    t[4] = __bench_now();
+    printf("%8zu B  crlf %10.1f -> %9.1f ns  header end %10.1f -> %9.1f ns  (%.2f GB/s)\n",
+           size, (t[1] - t[0]) * 1e9 / iters, (t[2] - t[1]) * 1e9 / iters,
+           (t[3] - t[2]) * 1e9 / iters, (t[4] - t[3]) * 1e9 / iters,
+           size * iters / (t[4] - t[3]) / 1e9);
+    free(buf);
+}
+
+static int __bench_copy(const char *p, size_t n, struct poller_frame_message *frame)
+{
+    size_t capacity = frame->capacity ? frame->capacity : 256;
+    char *buf;
+
+    if(frame->size + n > frame->capacity)
+    {
+        while(capacity < frame->size + n)
+            capacity *= 2;
+
+        buf = (char *)realloc(frame->buf, capacity);
+        if(!buf)
+            return -1;
+
+        frame->buf = buf;
+        frame->capacity = capacity;
+    }
+
+    memcpy(frame->buf + frame->size, p, n);
+    frame->size += n;
+    return 0;
+}
+
+/* A hand-written append(): memmem() over the seam with the bytes already
+ * in, then over the new bytes, then one copy. */
+static int __bench_memmem_append(const void *buf, size_t *n, poller_message_t *msg)
+{
+    struct poller_frame_message *frame = (struct poller_frame_message *)msg;
+    const char *p = (const char *)buf;
+    size_t tail = frame->size < 3 ? frame->size : 3;
+    size_t head = *n < 3 ? *n : 3;
+    const char *found;
+    char seam[6];
+
+    if(tail > 0)
+    {
+        memcpy(seam, frame->buf + frame->size - tail, tail);
+        memcpy(seam + tail, p, head);
+        found = (const char *)memmem(seam, tail + head, "\r\n\r\n", 4);
+        if(found)
+        {
+            *n = found - seam + 4 - tail;
+            return __bench_copy(p, *n, frame) < 0 ? -1 : 1;
+        }
+    }
+
+    found = (const char *)memmem(p, *n, "\r\n\r\n", 4);
+    if(found)
+    {
+        *n = found + 4 - p;
+        return __bench_copy(p, *n, frame) < 0 ? -1 : 1;
+    }
+
+    return __bench_copy(p, *n, frame);
+}
+
+/* The read loop of the poller, minus the read(). */
+static size_t __bench_frames(const char *p, size_t size,
+                             int (*append)(const void *, size_t *, poller_message_t *))
+{
+    struct poller_frame_message msg;
+    size_t frames = 0;
+    size_t n;
+    int ret;
+
+    poller_frame_init_http_header(8192, &msg);
+    msg.base.append = append;
+    while(size > 0)
+    {
+        n = size;
+        ret = msg.base.append(p, &n, &msg.base);
+        if(ret < 0)
+            break;
+
+        p += n;
+        size -= n;
+        if(ret > 0)
+        {
+            frames++;
+            msg.size = 0;
+        }
+    }
+
+    poller_frame_deinit(&msg);
+    return frames;
+}
+
+static void __bench_pipelined(size_t total)
+{
+    static const char req[] = "GET /index.html HTTP/1.1\r\nHost: bench\r\n"
+                              "User-Agent: framing_bench\r\n\r\n";
+    size_t iters = total / BENCH_READ + 1;
+    char *buf = (char *)malloc(BENCH_READ);
+    size_t frames = 0;
+    size_t size = 0;
+    double t[3];
+    size_t i;
+
+    while(size + sizeof req - 1 <= BENCH_READ)
+    {
+        memcpy(buf + size, req, sizeof req - 1);
+        size += sizeof req - 1;
+    }
+
+    t[0] = __bench_now();
+    for(i = 0; i < iters; i++)
+        frames = __bench_frames(buf, size, __bench_memmem_append);
+
+    t[1] = __bench_now();
+    for(i = 0; i < iters; i++)
+        frames = __bench_frames(buf, size, poller_frame_append_delim);
+
+    t[2] = __bench_now();
+    printf("pipelined %zuB requests: %.1f -> %.1f ns/request\n", sizeof req - 1,
+           (t[1] - t[0]) * 1e9 / (iters * frames), (t[2] - t[1]) * 1e9 / (iters * frames));
+    free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t total = (argc > 1 ? strtoul(argv[1], NULL, 10) : 256) << 20;
+    size_t size;
+
+    for(size = 64; size <= 1024 * 1024; size *= 4)
+        __bench_search(size, total);
+
+    __bench_pipelined(total);
+    return 0;
+}
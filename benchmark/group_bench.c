@@ -0,0 +1,444 @@
+// Loopback echo over poller groups, to see how a group scales with its
+// number of shards.
+//
+//   cmake --build <build dir> --target group_bench
+//   ./group_bench [-n max shards] [-c conns] [-s size] [-T seconds]
+//
+//   -n  largest group size (default: the number of CPUs); the benchmark
+//       runs 1, 2, 4, ... shards up to it
+//   -c  connections (default 256)
+//   -s  bytes per request and per reply (default 64)
+//   -T  measured seconds per group size (default 5)
+//
+// The server group takes the connections from one listening socket added
+// with poller_group_add_listen(). The clients run in a second group of as
+// many shards, so each size uses twice as many poller threads, and the
+// scaling it shows flattens out at half the CPUs at the latest. Every
+// connection writes one request, waits for its reply, and starts over.
+//
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "poller.h"
+#include "poller_group.h"
+
+struct __gb_msg
+{
+    poller_message_t base;
+    size_t got;
+    size_t size;
+};
+
+struct __gb_conn
+{
+    struct __gb *gb;
+    int fd;
+    struct __gb_msg msg;
+    struct iovec iov;
+    unsigned long long responses;
+};
+
+struct __gb
+{
+    poller_group_t *server;
+    poller_group_t *client;
+    size_t size;
+    size_t max_open_files;
+    char *buf;
+    int nconns;
+    struct __gb_conn *conns;
+    int connected;
+    int failed;
+};
+
+static double __gb_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int __gb_append(const void *buf, size_t *size, poller_message_t *base)
+{
+    struct __gb_msg *msg = (struct __gb_msg *)base;
+
+    if(*size >= msg->size - msg->got)
+    {
+        *size = msg->size - msg->got;
+        msg->got = msg->size;
+        return 1;
+    }
+
+    msg->got += *size;
+    return 0;
+}
+
+static poller_message_t *__gb_create_message(void *context)
+{
+    struct __gb_conn *conn = (struct __gb_conn *)context;
+
+    conn->msg.base.append = __gb_append;
+    conn->msg.base.get_buffer = NULL;
+    conn->msg.base.commit = NULL;
+    conn->msg.got = 0;
+    conn->msg.size = conn->gb->size;
+    return &conn->msg.base;
+}
+
+static int __gb_partial_written(size_t n, void *context)
+{
+    return 0;
+}
+
+static void __gb_read_data(struct __gb_conn *conn, struct poller_data *data)
+{
+    memset(data, 0, sizeof (struct poller_data));
+    data->operation = PD_OP_READ;
+    data->fd = conn->fd;
+    data->create_message = __gb_create_message;
+    data->context = conn;
+}
+
+static void __gb_write_data(struct __gb_conn *conn, struct poller_data *data)
+{
+    conn->iov.iov_base = conn->gb->buf;
+    conn->iov.iov_len = conn->gb->size;
+
+    memset(data, 0, sizeof (struct poller_data));
+    data->operation = PD_OP_WRITE;
+    data->fd = conn->fd;
+    data->partial_written = __gb_partial_written;
+    data->context = conn;
+    data->write_iov = &conn->iov;
+    data->iovcnt = 1;
+}
+
+static void __gb_nodelay(int fd)
+{
+    int one = 1;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+}
+
+/* Group shards do not use the slab, so any shard can free any result;
+ * the one an fd is routed to is as good as another. */
+static void __gb_free_result(struct poller_result *res, poller_group_t *group)
+{
+    poller_free_result(res, poller_group_get(res->data.fd, group));
+}
+
+/* Server side. */
+
+static void *__gb_accept(const struct sockaddr *addr, socklen_t addrlen,
+                         int sockfd, void *context)
+{
+    struct __gb_conn *conn;
+
+    conn = (struct __gb_conn *)calloc(1, sizeof (struct __gb_conn));
+    if(!conn)
+        return NULL;
+
+    conn->gb = (struct __gb *)context;
+    conn->fd = sockfd;
+    __gb_nodelay(sockfd);
+    return conn;
+}
+
+static void __gb_server_close(struct __gb_conn *conn)
+{
+    close(conn->fd);
+    free(conn);
+}
+
+static void __gb_server_read(struct __gb_conn *conn)
+{
+    struct poller_data data;
+
+    __gb_read_data(conn, &data);
+    if(poller_group_add(&data, -1, conn->gb->server) < 0)
+        __gb_server_close(conn);
+}
+
+/* The client sends nothing more before the reply, so no request bytes are
+ * left behind when the read node is replaced. */
+static void __gb_server_write(struct __gb_conn *conn)
+{
+    struct poller_data data;
+
+    __gb_write_data(conn, &data);
+    if(poller_group_mod(&data, -1, conn->gb->server) < 0)
+        poller_group_del(conn->fd, conn->gb->server);
+}
+
+static void __gb_server_callback(struct poller_result *res, void *context)
+{
+    struct __gb *gb = (struct __gb *)context;
+    struct __gb_conn *conn = (struct __gb_conn *)res->data.context;
+
+    if(res->data.operation == PD_OP_LISTEN)
+    {
+        if(res->state == PR_ST_SUCCESS)
+            __gb_server_read((struct __gb_conn *)res->data.result);
+    }
+    else if(res->state == PR_ST_SUCCESS)
+        __gb_server_write(conn);
+    else if(res->state == PR_ST_FINISHED)
+        __gb_server_read(conn);
+    else if(res->state != PR_ST_MODIFIED)
+        __gb_server_close(conn);
+
+    __gb_free_result(res, gb->server);
+}
+
+/* Client side. */
+
+static void __gb_client_write(struct __gb_conn *conn, int mod)
+{
+    struct poller_data data;
+    int ret;
+
+    __gb_write_data(conn, &data);
+    if(mod)
+        ret = poller_group_mod(&data, -1, conn->gb->client);
+    else
+        ret = poller_group_add(&data, -1, conn->gb->client);
+
+    if(ret < 0)
+        __atomic_add_fetch(&conn->gb->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void __gb_client_read(struct __gb_conn *conn)
+{
+    struct poller_data data;
+
+    __gb_read_data(conn, &data);
+    if(poller_group_add(&data, -1, conn->gb->client) < 0)
+        __atomic_add_fetch(&conn->gb->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void __gb_client_callback(struct poller_result *res, void *context)
+{
+    struct __gb *gb = (struct __gb *)context;
+    struct __gb_conn *conn = (struct __gb_conn *)res->data.context;
+
+    switch(res->state)
+    {
+        case PR_ST_SUCCESS:
+            /* Only the shard of the connection writes its count. */
+            __atomic_store_n(&conn->responses, conn->responses + 1, __ATOMIC_RELAXED);
+            __gb_client_write(conn, 1);
+            break;
+        case PR_ST_FINISHED:
+            if(res->data.operation == PD_OP_CONNECT)
+            {
+                __atomic_add_fetch(&gb->connected, 1, __ATOMIC_RELEASE);
+                __gb_client_write(conn, 0);
+            }
+            else
+                __gb_client_read(conn);
+            break;
+        case PR_ST_ERROR:
+            __atomic_add_fetch(&gb->failed, 1, __ATOMIC_RELEASE);
+            break;
+    }
+
+    __gb_free_result(res, gb->client);
+}
+
+static int __gb_connect(struct __gb_conn *conn, const struct sockaddr_in *addr)
+{
+    struct poller_data data;
+
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(conn->fd < 0)
+        return -1;
+
+    __gb_nodelay(conn->fd);
+    if(connect(conn->fd, (const struct sockaddr *)addr, sizeof *addr) < 0 &&
+        errno != EINPROGRESS)
+        return -1;
+
+    memset(&data, 0, sizeof (struct poller_data));
+    data.operation = PD_OP_CONNECT;
+    data.fd = conn->fd;
+    data.context = conn;
+    return poller_group_add(&data, 30000, conn->gb->client);
+}
+
+static int __gb_listen(struct __gb *gb, struct sockaddr_in *addr)
+{
+    socklen_t addrlen = sizeof *addr;
+    struct poller_data data;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(addr, 0, sizeof *addr);
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(fd < 0 || bind(fd, (struct sockaddr *)addr, sizeof *addr) < 0 ||
+        getsockname(fd, (struct sockaddr *)addr, &addrlen) < 0 ||
+        listen(fd, 65535) < 0)
+        return -1;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    memset(&data, 0, sizeof (struct poller_data));
+    data.operation = PD_OP_LISTEN;
+    data.fd = fd;
+    data.accept = __gb_accept;
+    data.context = gb;
+    if(poller_group_add_listen(&data, -1, gb->server) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static unsigned long long __gb_responses(const struct __gb *gb)
+{
+    unsigned long long sum = 0;
+    int i;
+
+    for(i = 0; i < gb->nconns; i++)
+        sum += __atomic_load_n(&gb->conns[i].responses, __ATOMIC_RELAXED);
+
+    return sum;
+}
+
+static int __gb_run(struct __gb *gb, size_t nshards, double seconds)
+{
+    struct poller_params params = { };
+    struct sockaddr_in addr;
+    unsigned long long responses;
+    double begin;
+    int listen_fd;
+    int i;
+
+    gb->connected = 0;
+    gb->failed = 0;
+    memset(gb->conns, 0, gb->nconns * sizeof (struct __gb_conn));
+
+    params.max_open_files = gb->max_open_files;
+    params.context = gb;
+    params.callback = __gb_server_callback;
+    gb->server = poller_group_create(nshards, &params);
+    params.callback = __gb_client_callback;
+    gb->client = poller_group_create(nshards, &params);
+    if(!gb->server || !gb->client || poller_group_start(gb->server) < 0 ||
+        poller_group_start(gb->client) < 0 ||
+        (listen_fd = __gb_listen(gb, &addr)) < 0)
+        return -1;
+
+    for(i = 0; i < gb->nconns; i++)
+    {
+        gb->conns[i].gb = gb;
+        gb->conns[i].fd = -1;
+        if(__gb_connect(&gb->conns[i], &addr) < 0)
+            __atomic_add_fetch(&gb->failed, 1, __ATOMIC_RELEASE);
+    }
+
+    begin = __gb_now();
+    while(__atomic_load_n(&gb->connected, __ATOMIC_ACQUIRE) +
+          __atomic_load_n(&gb->failed, __ATOMIC_ACQUIRE) < gb->nconns &&
+          __gb_now() - begin < 60)
+        usleep(10000);
+
+    /* Warm up, then measure. */
+    usleep(500000);
+    responses = __gb_responses(gb);
+    begin = __gb_now();
+    usleep(seconds * 1e6);
+    responses = __gb_responses(gb) - responses;
+    printf("%3zu shards  %10.0f req/s  %d connected, %d errors\n", nshards,
+           responses / (__gb_now() - begin), gb->connected, gb->failed);
+
+    poller_group_stop(gb->client);
+    poller_group_stop(gb->server);
+    for(i = 0; i < gb->nconns; i++)
+    {
+        if(gb->conns[i].fd >= 0)
+            close(gb->conns[i].fd);
+    }
+
+    close(listen_fd);
+    poller_group_destroy(gb->client);
+    poller_group_destroy(gb->server);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t max_shards = sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = 5;
+    struct rlimit rl;
+    struct __gb gb;
+    size_t nshards;
+    int c;
+
+    memset(&gb, 0, sizeof gb);
+    gb.nconns = 256;
+    gb.size = 64;
+    while((c = getopt(argc, argv, "n:c:s:T:")) != -1)
+    {
+        switch(c)
+        {
+            case 'n': max_shards = strtoul(optarg, NULL, 10); break;
+            case 'c': gb.nconns = atoi(optarg); break;
+            case 's': gb.size = strtoul(optarg, NULL, 10); break;
+            case 'T': seconds = atof(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n max shards] [-c conns] [-s size] "
+                                "[-T seconds]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if(max_shards < 1 || gb.nconns < 1 || gb.size < 1)
+        return 1;
+
+    /* Both ends of every connection live in this process. */
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if(rl.rlim_cur < 2 * (rlim_t)gb.nconns + 64)
+    {
+        fprintf(stderr, "RLIMIT_NOFILE %llu is too low for %d connections\n",
+                (unsigned long long)rl.rlim_cur, gb.nconns);
+        return 1;
+    }
+
+    gb.max_open_files = rl.rlim_cur;
+    gb.buf = (char *)malloc(gb.size);
+    gb.conns = (struct __gb_conn *)malloc(gb.nconns * sizeof (struct __gb_conn));
+    if(!gb.buf || !gb.conns)
+        return 1;
+
+    memset(gb.buf, 'x', gb.size);
+    printf("conns %d size %zu\n", gb.nconns, gb.size);
+    for(nshards = 1; nshards <= max_shards; nshards *= 2)
+    {
+        if(__gb_run(&gb, nshards, seconds) < 0)
+        {
+            perror("setup");
+            return 1;
+        }
+    }
+
+    free(gb.conns);
+    free(gb.buf);
+    return 0;
+}
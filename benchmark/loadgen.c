@@ -0,0 +1,699 @@
+// Loopback load generator: a poller-based length-prefixed RPC server and
+// a poller-based client in one process, each on its own poller thread.
+//
+//   cmake --build <build dir> --target loadgen
+//   ./loadgen [-c conns] [-s size] [-d depth] [-w warmup] [-T seconds] [-t]
+//
+//   -c  connections (default 100, up to what RLIMIT_NOFILE allows)
+//   -s  payload bytes per request and per reply (default 64)
+//   -d  pipelining depth: requests written back to back per connection
+//       before waiting for their replies (default 1)
+//   -w  warmup seconds once all connections are up (default 2)
+//   -T  measured seconds (default 10)
+//   -t  TLS, with a throwaway self-signed P-256 certificate
+//
+// A frame is a 4-byte big-endian length followed by the payload. Every
+// client connection writes 'depth' frames with PD_OP_WRITE, then reads
+// the 'depth' replies with PD_OP_READ, and starts over. The server does
+// the same the other way round: it reads the 'depth' frames of a burst
+// with PD_OP_READ, then switches the connection to a PD_OP_WRITE of as
+// many replies of the same size. Latency is measured per request, from
+// the start of its burst to the arrival of its reply.
+//
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include "poller.h"
+
+/* Log-linear latency buckets: 64 per power of two, in microseconds. */
+#define LG_HIST_SUB     64
+#define LG_HIST_SIZE    (LG_HIST_SUB * 36)
+
+struct __lg_msg
+{
+    poller_message_t base;
+    unsigned char header[4];
+    size_t got;
+    size_t max;
+};
+
+struct __lg_conn
+{
+    struct __lg *lg;
+    int fd;
+    SSL *ssl;
+    struct __lg_msg msg;
+    struct iovec iov;
+    double sent_at;
+    int pending;
+};
+
+struct __lg
+{
+    poller_t *server;
+    poller_t *client;
+    SSL_CTX *server_ctx;
+    SSL_CTX *client_ctx;
+    size_t size;
+    int depth;
+    int nconns;
+    struct __lg_conn *conns;
+    char *request;
+    size_t request_len;
+    char *reply;
+    size_t reply_len;
+    int connected;
+    int failed;
+    int measuring;
+    unsigned long long responses;
+    unsigned long long errors;
+    unsigned long long hist[LG_HIST_SIZE];
+};
+
+static double __lg_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int __lg_hist_index(unsigned long long us)
+{
+    int e;
+
+    if(us < LG_HIST_SUB)
+        return us;
+
+    e = 63 - __builtin_clzll(us);
+    if(e >= 40)
+        return LG_HIST_SIZE - 1;
+
+    return (e - 5) * LG_HIST_SUB + ((us >> (e - 6)) & (LG_HIST_SUB - 1));
+}
+
+static unsigned long long __lg_hist_value(int i)
+{
+    if(i < LG_HIST_SUB)
+        return i;
+
+    return (unsigned long long)(LG_HIST_SUB + i % LG_HIST_SUB) << (i / LG_HIST_SUB - 1);
+}
+
+static double __lg_percentile(const struct __lg *lg, double p)
+{
+    unsigned long long want = lg->responses * p;
+    unsigned long long sum = 0;
+    int i;
+
+    for(i = 0; i < LG_HIST_SIZE; i++)
+    {
+        sum += lg->hist[i];
+        if(sum > want)
+            return __lg_hist_value(i);
+    }
+
+    return 0;
+}
+
+static void __lg_frame(char *buf, size_t size)
+{
+    buf[0] = size >> 24;
+    buf[1] = size >> 16;
+    buf[2] = size >> 8;
+    buf[3] = size;
+    memset(buf + 4, 'x', size);
+}
+
+static int __lg_append(const void *buf, size_t *size, poller_message_t *base)
+{
+    struct __lg_msg *msg = (struct __lg_msg *)base;
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t n = *size;
+    size_t length;
+    size_t want;
+
+    while(msg->got < 4 && n > 0)
+    {
+        msg->header[msg->got++] = *p++;
+        n--;
+    }
+
+    if(msg->got < 4)
+        return 0;
+
+    length = (size_t)msg->header[0] << 24 | msg->header[1] << 16 |
+             msg->header[2] << 8 | msg->header[3];
+    if(length > msg->max)
+    {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    want = 4 + length - msg->got;
+    if(n >= want)
+    {
+        msg->got += want;
+        *size -= n - want;
+        return 1;
+    }
+
+    msg->got += n;
+    return 0;
+}
+
+/* The callback is done with a message before the next one is created, so
+ * each connection reuses its own. */
+static poller_message_t *__lg_create_message(void *context)
+{
+    struct __lg_conn *conn = (struct __lg_conn *)context;
+
+    memset(&conn->msg, 0, sizeof (struct __lg_msg));
+    conn->msg.base.append = __lg_append;
+    conn->msg.max = conn->lg->size;
+    return &conn->msg.base;
+}
+
+static int __lg_partial_written(size_t n, void *context)
+{
+    return 0;
+}
+
+static void __lg_read_data(struct __lg_conn *conn, struct poller_data *data)
+{
+    memset(data, 0, sizeof (struct poller_data));
+    data->operation = PD_OP_READ;
+    data->fd = conn->fd;
+    data->ssl = conn->ssl;
+    data->create_message = __lg_create_message;
+    data->context = conn;
+}
+
+static void __lg_close(struct __lg_conn *conn)
+{
+    if(conn->ssl)
+        SSL_free(conn->ssl);
+
+    if(conn->fd >= 0)
+        close(conn->fd);
+
+    conn->ssl = NULL;
+    conn->fd = -1;
+}
+
+static void __lg_nodelay(int fd)
+{
+    int one = 1;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+}
+
+static void __lg_write_data(struct __lg_conn *conn, char *buf, size_t len,
+                            struct poller_data *data)
+{
+    conn->iov.iov_base = buf;
+    conn->iov.iov_len = len;
+
+    memset(data, 0, sizeof (struct poller_data));
+    data->operation = PD_OP_WRITE;
+    data->fd = conn->fd;
+    data->ssl = conn->ssl;
+    data->partial_written = __lg_partial_written;
+    data->context = conn;
+    data->write_iov = &conn->iov;
+    data->iovcnt = 1;
+}
+
+/* Server side. */
+
+static void *__lg_accept(const struct sockaddr *addr, socklen_t addrlen,
+                         int sockfd, void *context)
+{
+    struct __lg *lg = (struct __lg *)context;
+    struct __lg_conn *conn;
+
+    conn = (struct __lg_conn *)calloc(1, sizeof (struct __lg_conn));
+    if(!conn)
+        return NULL;
+
+    conn->lg = lg;
+    conn->fd = sockfd;
+    __lg_nodelay(sockfd);
+    if(lg->server_ctx)
+    {
+        conn->ssl = SSL_new(lg->server_ctx);
+        if(!conn->ssl || !SSL_set_fd(conn->ssl, sockfd))
+        {
+            __lg_close(conn);
+            free(conn);
+            return NULL;
+        }
+    }
+
+    return conn;
+}
+
+static void __lg_server_read(struct __lg_conn *conn)
+{
+    struct poller_data data;
+
+    __lg_read_data(conn, &data);
+    if(poller_add(&data, -1, conn->lg->server) < 0)
+    {
+        __lg_close(conn);
+        free(conn);
+    }
+}
+
+/* The client sends nothing more until it has every reply of its burst, so
+ * no request bytes are left behind when the read node is replaced. */
+static void __lg_server_write(struct __lg_conn *conn)
+{
+    struct __lg *lg = conn->lg;
+    struct poller_data data;
+
+    __lg_write_data(conn, lg->reply, lg->reply_len, &data);
+    if(poller_mod(&data, -1, lg->server) < 0)
+        poller_del(conn->fd, lg->server);
+}
+
+static void __lg_server_request(struct __lg_conn *conn)
+{
+    if(++conn->pending == conn->lg->depth)
+    {
+        conn->pending = 0;
+        __lg_server_write(conn);
+    }
+}
+
+static void __lg_server_start(struct __lg_conn *conn)
+{
+    struct poller_data data;
+
+    if(!conn->ssl)
+    {
+        __lg_server_read(conn);
+        return;
+    }
+
+    memset(&data, 0, sizeof (struct poller_data));
+    data.operation = PD_OP_SSL_ACCEPT;
+    data.fd = conn->fd;
+    data.ssl = conn->ssl;
+    data.context = conn;
+    if(poller_add(&data, 10000, conn->lg->server) < 0)
+    {
+        __lg_close(conn);
+        free(conn);
+    }
+}
+
+static void __lg_server_callback(struct poller_result *res, void *context)
+{
+    struct __lg *lg = (struct __lg *)context;
+    struct __lg_conn *conn = (struct __lg_conn *)res->data.context;
+
+    if(res->data.operation == PD_OP_LISTEN)
+    {
+        if(res->state == PR_ST_SUCCESS)
+            __lg_server_start((struct __lg_conn *)res->data.result);
+    }
+    else if(res->state == PR_ST_SUCCESS)
+        __lg_server_request(conn);
+    else if(res->state == PR_ST_FINISHED)
+        __lg_server_read(conn);
+    else if(res->state != PR_ST_MODIFIED)
+    {
+        __lg_close(conn);
+        free(conn);
+    }
+
+    poller_free_result(res, lg->server);
+}
+
+/* Client side. */
+
+static void __lg_client_write(struct __lg_conn *conn, int mod)
+{
+    struct __lg *lg = conn->lg;
+    struct poller_data data;
+    int ret;
+
+    conn->pending = lg->depth;
+    conn->sent_at = __lg_now();
+    __lg_write_data(conn, lg->request, lg->request_len, &data);
+    if(mod)
+        ret = poller_mod(&data, -1, lg->client);
+    else
+        ret = poller_add(&data, -1, lg->client);
+
+    if(ret < 0)
+    {
+        __atomic_add_fetch(&lg->errors, 1, __ATOMIC_RELAXED);
+        __lg_close(conn);
+    }
+}
+
+static void __lg_client_read(struct __lg_conn *conn)
+{
+    struct poller_data data;
+
+    __lg_read_data(conn, &data);
+    if(poller_add(&data, -1, conn->lg->client) < 0)
+    {
+        __atomic_add_fetch(&conn->lg->errors, 1, __ATOMIC_RELAXED);
+        __lg_close(conn);
+    }
+}
+
+static void __lg_client_ready(struct __lg_conn *conn)
+{
+    __atomic_add_fetch(&conn->lg->connected, 1, __ATOMIC_RELEASE);
+    __lg_client_write(conn, 0);
+}
+
+static void __lg_client_connected(struct __lg_conn *conn)
+{
+    struct __lg *lg = conn->lg;
+    struct poller_data data;
+
+    if(!lg->client_ctx)
+    {
+        __lg_client_ready(conn);
+        return;
+    }
+
+    conn->ssl = SSL_new(lg->client_ctx);
+    memset(&data, 0, sizeof (struct poller_data));
+    data.operation = PD_OP_SSL_CONNECT;
+    data.fd = conn->fd;
+    data.ssl = conn->ssl;
+    data.context = conn;
+    if(!conn->ssl || !SSL_set_fd(conn->ssl, conn->fd) ||
+        poller_add(&data, 10000, lg->client) < 0)
+    {
+        __atomic_add_fetch(&lg->failed, 1, __ATOMIC_RELEASE);
+        __lg_close(conn);
+    }
+}
+
+static void __lg_client_response(struct __lg_conn *conn)
+{
+    struct __lg *lg = conn->lg;
+    double us;
+
+    if(__atomic_load_n(&lg->measuring, __ATOMIC_RELAXED))
+    {
+        us = (__lg_now() - conn->sent_at) * 1e6;
+        lg->hist[__lg_hist_index(us)]++;
+        lg->responses++;
+    }
+
+    if(--conn->pending == 0)
+        __lg_client_write(conn, 1);
+}
+
+static void __lg_client_callback(struct poller_result *res, void *context)
+{
+    struct __lg *lg = (struct __lg *)context;
+    struct __lg_conn *conn = (struct __lg_conn *)res->data.context;
+
+    switch(res->state)
+    {
+        case PR_ST_SUCCESS:
+            __lg_client_response(conn);
+            break;
+        case PR_ST_FINISHED:
+            if(res->data.operation == PD_OP_CONNECT)
+                __lg_client_connected(conn);
+            else if(res->data.operation == PD_OP_SSL_CONNECT)
+                __lg_client_ready(conn);
+            else if(res->data.operation == PD_OP_WRITE)
+                __lg_client_read(conn);
+            else
+            {
+                __atomic_add_fetch(&lg->errors, 1, __ATOMIC_RELAXED);
+                __lg_close(conn);
+            }
+            break;
+        case PR_ST_ERROR:
+            if(res->data.operation == PD_OP_CONNECT ||
+                res->data.operation == PD_OP_SSL_CONNECT)
+                __atomic_add_fetch(&lg->failed, 1, __ATOMIC_RELEASE);
+            else
+                __atomic_add_fetch(&lg->errors, 1, __ATOMIC_RELAXED);
+
+            __lg_close(conn);
+            break;
+    }
+
+    poller_free_result(res, lg->client);
+}
+
+static int __lg_connect(struct __lg_conn *conn, const struct sockaddr_in *addr, int i)
+{
+    struct poller_data data;
+    struct sockaddr_in src;
+    int one = 1;
+
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(conn->fd < 0)
+        return -1;
+
+    __lg_nodelay(conn->fd);
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    /* Spread the connections over 127.0.0.1-64 so that 100k of them do not
+     * run out of ephemeral ports towards one address. */
+    memset(&src, 0, sizeof src);
+    src.sin_family = AF_INET;
+    src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + i % 64);
+    setsockopt(conn->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof one);
+    bind(conn->fd, (struct sockaddr *)&src, sizeof src);
+#endif
+
+    if(connect(conn->fd, (const struct sockaddr *)addr, sizeof *addr) == 0)
+    {
+        __lg_client_connected(conn);
+        return 0;
+    }
+
+    if(errno != EINPROGRESS)
+        return -1;
+
+    memset(&data, 0, sizeof (struct poller_data));
+    data.operation = PD_OP_CONNECT;
+    data.fd = conn->fd;
+    data.context = conn;
+    return poller_add(&data, 30000, conn->lg->client);
+}
+
+static SSL_CTX *__lg_server_ssl_ctx(void)
+{
+    EVP_PKEY *pkey = EVP_EC_gen("P-256");
+    X509 *x509 = X509_new();
+    SSL_CTX *ctx = NULL;
+    X509_NAME *name;
+
+    if(pkey && x509)
+    {
+        ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+        X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+        X509_gmtime_adj(X509_getm_notAfter(x509), 86400);
+        X509_set_pubkey(x509, pkey);
+        name = X509_get_subject_name(x509);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                   (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(x509, name);
+        if(X509_sign(x509, pkey, EVP_sha256()))
+        {
+            ctx = SSL_CTX_new(TLS_server_method());
+            if(ctx && (!SSL_CTX_use_certificate(ctx, x509) ||
+                       !SSL_CTX_use_PrivateKey(ctx, pkey)))
+            {
+                SSL_CTX_free(ctx);
+                ctx = NULL;
+            }
+        }
+    }
+
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+    return ctx;
+}
+
+static int __lg_listen(struct __lg *lg, struct sockaddr_in *addr)
+{
+    socklen_t addrlen = sizeof *addr;
+    struct poller_data data;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(addr, 0, sizeof *addr);
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(fd < 0 || bind(fd, (struct sockaddr *)addr, sizeof *addr) < 0 ||
+        getsockname(fd, (struct sockaddr *)addr, &addrlen) < 0 ||
+        listen(fd, 65535) < 0)
+        return -1;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    memset(&data, 0, sizeof (struct poller_data));
+    data.operation = PD_OP_LISTEN;
+    data.fd = fd;
+    data.accept = __lg_accept;
+    data.context = lg;
+    return poller_add(&data, -1, lg->server);
+}
+
+int main(int argc, char *argv[])
+{
+    struct poller_params params = { };
+    struct sockaddr_in addr;
+    struct rlimit rl;
+    double warmup = 2;
+    double seconds = 10;
+    double begin, end;
+    struct __lg lg;
+    int tls = 0;
+    int c;
+    int i;
+
+    memset(&lg, 0, sizeof lg);
+    lg.nconns = 100;
+    lg.size = 64;
+    lg.depth = 1;
+    while((c = getopt(argc, argv, "c:s:d:w:T:t")) != -1)
+    {
+        switch(c)
+        {
+            case 'c': lg.nconns = atoi(optarg); break;
+            case 's': lg.size = strtoul(optarg, NULL, 10); break;
+            case 'd': lg.depth = atoi(optarg); break;
+            case 'w': warmup = atof(optarg); break;
+            case 'T': seconds = atof(optarg); break;
+            case 't': tls = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-c conns] [-s size] [-d depth] "
+                                "[-w warmup] [-T seconds] [-t]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if(lg.nconns < 1 || lg.depth < 1)
+        return 1;
+
+    /* Both ends of every connection live in this process. */
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if(rl.rlim_cur < 2 * (rlim_t)lg.nconns + 64)
+    {
+        fprintf(stderr, "RLIMIT_NOFILE %llu is too low for %d connections\n",
+                (unsigned long long)rl.rlim_cur, lg.nconns);
+        return 1;
+    }
+
+    lg.request_len = (4 + lg.size) * lg.depth;
+    lg.reply_len = lg.request_len;
+    lg.request = (char *)malloc(lg.request_len);
+    lg.reply = (char *)malloc(lg.reply_len);
+    lg.conns = (struct __lg_conn *)calloc(lg.nconns, sizeof (struct __lg_conn));
+    if(!lg.request || !lg.reply || !lg.conns)
+        return 1;
+
+    for(i = 0; i < lg.depth; i++)
+    {
+        __lg_frame(lg.request + i * (4 + lg.size), lg.size);
+        __lg_frame(lg.reply + i * (4 + lg.size), lg.size);
+    }
+
+    if(tls)
+    {
+        lg.server_ctx = __lg_server_ssl_ctx();
+        lg.client_ctx = SSL_CTX_new(TLS_client_method());
+        if(!lg.server_ctx || !lg.client_ctx)
+        {
+            ERR_print_errors_fp(stderr);
+            return 1;
+        }
+    }
+
+    params.max_open_files = rl.rlim_cur;
+    params.context = &lg;
+    params.callback = __lg_server_callback;
+    lg.server = poller_create(&params);
+    params.callback = __lg_client_callback;
+    lg.client = poller_create(&params);
+    if(!lg.server || !lg.client || __lg_listen(&lg, &addr) < 0 ||
+        poller_start(lg.server) < 0 || poller_start(lg.client) < 0)
+    {
+        perror("setup");
+        return 1;
+    }
+
+    for(i = 0; i < lg.nconns; i++)
+    {
+        lg.conns[i].lg = &lg;
+        lg.conns[i].fd = -1;
+        if(__lg_connect(&lg.conns[i], &addr, i) < 0)
+        {
+            __atomic_add_fetch(&lg.failed, 1, __ATOMIC_RELEASE);
+            __lg_close(&lg.conns[i]);
+        }
+    }
+
+    begin = __lg_now();
+    while(__atomic_load_n(&lg.connected, __ATOMIC_ACQUIRE) +
+          __atomic_load_n(&lg.failed, __ATOMIC_ACQUIRE) < lg.nconns &&
+          __lg_now() - begin < 60)
+        usleep(10000);
+
+    printf("%d connected, %d failed in %.2fs\n", lg.connected, lg.failed,
+           __lg_now() - begin);
+
+    usleep(warmup * 1e6);
+    __atomic_store_n(&lg.measuring, 1, __ATOMIC_RELAXED);
+    begin = __lg_now();
+    usleep(seconds * 1e6);
+    __atomic_store_n(&lg.measuring, 0, __ATOMIC_RELAXED);
+    end = __lg_now();
+
+    poller_stop(lg.client);
+    poller_stop(lg.server);
+
+    printf("conns %d size %zu depth %d tls %s\n", lg.connected, lg.size,
+           lg.depth, tls ? "on" : "off");
+    printf("%.0f req/s, %.1f MB/s each way, %llu errors\n",
+           lg.responses / (end - begin),
+           lg.responses * (4.0 + lg.size) / (end - begin) / 1e6, lg.errors);
+    printf("latency us: p50 %.0f  p99 %.0f  p999 %.0f\n",
+           __lg_percentile(&lg, 0.5), __lg_percentile(&lg, 0.99),
+           __lg_percentile(&lg, 0.999));
+
+    for(i = 0; i < lg.nconns; i++)
+        __lg_close(&lg.conns[i]);
+
+    poller_destroy(lg.client);
+    poller_destroy(lg.server);
+    SSL_CTX_free(lg.server_ctx);
+    SSL_CTX_free(lg.client_ctx);
+    free(lg.conns);
+    free(lg.request);
+    free(lg.reply);
+    return 0;
+}
@@ -0,0 +1,423 @@
+// Microbenchmarks for the poller hot paths:
+//
+//   add_del, add_del/Nt   poller_add() + poller_del(), 1 and N threads
+//   mod, set_timeout      poller_mod() and poller_set_timeout() on one fd
+//   timeo/<type>/<n>      poller_add_timer() + poller_del_timer(), n queued
+//   del_roundtrip         poller_del() until its callback has run
+//   list, slist           list.h primitives
+//
+//   cmake --build <build dir> --target poller_bench
+//   ./poller_bench [name filter]
+//
+// Every benchmark is warmed up, then timed as a series of samples; the
+// report gives ns/op at the minimum and at the 50th, 90th and 99th
+// percentile of the samples, so runs can be compared against a baseline
+// without being thrown off by a single noisy sample.
+//
+// The fds are eventfds that are never signalled, so nodes stay idle until
+// they are deleted.
+//
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "list.h"
+#include "poller.h"
+
+#define BENCH_WARMUP    20
+#define BENCH_SAMPLES   200
+#define BENCH_FDS       1024
+#define BENCH_THREADS   4
+
+struct __bench
+{
+    poller_t *poller;
+    int fds[BENCH_FDS];
+    size_t nfds;
+    volatile int deleted;
+};
+
+typedef void (*__bench_fn)(struct __bench *, size_t, void *);
+
+static const char *__bench_filter;
+
+static double __bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int __bench_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Runs fn() for 'ops' operations per sample and reports ns per operation. */
+static void __bench_run(const char *name, __bench_fn fn, struct __bench *bench,
+                        size_t ops, int samples, void *arg)
+{
+    double *ns;
+    double t;
+    int i;
+
+    if(__bench_filter && !strstr(name, __bench_filter))
+        return;
+
+    ns = (double *)malloc(samples * sizeof (double));
+    if(!ns)
+        return;
+
+    for(i = 0; i < BENCH_WARMUP; i++)
+        fn(bench, ops, arg);
+
+    for(i = 0; i < samples; i++)
+    {
+        t = __bench_now();
+        fn(bench, ops, arg);
+        ns[i] = (__bench_now() - t) / ops;
+    }
+
+    qsort(ns, samples, sizeof (double), __bench_cmp);
+    printf("%-22s min %9.1f  p50 %9.1f  p90 %9.1f  p99 %9.1f  ns/op\n", name,
+           ns[0], ns[samples / 2], ns[samples * 9 / 10], ns[samples * 99 / 100]);
+    free(ns);
+}
+
+static void __bench_callback(struct poller_result *res, void *context)
+{
+    struct __bench *bench = (struct __bench *)context;
+
+    if(res->state == PR_ST_DELETED)
+        __atomic_store_n(&bench->deleted, 1, __ATOMIC_RELEASE);
+
+    poller_free_result(res, bench->poller);
+}
+
+static void *__bench_event(void *context)
+{
+    return NULL;
+}
+
+static void __bench_data(int fd, struct poller_data *data)
+{
+    memset(data, 0, sizeof (struct poller_data));
+    data->operation = PD_OP_EVENT;
+    data->fd = fd;
+    data->event = __bench_event;
+}
+
+/* Operations on fds [begin, end) of the bench. */
+struct __bench_range
+{
+    struct __bench *bench;
+    size_t begin;
+    size_t end;
+    size_t ops;
+    pthread_barrier_t *barrier;
+};
+
+static void __bench_add_del_range(struct __bench *bench, size_t ops, size_t begin, size_t end)
+{
+    struct poller_data data;
+    size_t i;
+
+    for(i = 0; i < ops; i++)
+    {
+        __bench_data(bench->fds[begin + i % (end - begin)], &data);
+        poller_add(&data, -1, bench->poller);
+        poller_del(data.fd, bench->poller);
+    }
+}
+
+static void __bench_add_del(struct __bench *bench, size_t ops, void *arg)
+{
+    __bench_add_del_range(bench, ops, 0, bench->nfds);
+}
+
+static void *__bench_add_del_routine(void *arg)
+{
+    struct __bench_range *range = (struct __bench_range *)arg;
+
+    pthread_barrier_wait(range->barrier);
+    __bench_add_del_range(range->bench, range->ops, range->begin, range->end);
+    return NULL;
+}
+
+/* Aggregate throughput: 'ops' is split over the threads. */
+static void __bench_add_del_mt(struct __bench *bench, size_t ops, void *arg)
+{
+    int nthreads = *(int *)arg;
+    struct __bench_range ranges[BENCH_THREADS];
+    pthread_t tids[BENCH_THREADS];
+    pthread_barrier_t barrier;
+    size_t per = bench->nfds / nthreads;
+    int i;
+
+    pthread_barrier_init(&barrier, NULL, nthreads);
+    for(i = 0; i < nthreads; i++)
+    {
+        ranges[i].bench = bench;
+        ranges[i].begin = i * per;
+        ranges[i].end = (i + 1) * per;
+        ranges[i].ops = ops / nthreads;
+        ranges[i].barrier = &barrier;
+        pthread_create(&tids[i], NULL, __bench_add_del_routine, &ranges[i]);
+    }
+
+    for(i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+
+    pthread_barrier_destroy(&barrier);
+}
+
+static void __bench_mod(struct __bench *bench, size_t ops, void *arg)
+{
+    struct poller_data data;
+    size_t i;
+
+    __bench_data(bench->fds[0], &data);
+    for(i = 0; i < ops; i++)
+        poller_mod(&data, i & 1 ? 1000 : -1, bench->poller);
+}
+
+static void __bench_set_timeout(struct __bench *bench, size_t ops, void *arg)
+{
+    size_t i;
+
+    for(i = 0; i < ops; i++)
+        poller_set_timeout(bench->fds[0], 1000 + i % 1000, bench->poller);
+}
+
+static void __bench_del_roundtrip(struct __bench *bench, size_t ops, void *arg)
+{
+    struct poller_data data;
+    size_t i;
+
+    __bench_data(bench->fds[0], &data);
+    for(i = 0; i < ops; i++)
+    {
+        if(poller_add(&data, -1, bench->poller) < 0)
+        {
+            perror("del_roundtrip");
+            exit(1);
+        }
+
+        __atomic_store_n(&bench->deleted, 0, __ATOMIC_RELAXED);
+        if(poller_del(data.fd, bench->poller) < 0)
+        {
+            perror("del_roundtrip");
+            exit(1);
+        }
+
+        while(!__atomic_load_n(&bench->deleted, __ATOMIC_ACQUIRE))
+            ;
+    }
+}
+
+/*
+ * Timers on a poller that is not started. poller_del_timer() then runs the
+ * callback in the caller, so an operation is the timer insert and erase
+ * plus one node allocation, with 'n' timers queued.
+ */
+struct __bench_timeo
+{
+    poller_t *poller;
+    void **timers;
+    size_t n;
+    unsigned int seed;
+};
+
+static int __bench_timeo_add(struct __bench_timeo *timeo, void **timer)
+{
+    long ms = 30000 + rand_r(&timeo->seed) % 60000;
+    struct timespec value = {
+        .tv_sec     = ms / 1000,
+        .tv_nsec    = ms % 1000 * 1000000,
+    };
+
+    return poller_add_timer(&value, NULL, timer, timeo->poller);
+}
+
+static void __bench_timeo(struct __bench *bench, size_t ops, void *arg)
+{
+    struct __bench_timeo *timeo = (struct __bench_timeo *)arg;
+    void **timer;
+    size_t i;
+
+    for(i = 0; i < ops; i++)
+    {
+        timer = &timeo->timers[rand_r(&timeo->seed) % timeo->n];
+        poller_del_timer(*timer, timeo->poller);
+        if(__bench_timeo_add(timeo, timer) < 0)
+        {
+            perror("timeouts");
+            exit(1);
+        }
+    }
+}
+
+static void __bench_timeo_callback(struct poller_result *res, void *context)
+{
+    struct __bench_timeo *timeo = (struct __bench_timeo *)context;
+
+    poller_free_result(res, timeo->poller);
+}
+
+static void __bench_timeouts(int timeo_type, size_t n)
+{
+    struct poller_params params = {
+        .max_open_files = 16,
+        .callback       = __bench_timeo_callback,
+        .timeo_type     = timeo_type,
+    };
+    struct __bench_timeo timeo;
+    char name[64];
+    size_t i;
+
+    snprintf(name, sizeof name, "timeo/%s/%zu",
+             timeo_type == POLLER_TIMEO_WHEEL ? "wheel" : "rbtree", n);
+    if(__bench_filter && !strstr(name, __bench_filter))
+        return;
+
+    params.context = &timeo;
+    timeo.poller = poller_create(&params);
+    timeo.timers = (void **)malloc(n * sizeof (void *));
+    timeo.n = n;
+    timeo.seed = 1;
+    if(!timeo.poller || !timeo.timers)
+    {
+        perror("timeouts");
+        exit(1);
+    }
+
+    for(i = 0; i < n; i++)
+    {
+        if(__bench_timeo_add(&timeo, &timeo.timers[i]) < 0)
+        {
+            perror("timeouts");
+            exit(1);
+        }
+    }
+
+    __bench_run(name, __bench_timeo, NULL, 1000, BENCH_SAMPLES, &timeo);
+    for(i = 0; i < n; i++)
+        poller_del_timer(timeo.timers[i], timeo.poller);
+
+    free(timeo.timers);
+    poller_destroy(timeo.poller);
+}
+
+struct __bench_item
+{
+    struct list_head list;
+    struct slist_node slist;
+};
+
+static void __bench_list(struct __bench *bench, size_t ops, void *arg)
+{
+    struct __bench_item *items = (struct __bench_item *)arg;
+    size_t i;
+
+    LIST_HEAD(head);
+
+    for(i = 0; i < ops; i++)
+        list_add_tail(&items[i].list, &head);
+
+    for(i = 0; i < ops; i++)
+        list_del(&items[i].list);
+}
+
+static void __bench_slist(struct __bench *bench, size_t ops, void *arg)
+{
+    struct __bench_item *items = (struct __bench_item *)arg;
+    size_t i;
+
+    SLIST_HEAD(head);
+
+    for(i = 0; i < ops; i++)
+        slist_add_tail(&items[i].slist, &head);
+
+    for(i = 0; i < ops; i++)
+        slist_del_head(&head);
+}
+
+int main(int argc, char *argv[])
+{
+    struct poller_params params = {
+        .max_open_files = 65536,
+        .callback       = __bench_callback,
+    };
+    static const size_t sizes[] = { 10000, 100000, 1000000 };
+    struct __bench_item *items;
+    struct __bench bench;
+    char name[32];
+    int nthreads;
+    int fd;
+    size_t i;
+
+    __bench_filter = argc > 1 ? argv[1] : NULL;
+    params.context = &bench;
+    bench.poller = poller_create(&params);
+    if(!bench.poller || poller_start(bench.poller) < 0)
+    {
+        perror("poller");
+        exit(1);
+    }
+
+    for(bench.nfds = 0; bench.nfds < BENCH_FDS; bench.nfds++)
+    {
+        fd = eventfd(0, EFD_NONBLOCK);
+        if(fd < 0)
+            break;
+
+        bench.fds[bench.nfds] = fd;
+    }
+
+    __bench_run("add_del", __bench_add_del, &bench, 1000, BENCH_SAMPLES, NULL);
+    for(nthreads = 2; nthreads <= BENCH_THREADS; nthreads *= 2)
+    {
+        snprintf(name, sizeof name, "add_del/%dt", nthreads);
+        __bench_run(name, __bench_add_del_mt, &bench, 8000, BENCH_SAMPLES / 4, &nthreads);
+    }
+
+    {
+        struct poller_data data;
+
+        __bench_data(bench.fds[0], &data);
+        poller_add(&data, -1, bench.poller);
+        __bench_run("mod", __bench_mod, &bench, 1000, BENCH_SAMPLES, NULL);
+        __bench_run("set_timeout", __bench_set_timeout, &bench, 1000, BENCH_SAMPLES, NULL);
+        poller_del(data.fd, bench.poller);
+    }
+
+    __bench_run("del_roundtrip", __bench_del_roundtrip, &bench, 1, 10000, NULL);
+
+    poller_stop(bench.poller);
+    poller_destroy(bench.poller);
+    for(i = 0; i < bench.nfds; i++)
+        close(bench.fds[i]);
+
+    for(i = 0; i < sizeof sizes / sizeof sizes[0]; i++)
+    {
+        __bench_timeouts(POLLER_TIMEO_RBTREE, sizes[i]);
+        __bench_timeouts(POLLER_TIMEO_WHEEL, sizes[i]);
+    }
+
+    items = (struct __bench_item *)malloc(1000 * sizeof (struct __bench_item));
+    if(items)
+    {
+        __bench_run("list", __bench_list, NULL, 1000, BENCH_SAMPLES, items);
+        __bench_run("slist", __bench_slist, NULL, 1000, BENCH_SAMPLES, items);
+        free(items);
+    }
+
+    return 0;
+}
@@ -0,0 +1,209 @@
+// PD_OP_SENDTO send path over loopback UDP: one sendto() per datagram vs.
+// PD_OP_SENDTO nodes, whose datagrams go out in sendmmsg() batches, or in
+// UDP GSO runs when consecutive datagrams share their destination.
+//
+//   cmake --build <build dir> --target sendto_bench
+//   ./sendto_bench [datagrams] [payload]
+//
+// The sendmmsg case alternates between two receivers, so that no two
+// consecutive datagrams can form a GSO run; the gso case sends everything
+// to one. Each is preceded by plain sendto() calls with the same
+// destinations, as delivering to two sockets costs more than to one.
+// Each node carries BENCH_QUEUE datagrams and the callback adds the next
+// one. The receiving sockets are never read; the kernel drops what does
+// not fit in their buffers, which is fine since only the sender is
+// measured.
+//
+// Over loopback the receive side runs in the sender's syscall and costs
+// far more than the syscall itself, so sendmmsg() is only about even with
+// sendto() there; it wins where the syscall is a large part of the cost
+// of a datagram, as with small datagrams sent out of a NIC. Try a small
+// payload to see the gap open.
+//
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "poller.h"
+
+#define BENCH_QUEUE     1024
+
+struct __bench_sendto
+{
+    poller_t *poller;
+    int fd;
+    size_t left;
+    int done;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct msghdr msg[BENCH_QUEUE];
+    struct iovec iov[BENCH_QUEUE];
+};
+
+static double __bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void __bench_report(const char *name, size_t n, size_t bytes, double t)
+{
+    printf("%-9s %zu datagrams, %.1f ns/datagram, %.1f MB/s\n",
+           name, n, t * 1e9 / n, bytes / t / 1e6);
+}
+
+static int __bench_partial_written(size_t n, void *context)
+{
+    return 0;
+}
+
+/* Queues the next node: 1 if added, 0 once everything is sent, -1 on
+ * error. */
+static int __bench_next(struct __bench_sendto *bench)
+{
+    struct poller_data data;
+    size_t cnt = bench->left < BENCH_QUEUE ? bench->left : BENCH_QUEUE;
+
+    if(cnt == 0)
+        return 0;
+
+    bench->left -= cnt;
+    memset(&data, 0, sizeof (struct poller_data));
+    data.operation = PD_OP_SENDTO;
+    data.fd = bench->fd;
+    data.partial_written = __bench_partial_written;
+    data.context = bench;
+    data.write_msg = bench->msg;
+    data.iovcnt = cnt;
+    if(poller_add(&data, -1, bench->poller) < 0)
+    {
+        perror("poller_add");
+        return -1;
+    }
+
+    return 1;
+}
+
+static void __bench_callback(struct poller_result *res, void *context)
+{
+    struct __bench_sendto *bench = (struct __bench_sendto *)context;
+    int finished = res->state == PR_ST_FINISHED;
+
+    if(!finished)
+        fprintf(stderr, "sendto node: state %d error %d\n", res->state, res->error);
+
+    poller_free_result(res, bench->poller);
+    if(!finished || __bench_next(bench) <= 0)
+    {
+        pthread_mutex_lock(&bench->mutex);
+        bench->done = 1;
+        pthread_cond_signal(&bench->cond);
+        pthread_mutex_unlock(&bench->mutex);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t payload = argc > 2 ? strtoul(argv[2], NULL, 10) : 1200;
+    static struct __bench_sendto bench;
+    struct poller_params params = {
+        .max_open_files = 16,
+        .callback       = __bench_callback,
+        .context        = &bench,
+    };
+    struct sockaddr_in addr[2];
+    socklen_t addrlen = sizeof (struct sockaddr_in);
+    size_t sent;
+    char *buf;
+    double t;
+    int pass;
+    int rfd[2];
+    int i;
+
+    pthread_mutex_init(&bench.mutex, NULL);
+    pthread_cond_init(&bench.cond, NULL);
+    bench.poller = poller_create(&params);
+    buf = (char *)malloc(payload);
+    rfd[0] = socket(AF_INET, SOCK_DGRAM, 0);
+    rfd[1] = socket(AF_INET, SOCK_DGRAM, 0);
+    bench.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(!bench.poller || !buf || rfd[0] < 0 || rfd[1] < 0 || bench.fd < 0 ||
+        poller_start(bench.poller) < 0)
+    {
+        perror("setup");
+        exit(1);
+    }
+
+    memset(buf, 'x', payload);
+    for(i = 0; i < 2; i++)
+    {
+        memset(&addr[i], 0, sizeof (struct sockaddr_in));
+        addr[i].sin_family = AF_INET;
+        addr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if(bind(rfd[i], (struct sockaddr *)&addr[i], addrlen) < 0 ||
+            getsockname(rfd[i], (struct sockaddr *)&addr[i], &addrlen) < 0)
+        {
+            perror("bind");
+            exit(1);
+        }
+    }
+
+    for(i = 0; i < BENCH_QUEUE; i++)
+    {
+        bench.iov[i].iov_base = buf;
+        bench.iov[i].iov_len = payload;
+        bench.msg[i].msg_namelen = addrlen;
+        bench.msg[i].msg_iov = &bench.iov[i];
+        bench.msg[i].msg_iovlen = 1;
+    }
+
+    /* Pass 0 alternates destinations, pass 1 sends to one. */
+    for(pass = 0; pass < 2; pass++)
+    {
+        for(i = 0; i < BENCH_QUEUE; i++)
+            bench.msg[i].msg_name = &addr[pass ? 0 : i % 2];
+
+        t = __bench_now();
+        for(sent = 0; sent < n; sent++)
+        {
+            if(sendto(bench.fd, buf, payload, 0,
+                      (struct sockaddr *)&addr[pass ? 0 : sent % 2], addrlen) < 0)
+            {
+                perror("sendto");
+                exit(1);
+            }
+        }
+
+        __bench_report("sendto", n, n * payload, __bench_now() - t);
+        bench.left = n;
+        bench.done = 0;
+        t = __bench_now();
+        if(__bench_next(&bench) < 0)
+            exit(1);
+
+        /* Sleep rather than poll, not to take turns with the poller thread. */
+        pthread_mutex_lock(&bench.mutex);
+        while(!bench.done)
+            pthread_cond_wait(&bench.cond, &bench.mutex);
+        pthread_mutex_unlock(&bench.mutex);
+
+        __bench_report(pass ? "gso" : "sendmmsg", n, n * payload, __bench_now() - t);
+    }
+
+    poller_stop(bench.poller);
+    close(bench.fd);
+    close(rfd[0]);
+    close(rfd[1]);
+    free(buf);
+    poller_destroy(bench.poller);
+    return 0;
+}
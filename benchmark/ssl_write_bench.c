@@ -0,0 +1,295 @@
+// TLS write path of PD_OP_WRITE: one SSL_write() per iovec
+// (poller_params.ssl_gather_off) vs. iovecs gathered into record-sized
+// writes, over a socketpair.
+//
+//   cmake --build <build dir> --target ssl_write_bench
+//   ./ssl_write_bench [responses] [chunks] [chunk size]
+//
+// A response is a 256-byte header followed by 'chunks' body chunks, sent
+// by one PD_OP_WRITE node; the callback adds the node of the next one.
+// The peer completes the handshake, then reads the raw stream and counts
+// TLS records without decrypting them, so the count includes the handful
+// of post-handshake records (session tickets) as well.
+//
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include "poller.h"
+
+#define BENCH_HEADER    256
+
+struct __bench_peer
+{
+    SSL_CTX *ctx;
+    int fd;
+    size_t records;
+    size_t bytes;
+};
+
+struct __bench_writer
+{
+    poller_t *poller;
+    SSL *ssl;
+    int fd;
+    const struct iovec *tmpl;
+    struct iovec *iov;
+    int iovcnt;
+    size_t left;
+    size_t total;
+    int done;
+};
+
+static double __bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static SSL_CTX *__bench_server_ctx(void)
+{
+    EVP_PKEY *pkey = EVP_EC_gen("P-256");
+    X509 *x509 = X509_new();
+    SSL_CTX *ctx = NULL;
+
+    if(pkey && x509)
+    {
+        ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+        X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+        X509_gmtime_adj(X509_getm_notAfter(x509), 86400);
+        X509_set_pubkey(x509, pkey);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN", MBSTRING_ASC,
+                                   (const unsigned char *)"bench", -1, -1, 0);
+        X509_set_issuer_name(x509, X509_get_subject_name(x509));
+        if(X509_sign(x509, pkey, EVP_sha256()))
+        {
+            ctx = SSL_CTX_new(TLS_server_method());
+            if(ctx && (!SSL_CTX_use_certificate(ctx, x509) ||
+                       !SSL_CTX_use_PrivateKey(ctx, pkey)))
+            {
+                SSL_CTX_free(ctx);
+                ctx = NULL;
+            }
+        }
+    }
+
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+    return ctx;
+}
+
+/* Handshake as the client, then walk the raw record headers to EOF. */
+static void *__bench_peer_routine(void *arg)
+{
+    struct __bench_peer *peer = (struct __bench_peer *)arg;
+    SSL *ssl = SSL_new(peer->ctx);
+    unsigned char hdr[5];
+    size_t need = 0;
+    size_t got = 0;
+    char buf[65536];
+    ssize_t n;
+    ssize_t i;
+
+    SSL_set_fd(ssl, peer->fd);
+    if(SSL_connect(ssl) <= 0)
+    {
+        fprintf(stderr, "SSL_connect failed\n");
+        exit(1);
+    }
+
+    while((n = read(peer->fd, buf, sizeof buf)) > 0)
+    {
+        peer->bytes += n;
+        for(i = 0; i < n; )
+        {
+            if(need > 0)
+            {
+                if((size_t)(n - i) < need)
+                {
+                    need -= n - i;
+                    break;
+                }
+
+                i += need;
+                need = 0;
+            }
+            else
+            {
+                hdr[got++] = buf[i++];
+                if(got == 5)
+                {
+                    need = (hdr[3] << 8) | hdr[4];
+                    peer->records++;
+                    got = 0;
+                }
+            }
+        }
+    }
+
+    SSL_free(ssl);
+    return NULL;
+}
+
+static int __bench_partial_written(size_t n, void *context)
+{
+    return 0;
+}
+
+/* Adds the node of the next response: 1 if added, 0 once all are sent,
+ * -1 on error. */
+static int __bench_next(struct __bench_writer *w)
+{
+    struct poller_data data;
+    int i;
+
+    if(w->left == 0)
+        return 0;
+
+    w->left--;
+    memcpy(w->iov, w->tmpl, w->iovcnt * sizeof (struct iovec));
+    for(i = 0; i < w->iovcnt; i++)
+        w->total += w->iov[i].iov_len;
+
+    memset(&data, 0, sizeof (struct poller_data));
+    data.operation = PD_OP_WRITE;
+    data.fd = w->fd;
+    data.ssl = w->ssl;
+    data.partial_written = __bench_partial_written;
+    data.context = w;
+    data.write_iov = w->iov;
+    data.iovcnt = w->iovcnt;
+    if(poller_add(&data, -1, w->poller) < 0)
+    {
+        perror("poller_add");
+        return -1;
+    }
+
+    return 1;
+}
+
+static void __bench_callback(struct poller_result *res, void *context)
+{
+    struct __bench_writer *w = (struct __bench_writer *)context;
+    int finished = res->state == PR_ST_FINISHED;
+
+    if(!finished)
+        fprintf(stderr, "write node: state %d error %d\n", res->state, res->error);
+
+    poller_free_result(res, w->poller);
+    if(!finished || __bench_next(w) <= 0)
+        __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+}
+
+static void __bench_run(int gather, size_t responses, int chunks, size_t chunk,
+                        SSL_CTX *server_ctx, SSL_CTX *client_ctx)
+{
+    struct __bench_writer w;
+    struct poller_params params = {
+        .max_open_files = 16,
+        .callback       = __bench_callback,
+        .context        = &w,
+        .ssl_gather_off = !gather,
+    };
+    struct iovec *tmpl = (struct iovec *)malloc((chunks + 1) * sizeof (struct iovec));
+    struct iovec *iov = (struct iovec *)malloc((chunks + 1) * sizeof (struct iovec));
+    char *body = (char *)malloc(BENCH_HEADER + chunk);
+    struct __bench_peer peer;
+    pthread_t tid;
+    SSL *ssl;
+    double t;
+    int fds[2];
+    int i;
+
+    memset(&w, 0, sizeof w);
+    w.poller = poller_create(&params);
+    if(!w.poller || !tmpl || !iov || !body ||
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0 || poller_start(w.poller) < 0)
+    {
+        perror("setup");
+        exit(1);
+    }
+
+    memset(body, 'x', BENCH_HEADER + chunk);
+    tmpl[0].iov_base = body;
+    tmpl[0].iov_len = BENCH_HEADER;
+    for(i = 1; i <= chunks; i++)
+    {
+        tmpl[i].iov_base = body + BENCH_HEADER;
+        tmpl[i].iov_len = chunk;
+    }
+
+    memset(&peer, 0, sizeof peer);
+    peer.ctx = client_ctx;
+    peer.fd = fds[1];
+    pthread_create(&tid, NULL, __bench_peer_routine, &peer);
+
+    ssl = SSL_new(server_ctx);
+    SSL_set_fd(ssl, fds[0]);
+    if(SSL_accept(ssl) <= 0)
+    {
+        fprintf(stderr, "SSL_accept failed\n");
+        exit(1);
+    }
+
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    w.ssl = ssl;
+    w.fd = fds[0];
+    w.tmpl = tmpl;
+    w.iov = iov;
+    w.iovcnt = chunks + 1;
+    w.left = responses;
+    t = __bench_now();
+    if(__bench_next(&w) < 0)
+        exit(1);
+
+    while(!__atomic_load_n(&w.done, __ATOMIC_ACQUIRE))
+        usleep(100);
+
+    shutdown(fds[0], SHUT_WR);
+    pthread_join(tid, NULL);
+    t = __bench_now() - t;
+
+    printf("%-8s %zu responses, %.2f records/response, %.1f wire bytes/response, "
+           "%.1f MB/s\n", gather ? "gather" : "per-iov", responses,
+           (double)peer.records / responses, (double)peer.bytes / responses,
+           w.total / t / 1e6);
+
+    poller_stop(w.poller);
+    SSL_free(ssl);
+    close(fds[0]);
+    close(fds[1]);
+    poller_destroy(w.poller);
+    free(body);
+    free(iov);
+    free(tmpl);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t responses = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    int chunks = argc > 2 ? atoi(argv[2]) : 16;
+    size_t chunk = argc > 3 ? strtoul(argv[3], NULL, 10) : 512;
+    SSL_CTX *server_ctx = __bench_server_ctx();
+    SSL_CTX *client_ctx = SSL_CTX_new(TLS_client_method());
+
+    if(!server_ctx || !client_ctx || chunks < 1)
+    {
+        fprintf(stderr, "setup failed\n");
+        return 1;
+    }
+
+    __bench_run(0, responses, chunks, chunk, server_ctx, client_ctx);
+    __bench_run(1, responses, chunks, chunk, server_ctx, client_ctx);
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(client_ctx);
+    return 0;
+}
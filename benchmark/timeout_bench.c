@@ -0,0 +1,141 @@
+// Timeout structure churn: rbtree + sorted list vs. timing wheel.
+//
+//   cmake --build <build dir> --target timeout_bench
+//   ./timeout_bench [nodes] [refreshes]
+//
+// Insert and refresh run on a poller that is not started yet, where
+// poller_del_timer() delivers the timer's result in the caller, so a
+// refresh is one poller_del_timer() plus one poller_add_timer(). Expiry
+// is measured by starting the poller with 'nodes' timers that are already
+// due, until the last of their results has been delivered.
+//
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "poller.h"
+
+struct __bench_timeo
+{
+    poller_t *poller;
+    unsigned int seed;
+    size_t expired;
+};
+
+static void __bench_callback(struct poller_result *res, void *context)
+{
+    struct __bench_timeo *timeo = (struct __bench_timeo *)context;
+
+    __atomic_add_fetch(&timeo->expired, 1, __ATOMIC_RELEASE);
+    poller_free_result(res, timeo->poller);
+}
+
+static double __bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Keepalive-like timeouts between 30s and 90s. */
+static void __bench_add(struct __bench_timeo *timeo, void **timer)
+{
+    long ms = 30000 + rand_r(&timeo->seed) % 60000;
+    struct timespec value = { ms / 1000, ms % 1000 * 1000000 };
+
+    if(poller_add_timer(&value, NULL, timer, timeo->poller) < 0)
+    {
+        perror("poller_add_timer");
+        exit(1);
+    }
+}
+
+static void __bench_run(int timeo_type, size_t n, size_t refreshes)
+{
+    struct __bench_timeo timeo = { };
+    struct poller_params params = {
+        .max_open_files = 16,
+        .callback       = __bench_callback,
+        .context        = &timeo,
+        .timeo_type     = timeo_type,
+    };
+    struct timespec due = { 0, 0 };
+    double t0, t1, t2, t3, t4, t5;
+    void **timers;
+    void **slot;
+    void *timer;
+    size_t i;
+
+    timeo.poller = poller_create(&params);
+    timeo.seed = 1;
+    timers = (void **)malloc(n * sizeof (void *));
+    if(!timeo.poller || !timers)
+    {
+        perror("setup");
+        exit(1);
+    }
+
+    t0 = __bench_now();
+    for(i = 0; i < n; i++)
+        __bench_add(&timeo, &timers[i]);
+
+    /* Every request refreshes the timeout of a random connection. */
+    t1 = __bench_now();
+    for(i = 0; i < refreshes; i++)
+    {
+        slot = &timers[rand_r(&timeo.seed) % n];
+        poller_del_timer(*slot, timeo.poller);
+        __bench_add(&timeo, slot);
+    }
+
+    t2 = __bench_now();
+    for(i = 0; i < n; i++)
+        poller_del_timer(timers[i], timeo.poller);
+
+    /* Expire everything in one pass of the poller thread. */
+    t3 = __bench_now();
+    timeo.expired = 0;
+    for(i = 0; i < n; i++)
+    {
+        if(poller_add_timer(&due, NULL, &timer, timeo.poller) < 0)
+        {
+            perror("poller_add_timer");
+            exit(1);
+        }
+    }
+
+    t4 = __bench_now();
+    if(poller_start(timeo.poller) < 0)
+    {
+        perror("poller_start");
+        exit(1);
+    }
+
+    while(__atomic_load_n(&timeo.expired, __ATOMIC_ACQUIRE) < n)
+        ;
+
+    t5 = __bench_now();
+    printf("%-7s n=%zu insert %.1f ns/op, refresh %.1f ns/op, delete %.1f ns/op, "
+           "expire %.1f ns/op\n",
+           timeo_type == POLLER_TIMEO_WHEEL ? "wheel" : "rbtree", n,
+           (t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / refreshes,
+           (t3 - t2) * 1e9 / n, (t5 - t4) * 1e9 / n);
+
+    poller_stop(timeo.poller);
+    poller_destroy(timeo.poller);
+    free(timers);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t refreshes = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000000;
+
+    if(n == 0 || refreshes == 0)
+        return 1;
+
+    __bench_run(POLLER_TIMEO_RBTREE, n, refreshes);
+    __bench_run(POLLER_TIMEO_WHEEL, n, refreshes);
+    return 0;
+}
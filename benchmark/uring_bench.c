@@ -0,0 +1,465 @@
+// Syscalls the poller thread makes per connection and per request, with
+// epoll and, in a POLLER_IO_URING build, with the io_uring backend with
+// and without uring_ops.
+//
+//   cmake --build <build dir> --target uring_bench
+//   ./uring_bench [connections] [rounds]
+//
+// The server runs in a child process traced with ptrace, which counts the
+// syscalls of each of its threads. Connections come in on a
+// PD_OP_LISTEN_BATCH node, whose hook adds a PD_OP_READ node for each;
+// every 64 byte request is echoed back with write() from the callback.
+// The client, a thread of the tracing process, opens all connections,
+// then for each round sends one request on every connection and reads
+// back every reply. The server calls getppid() to mark the end of each
+// phase; those calls are left out of the counts.
+//
+// Per connection covers accepting and adding its read node, per request
+// the wakeups, the read and the write. Timings under ptrace mean little;
+// use poller_bench for those.
+//
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/ptrace.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "poller.h"
+
+#define BENCH_MSG       64
+#define BENCH_THREADS   16
+#define BENCH_MARKS     3
+
+struct __bench_mode
+{
+    const char *name;
+    int backend;
+    int uring_ops;
+};
+
+static const struct __bench_mode __bench_modes[] = {
+    {   "epoll",        POLLER_BACKEND_DEFAULT,     0   },
+#ifdef POLLER_IO_URING
+    {   "io_uring",     POLLER_BACKEND_IO_URING,    0   },
+    {   "io_uring ops", POLLER_BACKEND_IO_URING,    1   },
+#endif
+};
+
+struct __bench_message
+{
+    poller_message_t base;
+    size_t size;
+    char buf[BENCH_MSG];
+};
+
+/* Server side, in the traced child. */
+struct __bench_server
+{
+    poller_t *poller;
+    size_t conns;
+    size_t requests;
+    size_t accepted;
+    size_t replied;
+    int done;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+/* Client side, a thread of the tracer. 'phase' is the number of marks
+ * seen so far, or -1 once the server is gone. */
+struct __bench_client
+{
+    struct sockaddr_in addr;
+    size_t conns;
+    size_t rounds;
+    int phase;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+struct __bench_thread
+{
+    pid_t tid;
+    unsigned long calls;
+    unsigned long marks[BENCH_MARKS];
+};
+
+static void __bench_mark(void)
+{
+    syscall(SYS_getppid);
+}
+
+static int __bench_append(const void *buf, size_t *n, poller_message_t *msg)
+{
+    struct __bench_message *m = (struct __bench_message *)msg;
+
+    if(*n > BENCH_MSG - m->size)
+        *n = BENCH_MSG - m->size;
+
+    memcpy(m->buf + m->size, buf, *n);
+    m->size += *n;
+    return m->size == BENCH_MSG;
+}
+
+static poller_message_t *__bench_create_message(void *context)
+{
+    struct __bench_message *m;
+
+    m = (struct __bench_message *)malloc(sizeof (struct __bench_message));
+    if(!m)
+        return NULL;
+
+    memset(&m->base, 0, sizeof (poller_message_t));
+    m->base.append = __bench_append;
+    m->size = 0;
+    return &m->base;
+}
+
+static void *__bench_accept_batch(const struct poller_accepted *acc, int n,
+                                  void *context)
+{
+    struct __bench_server *server = (struct __bench_server *)context;
+    struct poller_data data;
+    int i;
+
+    memset(&data, 0, sizeof data);
+    data.operation = PD_OP_READ;
+    data.create_message = __bench_create_message;
+    data.context = server;
+    for(i = 0; i < n; i++)
+    {
+        data.fd = acc[i].sockfd;
+        if(poller_add(&data, -1, server->poller) < 0)
+        {
+            perror("poller_add");
+            close(acc[i].sockfd);
+        }
+    }
+
+    server->accepted += n;
+    if(server->accepted == server->conns)
+        __bench_mark();
+
+    return server;
+}
+
+static void __bench_server_callback(struct poller_result *res, void *context)
+{
+    struct __bench_server *server = (struct __bench_server *)context;
+    struct __bench_message *m = (struct __bench_message *)res->data.message;
+
+    if(res->data.operation == PD_OP_READ)
+    {
+        if(res->state == PR_ST_SUCCESS)
+        {
+            if(write(res->data.fd, m->buf, BENCH_MSG) != BENCH_MSG)
+                perror("write");
+
+            if(++server->replied == server->requests)
+            {
+                __bench_mark();
+                pthread_mutex_lock(&server->mutex);
+                server->done = 1;
+                pthread_cond_signal(&server->cond);
+                pthread_mutex_unlock(&server->mutex);
+            }
+        }
+        else
+            close(res->data.fd);
+
+        free(m);
+    }
+
+    poller_free_result(res, server->poller);
+}
+
+/* The traced child. Returns its exit status. */
+static int __bench_serve(int listenfd, const struct __bench_mode *mode,
+                         size_t conns, size_t rounds)
+{
+    static struct __bench_server server;
+    struct poller_params params = {
+        .max_open_files = conns + 64,
+        .callback       = __bench_server_callback,
+        .context        = &server,
+        .backend        = mode->backend,
+        .uring_ops      = mode->uring_ops,
+    };
+    struct poller_data data;
+
+    if(ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0 || raise(SIGSTOP) != 0)
+        return 1;
+
+    server.conns = conns;
+    server.requests = conns * rounds;
+    pthread_mutex_init(&server.mutex, NULL);
+    pthread_cond_init(&server.cond, NULL);
+    server.poller = poller_create(&params);
+    if(!server.poller || poller_start(server.poller) < 0)
+    {
+        perror("poller");
+        return 1;
+    }
+
+    memset(&data, 0, sizeof data);
+    data.operation = PD_OP_LISTEN_BATCH;
+    data.fd = listenfd;
+    data.accept_batch = __bench_accept_batch;
+    data.context = &server;
+    if(poller_add(&data, -1, server.poller) < 0)
+    {
+        perror("poller_add");
+        return 1;
+    }
+
+    __bench_mark();
+    pthread_mutex_lock(&server.mutex);
+    while(!server.done)
+        pthread_cond_wait(&server.cond, &server.mutex);
+    pthread_mutex_unlock(&server.mutex);
+
+    poller_stop(server.poller);
+    poller_destroy(server.poller);
+    return 0;
+}
+
+static int __bench_wait_phase(struct __bench_client *client, int phase)
+{
+    pthread_mutex_lock(&client->mutex);
+    while(client->phase >= 0 && client->phase < phase)
+        pthread_cond_wait(&client->cond, &client->mutex);
+    phase = client->phase >= phase;
+    pthread_mutex_unlock(&client->mutex);
+    return phase;
+}
+
+static void __bench_set_phase(struct __bench_client *client, int phase)
+{
+    pthread_mutex_lock(&client->mutex);
+    client->phase = phase;
+    pthread_cond_signal(&client->cond);
+    pthread_mutex_unlock(&client->mutex);
+}
+
+static void *__bench_client_routine(void *arg)
+{
+    struct __bench_client *client = (struct __bench_client *)arg;
+    char buf[BENCH_MSG];
+    int *fds;
+    size_t i, j;
+    ssize_t ret;
+    size_t n;
+    int one = 1;
+
+    fds = (int *)malloc(client->conns * sizeof (int));
+    if(!fds || !__bench_wait_phase(client, 1))
+    {
+        free(fds);
+        return NULL;
+    }
+
+    for(i = 0; i < client->conns; i++)
+    {
+        fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if(fds[i] < 0 || connect(fds[i], (struct sockaddr *)&client->addr,
+                                 sizeof client->addr) < 0)
+        {
+            perror("connect");
+            exit(1);
+        }
+
+        setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    }
+
+    memset(buf, 'x', BENCH_MSG);
+    if(__bench_wait_phase(client, 2))
+    {
+        for(i = 0; i < client->rounds; i++)
+        {
+            for(j = 0; j < client->conns; j++)
+            {
+                if(write(fds[j], buf, BENCH_MSG) != BENCH_MSG)
+                    goto out;
+            }
+
+            for(j = 0; j < client->conns; j++)
+            {
+                for(n = 0; n < BENCH_MSG; n += ret)
+                {
+                    ret = read(fds[j], buf + n, BENCH_MSG - n);
+                    if(ret <= 0)
+                        goto out;
+                }
+            }
+        }
+    }
+
+out:
+    for(i = 0; i < client->conns; i++)
+        close(fds[i]);
+
+    free(fds);
+    return NULL;
+}
+
+static struct __bench_thread *__bench_thread(pid_t tid, struct __bench_thread *threads)
+{
+    int i;
+
+    for(i = 0; i < BENCH_THREADS; i++)
+    {
+        if(threads[i].tid == tid || threads[i].tid == 0)
+        {
+            threads[i].tid = tid;
+            return &threads[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Counts syscall entries of every thread of 'pid' until it exits, and
+ * moves the client on at each mark. Returns the tid that made the last
+ * mark, the poller thread, or -1 if the server never got that far. */
+static pid_t __bench_trace(pid_t pid, struct __bench_client *client,
+                           struct __bench_thread *threads)
+{
+    struct ptrace_syscall_info info;
+    struct __bench_thread *thread;
+    pid_t marker = -1;
+    int marks = 0;
+    pid_t tid;
+    int status;
+    int sig;
+    int i;
+
+    if(waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status) ||
+        ptrace(PTRACE_SETOPTIONS, pid, NULL,
+               PTRACE_O_TRACECLONE | PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL) < 0)
+    {
+        perror("ptrace");
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+    while((tid = waitpid(-1, &status, __WALL)) > 0)
+    {
+        if(!WIFSTOPPED(status))
+        {
+            if(tid == pid)
+                break;
+
+            continue;
+        }
+
+        sig = WSTOPSIG(status);
+        if(sig == (SIGTRAP | 0x80))
+        {
+            sig = 0;
+            thread = __bench_thread(tid, threads);
+            if(thread && ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof info, &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY)
+            {
+                if(info.entry.nr != SYS_getppid || marks == BENCH_MARKS)
+                    thread->calls++;
+                else
+                {
+                    for(i = 0; i < BENCH_THREADS; i++)
+                        threads[i].marks[marks] = threads[i].calls;
+
+                    marker = tid;
+                    __bench_set_phase(client, ++marks);
+                }
+            }
+        }
+        else if(sig == SIGTRAP || sig == SIGSTOP)
+            sig = 0;
+
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+    }
+
+    __bench_set_phase(client, -1);
+    return marks == BENCH_MARKS ? marker : -1;
+}
+
+static void __bench_run(const struct __bench_mode *mode, size_t conns, size_t rounds)
+{
+    struct __bench_thread threads[BENCH_THREADS];
+    struct __bench_thread *poller;
+    struct __bench_client client;
+    socklen_t addrlen = sizeof client.addr;
+    pthread_t tid;
+    pid_t marker;
+    pid_t pid;
+    int fd;
+
+    memset(threads, 0, sizeof threads);
+    memset(&client, 0, sizeof client);
+    client.addr.sin_family = AF_INET;
+    client.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(fd < 0 || bind(fd, (struct sockaddr *)&client.addr, addrlen) < 0 ||
+        getsockname(fd, (struct sockaddr *)&client.addr, &addrlen) < 0 ||
+        listen(fd, 4096) < 0)
+    {
+        perror("setup");
+        exit(1);
+    }
+
+    pid = fork();
+    if(pid < 0)
+    {
+        perror("fork");
+        exit(1);
+    }
+    else if(pid == 0)
+        _exit(__bench_serve(fd, mode, conns, rounds));
+
+    close(fd);
+    client.conns = conns;
+    client.rounds = rounds;
+    pthread_mutex_init(&client.mutex, NULL);
+    pthread_cond_init(&client.cond, NULL);
+    pthread_create(&tid, NULL, __bench_client_routine, &client);
+    marker = __bench_trace(pid, &client, threads);
+    pthread_join(tid, NULL);
+    if(marker < 0)
+    {
+        printf("%-12s failed\n", mode->name);
+        return;
+    }
+
+    poller = __bench_thread(marker, threads);
+    printf("%-12s %zu conns, %.2f syscalls/conn, %zu requests, %.2f syscalls/request\n",
+           mode->name, conns, (double)(poller->marks[1] - poller->marks[0]) / conns,
+           conns * rounds, (double)(poller->marks[2] - poller->marks[1]) / (conns * rounds));
+}
+
+int main(int argc, char *argv[])
+{
+    size_t conns = argc > 1 ? strtoul(argv[1], NULL, 10) : 100;
+    size_t rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 100;
+    size_t i;
+
+    if(conns == 0 || rounds == 0)
+    {
+        fprintf(stderr, "usage: %s [connections] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    for(i = 0; i < sizeof __bench_modes / sizeof __bench_modes[0]; i++)
+        __bench_run(&__bench_modes[i], conns, rounds);
+
+    return 0;
+}
@@ -49,7 +49,7 @@ static inline void list_del(struct list_head *entry)
     __list_del(entry->prev, entry->next);
 }
 
-struct inline void list_move(struct list_head *entry, struct list_head *head)
+static inline void list_move(struct list_head *entry, struct list_head *head)
 {
     __list_del(entry->prev, entry->next);
     list_add(entry, head);
@@ -138,7 +138,7 @@ static inline void INIT_SLIST_HEAD(struct slist_head *list)
 
 static inline void slist_add_after(struct slist_node *entry,
                     struct slist_node *prev,
-                    struct slist_node *list)
+                    struct slist_head *list)
 {
     entry->next = prev->next;
     prev->next = entry;
@@ -190,9 +190,9 @@ static inline void __slist_splice(const struct slist_head *list,
     }
 }
 
-static inline void slist_splice(const struct slist_head *list,
+static inline void slist_splice(struct slist_head *list,
                     struct slist_node *prev,
-                    struct slist_node *head)
+                    struct slist_head *head)
 {
     if(!slist_empty(list))
     {
@@ -207,12 +207,12 @@ static inline void slist_splice(const struct slist_head *list,
 #define slist_for_each(pos, head) \
     for(pos = (head)->first.next; pos; pos = pos->next)
 
-#define slist_for_each_safe(pos, prev, head)
+#define slist_for_each_safe(pos, prev, head) \
     for(prev = &(head)->first, pos = prev->next; pos; \
         prev = prev->next == pos ? pos : prev, pos = prev->next)
 
 #define slist_for_each_entry(pos, head, member) \
-    for(pos = slist_entry((head)->first.next, type (*pos), member); \
+    for(pos = slist_entry((head)->first.next, typeof (*pos), member); \
         &pos->member != (struct slist_node *)0; \
         pos = slist_entry(pos->member.next, typeof (*pos), member))
 
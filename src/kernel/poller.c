@@ -1,31 +1,79 @@
 //
 // Created by 陈家阔 on 2025/8/18.
 //
+#ifdef __linux__
+# ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+# endif
+#endif
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <netinet/in.h>
 #ifdef __linux__
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+# ifndef UDP_SEGMENT
+#  define UDP_SEGMENT 103
+# endif
+# ifdef POLLER_IO_URING
+#  include <liburing.h>
+# endif
+# if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#  define POLLER_ZEROCOPY
+# endif
 #else
 #include <sys/event.h>
 # undef LIST_HEAD
 # undef SLIST_HEAD
 #endif
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#if defined(POLLER_PROFILE) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
 #include <openssl/ssl.h>
+#ifdef SSL_OP_ENABLE_KTLS
+# define POLLER_KTLS
+#endif
 #include "list.h"
 #include "rbtree.h"
 #include "poller.h"
 
 #define POLLER_BUFSIZE (256 * 1024)
 #define POLLER_EVENTS_MAX 256
+#define POLLER_RESULTS_MAX (POLLER_EVENTS_MAX * 4)
+#define POLLER_ACCEPT_BATCH     64
+#define POLLER_SENDFILE_MAX     0x7ffff000
+#define POLLER_RECV_BATCH_MAX 256
+#define POLLER_DGRAM_MAX (64 * 1024)
+#define POLLER_FD_PAGE_BITS 10
+#define POLLER_FD_PAGE_SIZE (1 << POLLER_FD_PAGE_BITS)
+
+#define WHEEL_ROOT_BITS     8
+#define WHEEL_LEVEL_BITS    6
+#define WHEEL_ROOT_SIZE     (1 << WHEEL_ROOT_BITS)
+#define WHEEL_LEVEL_SIZE    (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_ROOT_MASK     (WHEEL_ROOT_SIZE - 1)
+#define WHEEL_LEVEL_MASK    (WHEEL_LEVEL_SIZE - 1)
+#define WHEEL_LEVELS        4
+#define WHEEL_MAX_DELTA     0xffffffffULL
 
 struct __poller_node{
     int state;
@@ -38,434 +86,2908 @@ struct __poller_node{
     };
 #pragma pack()
     char in_rbtree;
-    char rbmoved;
+    char removed;
+    char from_slab;
+    char in_wheel;
     int event;
     struct timespec timeout;
     struct __poller_node *res;
+    unsigned int gen;
+    int uring_error;
+    char uring_op;
+    int uring_head;
+    int uring_tail;
+    unsigned int zc_next;
+    unsigned int zc_done;
+    char zc_on;
+    char zc_off;
+    char ktls;
+    char gso_off;
+};
+
+/* Page directory of the fd table. A directory that has been replaced stays
+ * allocated on 'prev' until the poller is destroyed. */
+struct __poller_fd_slot
+{
+    struct __poller_node *node;
+#ifdef POLLER_ZEROCOPY
+    unsigned int zc_seq;        /* next MSG_ZEROCOPY send number of the socket */
+    signed char zc_state;       /* SO_ZEROCOPY: 0 unknown, 1 on, -1 refused */
+#endif
+#ifdef POLLER_IO_URING
+    struct __poller_uring_accept *uring_accept;
+#endif
+};
+
+struct __poller_fd_dir
+{
+    size_t npages;
+    struct __poller_fd_dir *prev;
+    struct __poller_fd_slot *pages[1];
 };
 
 struct __poller{
     size_t max_open_files;
     void (*callback)(struct poller_result *, void *);
+    void (*batch_callback)(struct poller_result **, int, void *);
     void *context;
 
+    int backend;
+    int listen_exclusive;
+#ifdef POLLER_IO_URING
+    struct io_uring ring;
+    unsigned int uring_gen;
+    int ctl_batch;
+    int uring_ops;
+    int uring_recv_multishot;
+    struct io_uring_buf_ring *uring_br;
+    char *uring_bufs;
+    struct __poller_uring_cqe *uring_cqes;
+    int uring_ncqes;
+#endif
+
     pthread_t tid;
     int pfd;
     int timerfd;
     int pipe_rd;
     int pipe_wr;
+    struct list_head *pipe_queue;
+    int pipe_stop;
     int stopped;
+    pthread_mutex_t mutex;
     struct rb_root timeo_tree;
     struct rb_node *tree_first;
     struct rb_node *tree_last;
     struct list_head timeo_list;
     struct list_head no_timeo_list;
-    struct __poller_node **nodes;
+    int timeo_type;
+    size_t wheel_count;
+    unsigned long long wheel_jiffies;
+    unsigned long long wheel_next;
+    unsigned long long wheel_first;
+    int wheel_first_valid;
+    struct list_head wheel_root[WHEEL_ROOT_SIZE];
+    struct list_head wheel[WHEEL_LEVELS][WHEEL_LEVEL_SIZE];
+    struct __poller_fd_dir *fd_dir;
+    size_t slab_nodes;
+    struct __poller_node *slab_free;
+    struct __poller_node *slab_returned;
+    struct list_head slab_chunks;
+    int recv_batch;
+    int accept_budget;
+    size_t zerocopy_threshold;
+    int ktls;
+    int ssl_gather_off;
+    void *dgram_msgs;
+    int stats_timing;
+    int message_buffers;
+    long long busy_poll_ns;
+    long long spin_ns;
+    int timer_deadline;
+    struct timespec timer_armed;
+    struct timespec wait_deadline;
+    int clock_source;
+    long long timeo_granularity_ns;
+    struct timespec now;
+    int busy_poll_sockets;
+    long long watchdog_ns;
+    void (*watchdog)(const struct poller_slow_report *, void *);
+    struct poller_stats stats;
+    unsigned long long stopped_callbacks;
+#ifdef POLLER_PROFILE
+    struct __poller_profile *prof;
+#endif
+    int nresults;
+    struct poller_result *results[POLLER_RESULTS_MAX];
     char buf[POLLER_BUFSIZE];
 };
 
-#ifdef __linux__
-
-static inline int __poller_create_pfd()
+static inline int __poller_in_thread(poller_t *poller)
 {
-    return epoll_create(1);
+    return !poller->stopped && pthread_equal(poller->tid, pthread_self());
 }
 
-static inline int __poller_close_pfd(int fd)
+/*
+ * The fd table maps an fd to its node in two levels: a directory of pages
+ * of POLLER_FD_PAGE_SIZE slots each. Pages are allocated the first time an
+ * fd in their range is added and stay until the poller is destroyed, so an
+ * fd table costs memory in proportion to the fds actually used. Changes
+ * are made with poller->mutex held. Directories and pages are published
+ * with release stores and never freed or moved while the poller is alive,
+ * so a slot found once stays valid.
+ */
+
+static struct __poller_fd_slot *__poller_node_slot(int fd, poller_t *poller)
 {
-    return close(fd);
+    struct __poller_fd_dir *dir = __atomic_load_n(&poller->fd_dir, __ATOMIC_ACQUIRE);
+    size_t index = (size_t)fd >> POLLER_FD_PAGE_BITS;
+    struct __poller_fd_slot *page;
+
+    if(!dir || index >= dir->npages)
+        return NULL;
+
+    page = __atomic_load_n(&dir->pages[index], __ATOMIC_ACQUIRE);
+    if(!page)
+        return NULL;
+
+    return &page[fd & (POLLER_FD_PAGE_SIZE - 1)];
 }
 
-static inline int __poller_add_fd(int fd, int event, void *data, poller_t *poller)
+static inline struct __poller_node *__poller_get_node(int fd, poller_t *poller)
 {
-    struct epoll_event ev = {
-            .events = event,
-            .data   = {
-                    .ptr = data
-            }
-    };
+    struct __poller_fd_slot *slot = __poller_node_slot(fd, poller);
 
-    return epoll_ctl(poller->pfd, EPOLL_CTL_ADD, fd, &ev);
+    return slot ? slot->node : NULL;
 }
 
-static inline int __poller_del_fd(int fd, int event, poller_t *poller)
+static inline void __poller_clear_node(int fd, poller_t *poller)
 {
-    return epoll_ctl(poller->pfd, EPOLL_CTL_DEL, fd, NULL);
+    struct __poller_fd_slot *slot = __poller_node_slot(fd, poller);
+
+    if(slot)
+        slot->node = NULL;
 }
 
-static inline int __poller_mod_fd(int fd, int old_event, int new_event, void *data, poller_t *poller)
+/* Makes the directory cover 'nfds' fds. Called with poller->mutex held,
+ * or before the poller is shared. */
+static int __poller_fd_dir_grow(size_t nfds, poller_t *poller)
 {
-    struct epoll_event ev = {
-        .events  = new_event,
-        .data    = {
-            .ptr = data
-        }
-    };
-    return epoll_ctl(poller->pfd, EPOLL_CTL_MOD, fd, &ev);
+    struct __poller_fd_dir *dir = poller->fd_dir;
+    struct __poller_fd_dir *new_dir;
+    size_t npages = (nfds + POLLER_FD_PAGE_SIZE - 1) >> POLLER_FD_PAGE_BITS;
+    size_t i;
+
+    if(npages == 0)
+        npages = 1;
+
+    if(dir)
+    {
+        if(npages <= dir->npages)
+            return 0;
+
+        if(npages < 2 * dir->npages)
+            npages = 2 * dir->npages;
+    }
+
+    new_dir = (struct __poller_fd_dir *)calloc(1, sizeof (struct __poller_fd_dir) +
+                                           (npages - 1) * sizeof (void *));
+    if(!new_dir)
+        return -1;
+
+    new_dir->npages = npages;
+    new_dir->prev = dir;
+    if(dir)
+    {
+        for(i = 0; i < dir->npages; i++)
+            new_dir->pages[i] = dir->pages[i];
+    }
+
+    __atomic_store_n(&poller->fd_dir, new_dir, __ATOMIC_RELEASE);
+    return 0;
 }
 
-static inline int __poller_create_timerfd()
+/* Called with poller->mutex held. */
+static struct __poller_fd_slot *__poller_node_slot_alloc(int fd, poller_t *poller)
 {
-    return timerfd_create(CLOCK_MONOTONIC, 0);
+    size_t index = (size_t)fd >> POLLER_FD_PAGE_BITS;
+    struct __poller_fd_slot *page;
+
+    if(__poller_fd_dir_grow((size_t)fd + 1, poller) < 0)
+        return NULL;
+
+    page = poller->fd_dir->pages[index];
+    if(!page)
+    {
+        page = (struct __poller_fd_slot *)calloc(POLLER_FD_PAGE_SIZE,
+                                                 sizeof (struct __poller_fd_slot));
+        if(!page)
+            return NULL;
+
+        __atomic_store_n(&poller->fd_dir->pages[index], page, __ATOMIC_RELEASE);
+    }
+
+    return &page[fd & (POLLER_FD_PAGE_SIZE - 1)];
 }
 
-static inline int __poller_close_timerfd(int fd)
+static void __poller_fd_dir_destroy(poller_t *poller)
 {
-    return close(fd);
+    struct __poller_fd_dir *dir = poller->fd_dir;
+    struct __poller_fd_dir *prev;
+    size_t i;
+#ifdef POLLER_IO_URING
+    size_t j;
+#endif
+
+    if(dir)
+    {
+        for(i = 0; i < dir->npages; i++)
+        {
+#ifdef POLLER_IO_URING
+            for(j = 0; dir->pages[i] && j < POLLER_FD_PAGE_SIZE; j++)
+                free(dir->pages[i][j].uring_accept);
+#endif
+            free(dir->pages[i]);
+        }
+    }
+
+    while(dir)
+    {
+        prev = dir->prev;
+        free(dir);
+        dir = prev;
+    }
 }
 
-static inline int __poller_add_timerfd(int fd, poller_t *poller)
+#if defined(CLOCK_MONOTONIC_COARSE)
+# define POLLER_CLOCK_COARSE_ID CLOCK_MONOTONIC_COARSE
+#elif defined(CLOCK_MONOTONIC_FAST)
+# define POLLER_CLOCK_COARSE_ID CLOCK_MONOTONIC_FAST
+#else
+# define POLLER_CLOCK_COARSE_ID CLOCK_MONOTONIC
+#endif
+
+/*
+ * The clock timeouts are computed from. 'now' is written by the poller
+ * thread once per loop iteration, right after the wait returns, so only
+ * the poller thread may read it; other threads fall back to the coarse
+ * clock in POLLER_CLOCK_CACHED mode.
+ */
+static inline void __poller_now(struct timespec *ts, poller_t *poller)
 {
-    struct epoll_event ev = {
-        .events = EPOLLIN | EPOLLET,
-        .data   = {
-           .ptr = NULL
-         }
-    };
-    return epoll_ctl(poller->pfd, EPOLL_CTL_ADD, fd, &ev);
+    switch(poller->clock_source)
+    {
+        case POLLER_CLOCK_CACHED:
+            if(__poller_in_thread(poller))
+            {
+                *ts = poller->now;
+                break;
+            }
+            /* fall through */
+        case POLLER_CLOCK_COARSE:
+            clock_gettime(POLLER_CLOCK_COARSE_ID, ts);
+            break;
+        default:
+            clock_gettime(CLOCK_MONOTONIC, ts);
+            break;
+    }
 }
 
-static inline int __poller_set_timerfd(int fd, const struct timespace *abstime, poller_t *poller)
+/* Rounds a deadline up to the timeout granularity, never earlier. */
+static inline void __poller_round_deadline(struct timespec *ts, poller_t *poller)
 {
-    struct itimerspec timer ={
-            .it_interval = {},
-            .it_value    = *abstime
-    };
-    return timerfd_settime(fd, TFD_TIMER_ABSTIME, &timer, NULL);
+    long long g = poller->timeo_granularity_ns;
+    long long ns;
+
+    if(g > 0)
+    {
+        ns = (ts->tv_sec * 1000000000LL + ts->tv_nsec + g - 1) / g * g;
+        ts->tv_sec = ns / 1000000000;
+        ts->tv_nsec = ns % 1000000000;
+    }
 }
 
-typedef struct epoll_event __poller_event_t;
+#ifdef __linux__
 
-static inline int __poller_wait(__poller_event_t *events, int maxevents, poller_t *poller)
+#ifdef POLLER_IO_URING
+
+/*
+ * io_uring backend. By default readiness still drives the handlers, so
+ * every registered fd gets a multishot POLL_ADD instead of an epoll_ctl(),
+ * and the control operations issued from the poller thread (mostly
+ * deletions from the handlers and from __poller_handle_timeout()) simply
+ * stay in the SQ until the next __poller_wait() submits them all with one
+ * syscall. Other threads submit immediately, under poller->mutex like
+ * epoll_ctl().
+ *
+ * With poller_params.uring_ops, the two operations whose handlers make a
+ * syscall or more per wakeup do their I/O through the ring as well. A
+ * PD_OP_READ socket gets a multishot recv that takes buffers from a ring
+ * the poller provides, and a listen fd keeps POLLER_URING_ACCEPTS accept
+ * requests queued. Their completions are kept in 'uring_cqes', chained
+ * per node, and the node gets an EPOLLIN event whose handler consumes the
+ * chain instead of calling read() or accept(). Multishot accept reports
+ * every connection to one address buffer, so single accepts are used,
+ * each with its own, and queued again once the handler has taken the
+ * address. A kernel without multishot recv (before 6.0) fails it with
+ * EINVAL, and single recvs are queued from then on. PD_OP_READ on an fd
+ * that is not a socket goes back to a poll.
+ *
+ * A completion may arrive after its node has been removed and freed, so
+ * user_data never carries the node pointer: it packs fd, a registration
+ * generation, a request slot and a kind, and the node is looked up again
+ * in the fd table. Control operations carry the generation of the node
+ * they were issued for, so a failure can be charged to that node if it is
+ * still there. A request completion whose node is gone gives its buffer
+ * back, or closes the socket it accepted.
+ */
+
+#define POLLER_URING_ENTRIES    4096
+#define POLLER_URING_ACCEPTS    8       /* queued accepts per listen fd */
+#define POLLER_URING_BUFS       256     /* provided recv buffers, a power of 2 */
+#define POLLER_URING_BUFSIZE    16384
+#define POLLER_URING_BGID       0
+#define POLLER_URING_CQES       1024    /* request completions kept per wakeup */
+
+#define __URING_UD_TIMER    0
+#define __URING_UD_PIPE     1
+#define __URING_UD_NODE     2
+#define __URING_UD_CTL      3
+
+/* Request slots of a node: its poll, or its requests in op mode. The
+ * completions of cancellations are CTL ones with __URING_SLOT_CANCEL. */
+#define __URING_SLOT_POLL       0
+#define __URING_SLOT_RECV       1
+#define __URING_SLOT_ACCEPT     2
+#define __URING_SLOT_CANCEL     63
+#define __URING_SLOT_MASK       ((__u64)63 << 2)
+
+#define __URING_OP_RECV     1
+#define __URING_OP_ACCEPT   2
+
+struct __poller_uring_cqe
 {
-    return epoll_wait(poller->pfd, events, maxevents, -1);
-}
+    int res;
+    unsigned int flags;
+    int slot;
+    int next;
+};
 
-static inline void *__poller_event_data(const __poller_event_t *event)
+/* Peer addresses of the accept requests of one fd. The kernel writes them
+ * when a request completes, which may be after its node is gone, so they
+ * stay in the fd table until the poller is destroyed. */
+struct __poller_uring_accept
 {
-    return event->data.ptr;
-}
-
-#else /*BSD,macOS*/
+    socklen_t addrlen[POLLER_URING_ACCEPTS];
+    struct sockaddr_storage addr[POLLER_URING_ACCEPTS];
+};
 
-static inline int __poller_create_pfd()
+static inline __u64 __poller_uring_udata(int fd, unsigned int gen, int kind)
 {
-    return kqueue();
+    return ((__u64)fd << 32) | ((__u64)(gen & 0xffffff) << 8) | kind;
 }
 
-static inline int __poller_close_pfd(int fd)
+static inline int __poller_uring_slot(__u64 udata)
 {
-    return close(fd);
+    return (int)((udata & __URING_SLOT_MASK) >> 2);
 }
 
-static inline int __poller_add_fd(int fd, int event, void *data, poller_t *poller)
+static inline __u64 __poller_uring_node_udata(int fd, void *data)
 {
-    struct kevent ev;
-    EV_SET(&ev, fd, event, EV_ADD, 0, 0, data);
-    return kevent(poller->fd, &ev, 1, NULL, 0 , NULL);
+    struct __poller_node *node = (struct __poller_node *)data;
+
+    if(data <= (void *)1)
+        return __poller_uring_udata(fd, 0, (int)(unsigned long)data);
+
+    return __poller_uring_udata(fd, node->gen, __URING_UD_NODE);
 }
 
-static inline int __poller_del_fd(int fd, int event, poller_t *poller)
+static inline __u64 __poller_uring_ctl_udata(int fd, void *data)
 {
-    struct kevent ev;
-    EV_SET(&ev, fd, event, EV_DELETE, 0, 0, NULL);
-    return kevent(poller->fd, &ev, 1, NULL, 0, NULL);
+    return (__poller_uring_node_udata(fd, data) & ~(__u64)3) | __URING_UD_CTL;
 }
 
-static inline int __poller_mod_fd(int fd, int old_event, int new_event, void *data, poller_t *poller)
+/* A poll request has no exclusive mode: with this backend, every poller
+ * sharing a listen fd is woken up for each connection. */
+static inline unsigned int __poller_uring_mask(int event)
 {
-    struct kevent ev[2];
-    EV_SET(&ev[0], fd, old_event, EV_DELETE, 0, 0, NULL);
-    EV_SET(&ev[0], fd, new_event, EV_ADD, 0, 0, data);
-    return kevent(poller->fd, ev, 2, NULL, 0, NULL);
+    return (unsigned int)event & ~(unsigned int)(EPOLLET | EPOLLEXCLUSIVE);
 }
 
-static inline int __poller_create_timerfd()
+/* Whether the node does its I/O through the ring. Messages that lend
+ * their own buffers are read into them, so those nodes keep polling. */
+static int __poller_uring_op(const struct __poller_node *node, poller_t *poller)
 {
+    if(!poller->uring_ops)
+        return 0;
+
+    switch(node->data.operation)
+    {
+        case PD_OP_READ:
+            if(!node->data.ssl && !poller->message_buffers)
+                return __URING_OP_RECV;
+            break;
+        case PD_OP_LISTEN:
+        case PD_OP_LISTEN_BATCH:
+            return __URING_OP_ACCEPT;
+    }
+
     return 0;
 }
 
-static inline int __poller_close_timerfd(int fd)
+static inline char *__poller_uring_buf(unsigned int flags, poller_t *poller)
 {
-    return 0;
+    return poller->uring_bufs +
+           (size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * POLLER_URING_BUFSIZE;
 }
 
-static inline int __poller_add_timerfd(int fd, poller_t *poller)
+/* Gives the buffer of a recv completion back. Only the poller thread adds
+ * to the buffer ring. */
+static void __poller_uring_recycle(unsigned int flags, poller_t *poller)
 {
-    return 0;
+    io_uring_buf_ring_add(poller->uring_br, __poller_uring_buf(flags, poller),
+                          POLLER_URING_BUFSIZE,
+                          (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT),
+                          io_uring_buf_ring_mask(POLLER_URING_BUFS), 0);
+    io_uring_buf_ring_advance(poller->uring_br, 1);
 }
 
-static int __poller_set_timerfd(int fd, const struct timespec *abstime, poller_t *poller)
+static struct io_uring_sqe *__poller_uring_get_sqe(poller_t *poller)
 {
-    struct timespec cutime;
-    long long nseconds;
-    struct kevent ev;
-    int flags;
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&poller->ring);
 
-    if(abstime->tv_sec || abstime->tv_nsec)
-    {
-        clock_gettime(CLOCK_MONOTONIC, &curtime);
-        nseconds = 1000000000LL * (abstime->tv_sec - curtime.tv_sec);
-        nseconds += abstime->tv_nsec - curtime.tv_nsec;
-        flags = EV_ADD;
-    }
-    else
+    if(!sqe)
     {
-        nseconds = 0;
-        flags = EV_SET;
+        io_uring_submit(&poller->ring);
+        sqe = io_uring_get_sqe(&poller->ring);
+        if(!sqe)
+            errno = EBUSY;
     }
 
-    EV_SET(&ev, fd, EVFILT_TIMER, flags, NOTE_NSECONDS, nseconds, NULL);
-    return kevent(poller->pfd, &ev, 1, NULL, 0, NULL);
+    return sqe;
 }
 
-typedef struct kevent __poller_event_t;
-
-static inline int __poller_wait(__poller_event_t *events, int maxevents, poller_t *poller)
+static int __poller_uring_flush(poller_t *poller)
 {
-    return kevent(poller->pfd, NULL, 0, events, maxevents, NULL);
-}
+    int ret;
 
-static inline void *__poller_event_data(const __poller_event_t *event)
-{
-    return event->udata;
-}
+    if(__poller_in_thread(poller) || poller->ctl_batch)
+        return 0;
 
-#define EPOLLIN  EVFILT_READ
-#define EPOLLOUT EVFILT_WRITE
-#define EPOLLET  0
+    ret = io_uring_submit(&poller->ring);
+    if(ret < 0)
+    {
+        errno = -ret;
+        return -1;
+    }
 
-#endif
+    return 0;
+}
 
-static inline long __timeout_cmp(const struct __Poller_node *node1, const struct __poller_node *node2)
+static void __poller_uring_free_ops(poller_t *poller)
 {
-    long ret = node1->timeout.tv_sec - node2->timeout.tv_sec;
-    if(ret == 0)
-    {
-        ret = node1->timeout.tv_sec - node2->timeout.tv_sec;
-    }
-    return ret;
+    free(poller->uring_cqes);
+    free(poller->uring_bufs);
+    free(poller->uring_br);
+    poller->uring_cqes = NULL;
+    poller->uring_bufs = NULL;
+    poller->uring_br = NULL;
 }
 
-static void __poller_tree_insert(struct __poller_node *node, poller_t *poller)
+/* Fails where the kernel has no provided buffer rings (before 5.19). */
+static int __poller_uring_setup_ops(poller_t *poller)
 {
-    struct rb_node **p = &poller->timeo_tree.rb_node;
-    struct rb_node *parent = NULL;
-    struct __poller_node *entry;
+    struct io_uring_buf_reg reg;
+    void *br;
+    int i;
 
-    entry = rb_entry(poller->tree_last, struct __poller_node, rb);
-    if(!*p)
-    {
-        poller->tree_first = &node->rb;
-        poller->tree_last  = &node->rb;
-    }
-    else if(__timeout_cmp(node, entry) >= 0)
-    {
-        parent = poller->tree_last;
-        p = &parent->rb_right;
-        poller->tree_last = &node->rb;
-    }
-    else
+    poller->uring_cqes = (struct __poller_uring_cqe *)
+        malloc(POLLER_URING_CQES * sizeof (struct __poller_uring_cqe));
+    poller->uring_bufs = (char *)malloc((size_t)POLLER_URING_BUFS * POLLER_URING_BUFSIZE);
+    if(posix_memalign(&br, sysconf(_SC_PAGESIZE),
+                      POLLER_URING_BUFS * sizeof (struct io_uring_buf)) == 0)
+        poller->uring_br = (struct io_uring_buf_ring *)br;
+
+    if(poller->uring_cqes && poller->uring_bufs && poller->uring_br)
     {
-        do {
-            parent = *p;
-            entry = rb_entry(*p, struct __poller_node, rb);
-            if(__timeout_cmp(node,entry) < 0)
-            {
-                p = &(*p)->rb_left;
-            }
-            else
+        io_uring_buf_ring_init(poller->uring_br);
+        memset(&reg, 0, sizeof (struct io_uring_buf_reg));
+        reg.ring_addr = (unsigned long)poller->uring_br;
+        reg.ring_entries = POLLER_URING_BUFS;
+        reg.bgid = POLLER_URING_BGID;
+        if(io_uring_register_buf_ring(&poller->ring, &reg, 0) == 0)
+        {
+            for(i = 0; i < POLLER_URING_BUFS; i++)
             {
-                p = &(*p)->rb_right;
+                io_uring_buf_ring_add(poller->uring_br,
+                                      poller->uring_bufs + (size_t)i * POLLER_URING_BUFSIZE,
+                                      POLLER_URING_BUFSIZE, (unsigned short)i,
+                                      io_uring_buf_ring_mask(POLLER_URING_BUFS), i);
             }
-        }while(*p);
 
-        if(p == &poller->tree_first->rb_left)
-        {
-            poller->tree_first = & node->rb;
+            io_uring_buf_ring_advance(poller->uring_br, POLLER_URING_BUFS);
+            poller->uring_recv_multishot = 1;
+            poller->uring_ncqes = 0;
+            return 0;
         }
     }
 
-    node->in_rbtree = 1;
-    rb_link_node(&node->rb, parent, p);
-    rb_insert_color(&node->rb, &poller->timeo_tree);
+    __poller_uring_free_ops(poller);
+    return -1;
 }
 
-static inline void __poller_tree_erase(struct __poller_node *node, poller_t *poller)
+static int __poller_uring_create(poller_t *poller)
 {
-    if(&node->rb == poller->tree_first)
-    {
-        poller->tree_first = rb_next(&node->rb)
-    }
+    int ret = io_uring_queue_init(POLLER_URING_ENTRIES, &poller->ring, 0);
 
-    if(&node->rb == poller->tree_last)
+    if(ret < 0)
     {
-        poller->tree_last = rb_prev(&node->rb);
+        errno = -ret;
+        return -1;
     }
 
-    rb_erase(&node->rb, &poller->timeo_tree);
-    node->in_rbtree = 0;
+    poller->uring_gen = 0;
+    poller->ctl_batch = 0;
+    poller->uring_br = NULL;
+    poller->uring_bufs = NULL;
+    poller->uring_cqes = NULL;
+    if(poller->uring_ops && __poller_uring_setup_ops(poller) < 0)
+        poller->uring_ops = 0;
+
+    return poller->ring.ring_fd;
 }
 
-static int __poller_remove_node(struct __poller_node *node, poller_t *poller)
+/* Queues request 'slot' of a node in op mode. */
+static int __poller_uring_prep_op(struct __poller_node *node, int slot, poller_t *poller)
 {
-    int removed;
+    struct io_uring_sqe *sqe = __poller_uring_get_sqe(poller);
+    struct __poller_uring_accept *acc;
+    int fd = node->data.fd;
+    int i = slot - __URING_SLOT_ACCEPT;
 
-    pthread_mutex_lock(&poller->mutex);
-    removed = node->removed;
-    if(!removed)
-    {
-        poller->nodes[node->data.fd] = NULL;
+    if(!sqe)
+        return -1;
 
-        if(node->in_rbtree)
-        {
-            __poller_tree_erase(node, poller);
-        }
+    if(slot == __URING_SLOT_RECV)
+    {
+        if(poller->uring_recv_multishot)
+            io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
         else
-        {
-            list_del(&node->list);
-        }
+            io_uring_prep_recv(sqe, fd, NULL, 0, 0);
 
-        __poller_del_fd(node->data.fd, node->event, poller);
+        io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+        sqe->buf_group = POLLER_URING_BGID;
+    }
+    else
+    {
+        acc = __poller_node_slot(fd, poller)->uring_accept;
+        acc->addrlen[i] = sizeof (struct sockaddr_storage);
+        io_uring_prep_accept(sqe, fd, (struct sockaddr *)&acc->addr[i], &acc->addrlen[i],
+                             node->data.operation == PD_OP_LISTEN_BATCH ?
+                             SOCK_NONBLOCK | SOCK_CLOEXEC : 0);
     }
 
-    pthread_mutex_unlock(&poller->mutex);
-    return removed;
+    io_uring_sqe_set_data64(sqe, __poller_uring_node_udata(fd, node) | (__u64)slot << 2);
+    return 0;
 }
 
-static int __poller_append_message(const void *buf, size_t *n,struct __poller_node *node, poller_t *poller)
+static int __poller_uring_add_op(struct __poller_node *node, poller_t *poller)
 {
-    poller_message_t *mgs = node->data.message;
-    struct __poller_node *res;
+    struct __poller_fd_slot *slot;
+    int i;
+
+    if(node->uring_op == __URING_OP_RECV)
+    {
+        if(__poller_uring_prep_op(node, __URING_SLOT_RECV, poller) < 0)
+            return -1;
+
+        return __poller_uring_flush(poller);
+    }
+
+    slot = __poller_node_slot(node->data.fd, poller);
+    if(!slot->uring_accept)
+    {
+        slot->uring_accept = (struct __poller_uring_accept *)
+            malloc(sizeof (struct __poller_uring_accept));
+        if(!slot->uring_accept)
+            return -1;
+    }
+
+    for(i = 0; i < POLLER_URING_ACCEPTS; i++)
+    {
+        if(__poller_uring_prep_op(node, __URING_SLOT_ACCEPT + i, poller) < 0)
+            return -1;
+    }
+
+    return __poller_uring_flush(poller);
+}
+
+static int __poller_uring_cancel_op(int fd, struct __poller_node *node, poller_t *poller)
+{
+    __u64 udata = __poller_uring_node_udata(fd, node);
+    struct io_uring_sqe *sqe;
+    int first = __URING_SLOT_RECV;
+    int last = __URING_SLOT_RECV;
+    int slot;
+
+    if(node->uring_op == __URING_OP_ACCEPT)
+    {
+        first = __URING_SLOT_ACCEPT;
+        last = __URING_SLOT_ACCEPT + POLLER_URING_ACCEPTS - 1;
+    }
+
+    for(slot = first; slot <= last; slot++)
+    {
+        sqe = __poller_uring_get_sqe(poller);
+        if(!sqe)
+            return -1;
+
+        io_uring_prep_cancel64(sqe, udata | (__u64)slot << 2, 0);
+        io_uring_sqe_set_data64(sqe, __poller_uring_udata(fd, 0, __URING_UD_CTL) |
+                                     (__u64)__URING_SLOT_CANCEL << 2);
+    }
+
+    return 0;
+}
+
+static int __poller_uring_add_fd(int fd, int event, void *data, poller_t *poller)
+{
+    struct __poller_node *node = (struct __poller_node *)data;
+    struct io_uring_sqe *sqe;
+
+    if(data > (void *)1)
+    {
+        node->gen = ++poller->uring_gen;
+        node->uring_op = __poller_uring_op(node, poller);
+        if(node->uring_op)
+            return __poller_uring_add_op(node, poller);
+    }
+
+    sqe = __poller_uring_get_sqe(poller);
+    if(!sqe)
+        return -1;
+
+    io_uring_prep_poll_multishot(sqe, fd, __poller_uring_mask(event));
+    io_uring_sqe_set_data64(sqe, __poller_uring_node_udata(fd, data));
+    return __poller_uring_flush(poller);
+}
+
+static int __poller_uring_del_fd(int fd, void *data, poller_t *poller)
+{
+    struct io_uring_sqe *sqe;
+
+    if(data > (void *)1 && ((struct __poller_node *)data)->uring_op)
+    {
+        if(__poller_uring_cancel_op(fd, (struct __poller_node *)data, poller) < 0)
+            return -1;
+
+        return __poller_uring_flush(poller);
+    }
+
+    sqe = __poller_uring_get_sqe(poller);
+    if(!sqe)
+        return -1;
+
+    io_uring_prep_poll_remove(sqe, __poller_uring_node_udata(fd, data));
+    io_uring_sqe_set_data64(sqe, __poller_uring_ctl_udata(fd, data));
+    return __poller_uring_flush(poller);
+}
+
+static int __poller_uring_mod_fd(int fd, int new_event, void *data, poller_t *poller)
+{
+    struct __poller_node *node = (struct __poller_node *)data;
+    struct io_uring_sqe *sqe;
+    struct __poller_node *orig;
+    __u64 old_udata;
+    int ctl_batch;
+    int ret;
+
+    /* Called before the node of 'fd' is replaced by the new one. */
+    orig = __poller_get_node(fd, poller);
+    if(orig && node != orig && (orig->uring_op || __poller_uring_op(node, poller)))
+    {
+        /* Only a poll can be updated. Otherwise the old requests are
+         * cancelled and the new ones queued, in one submission. */
+        ctl_batch = poller->ctl_batch;
+        poller->ctl_batch = 1;
+        ret = __poller_uring_del_fd(fd, orig, poller);
+        if(ret >= 0)
+            ret = __poller_uring_add_fd(fd, new_event, node, poller);
+
+        poller->ctl_batch = ctl_batch;
+        if(ret < 0)
+            return -1;
+
+        return __poller_uring_flush(poller);
+    }
+
+    sqe = __poller_uring_get_sqe(poller);
+    if(!sqe)
+        return -1;
+
+    old_udata = __poller_uring_node_udata(fd, orig);
+    if(node != orig)
+        node->gen = ++poller->uring_gen;
+
+    io_uring_prep_poll_update(sqe, old_udata, __poller_uring_node_udata(fd, data),
+                              __poller_uring_mask(new_event),
+                              IORING_POLL_UPDATE_EVENTS |
+                              IORING_POLL_UPDATE_USER_DATA |
+                              IORING_POLL_ADD_MULTI);
+    io_uring_sqe_set_data64(sqe, __poller_uring_ctl_udata(fd, data));
+    return __poller_uring_flush(poller);
+}
+
+/* The ones below up to __poller_uring_wait() are called with
+ * poller->mutex held. */
+static void *__poller_uring_lookup(__u64 udata, poller_t *poller)
+{
+    struct __poller_node *node;
+
+    switch(udata & 3)
+    {
+        case __URING_UD_TIMER:
+            return NULL;
+        case __URING_UD_PIPE:
+            return (void *)1;
+        case __URING_UD_NODE:
+            node = __poller_get_node((int)(udata >> 32), poller);
+            if(node && __poller_uring_node_udata(node->data.fd, node) ==
+                       (udata & ~__URING_SLOT_MASK))
+                return node;
+            /* fall through */
+        default:
+            return (void *)-1;
+    }
+}
+
+/* A multishot poll that ended without being removed must be armed again. */
+static void __poller_uring_rearm(__u64 udata, void *data, poller_t *poller)
+{
+    struct io_uring_sqe *sqe = __poller_uring_get_sqe(poller);
+    int event;
+
+    if(data > (void *)1)
+        event = ((struct __poller_node *)data)->event;
+    else
+        event = EPOLLIN;
+
+    if(sqe)
+    {
+        io_uring_prep_poll_multishot(sqe, (int)(udata >> 32),
+                                     __poller_uring_mask(event));
+        io_uring_sqe_set_data64(sqe, udata);
+    }
+}
+
+/* A request completion whose node is gone. */
+static void __poller_uring_drop(const struct io_uring_cqe *cqe, int slot, poller_t *poller)
+{
+    if(cqe->flags & IORING_CQE_F_BUFFER)
+        __poller_uring_recycle(cqe->flags, poller);
+    else if(slot >= __URING_SLOT_ACCEPT && cqe->res >= 0)
+        close(cqe->res);
+}
+
+/*
+ * A request completion of 'node'. Returns 0 if there is nothing for the
+ * handler. A recv that ended is queued again unless the peer closed or it
+ * failed. Running out of buffers is not a failure: the handlers give them
+ * back before the next submission.
+ */
+static int __poller_uring_op_cqe(const struct io_uring_cqe *cqe, int slot,
+                                 struct __poller_node *node, poller_t *poller)
+{
+    if(slot != __URING_SLOT_RECV || (cqe->flags & IORING_CQE_F_MORE))
+        return 1;
+
+    switch(cqe->res)
+    {
+        case -EINVAL:
+            if(!poller->uring_recv_multishot)
+                return 1;
+
+            poller->uring_recv_multishot = 0;
+            break;
+        case -ENOTSOCK:
+            node->uring_op = 0;
+            __poller_uring_rearm(__poller_uring_node_udata(node->data.fd, node), node, poller);
+            return 0;
+        case -ENOBUFS:
+            break;
+        default:
+            if(cqe->res <= 0)
+                return 1;
+    }
+
+    __poller_uring_prep_op(node, __URING_SLOT_RECV, poller);
+    return cqe->res > 0;
+}
+
+static void __poller_uring_save(const struct io_uring_cqe *cqe, int slot,
+                                struct __poller_node *node, poller_t *poller)
+{
+    int i = poller->uring_ncqes++;
+    struct __poller_uring_cqe *rec = &poller->uring_cqes[i];
+
+    rec->res = cqe->res;
+    rec->flags = cqe->flags;
+    rec->slot = slot;
+    rec->next = -1;
+    if(node->uring_head < 0)
+        node->uring_head = i;
+    else
+        poller->uring_cqes[node->uring_tail].next = i;
+
+    node->uring_tail = i;
+}
+
+/*
+ * A multishot poll only reports new readiness, like EPOLLET, so a handler
+ * that leaves a level-triggered fd ready on purpose (the accept budget)
+ * has it polled for again. Updating the poll with the same mask makes the
+ * kernel check readiness once more.
+ */
+static void __poller_uring_repoll(struct __poller_node *node, poller_t *poller)
+{
+    if(poller->backend != POLLER_BACKEND_IO_URING)
+        return;
+
+    pthread_mutex_lock(&poller->mutex);
+    if(!node->removed)
+        __poller_uring_mod_fd(node->data.fd, node->event, node, poller);
+
+    pthread_mutex_unlock(&poller->mutex);
+}
+
+static int __poller_uring_wait(struct epoll_event *events, int maxevents, int timeout,
+                               poller_t *poller)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int count = 0;
+    unsigned int head;
+    int nevents = 0;
+    __u64 udata;
+    void *data;
+    int slot;
     int ret;
+    int i;
+
+    /* Other threads queue SQEs and replace nodes in the fd table under the
+     * mutex. It is only dropped to block, so a wakeup that finds completions
+     * already there takes it once. Submitting costs no syscall when nothing
+     * is queued. */
+    pthread_mutex_lock(&poller->mutex);
+    ret = io_uring_submit(&poller->ring);
+    if(ret >= 0)
+    {
+        ret = io_uring_peek_cqe(&poller->ring, &cqe);
+        if(ret == -EAGAIN && timeout != 0)
+        {
+            pthread_mutex_unlock(&poller->mutex);
+            ret = io_uring_wait_cqe(&poller->ring, &cqe);
+            pthread_mutex_lock(&poller->mutex);
+        }
+    }
+
+    if(ret < 0)
+    {
+        pthread_mutex_unlock(&poller->mutex);
+        if(ret == -EAGAIN)
+            return 0;
+
+        errno = -ret;
+        return -1;
+    }
+
+    /* The handlers of the previous wakeup are done with their completions. */
+    poller->uring_ncqes = 0;
+    io_uring_for_each_cqe(&poller->ring, head, cqe)
+    {
+        if(nevents == maxevents || poller->uring_ncqes == POLLER_URING_CQES)
+            break;
+
+        count++;
+        udata = cqe->user_data;
+        slot = __poller_uring_slot(udata);
+        if(cqe->res == -ECANCELED)
+            continue;
+
+        if((udata & 3) == __URING_UD_CTL)
+        {
+            /* A failed poll update leaves the node without a poll. It is
+             * armed again if the old one had already ended, and gets an
+             * error result otherwise. A cancellation that found nothing
+             * raced with the end of its request. */
+            if(cqe->res >= 0 || slot == __URING_SLOT_CANCEL)
+                continue;
+
+            udata ^= __URING_UD_CTL ^ __URING_UD_NODE;
+            data = __poller_uring_lookup(udata, poller);
+            if(data == (void *)-1)
+                continue;
+
+            if(cqe->res == -ENOENT)
+            {
+                __poller_uring_rearm(udata, data, poller);
+                continue;
+            }
+        }
+        else if(slot != __URING_SLOT_POLL)
+        {
+            data = __poller_uring_lookup(udata, poller);
+            if(data == (void *)-1 || !((struct __poller_node *)data)->uring_op)
+            {
+                __poller_uring_drop(cqe, slot, poller);
+                continue;
+            }
+
+            if(!__poller_uring_op_cqe(cqe, slot, (struct __poller_node *)data, poller))
+                continue;
+        }
+        else
+        {
+            data = __poller_uring_lookup(udata, poller);
+            if(data == (void *)-1)
+                continue;
+
+            if(!(cqe->flags & IORING_CQE_F_MORE) && cqe->res >= 0)
+                __poller_uring_rearm(udata, data, poller);
+        }
+
+        if(cqe->res < 0 && slot == __URING_SLOT_POLL && data > (void *)1)
+            ((struct __poller_node *)data)->uring_error = -cqe->res;
+
+        /* Unlike epoll_wait(), one batch may report the same fd twice. */
+        for(i = 0; i < nevents; i++)
+        {
+            if(events[i].data.ptr == data)
+                break;
+        }
+
+        if(i == nevents)
+        {
+            events[i].events = 0;
+            events[i].data.ptr = data;
+            nevents++;
+            if(data > (void *)1)
+                ((struct __poller_node *)data)->uring_head = -1;
+        }
+
+        if(slot == __URING_SLOT_POLL)
+            events[i].events |= cqe->res >= 0 ? (unsigned int)cqe->res : EPOLLERR;
+        else
+        {
+            events[i].events |= EPOLLIN;
+            __poller_uring_save(cqe, slot, (struct __poller_node *)data, poller);
+        }
+    }
+
+    pthread_mutex_unlock(&poller->mutex);
+    io_uring_cq_advance(&poller->ring, count);
+    return nevents;
+}
+
+/* Sockets accepted for nodes that are gone by now are closed. */
+static void __poller_uring_destroy(poller_t *poller)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+
+    io_uring_for_each_cqe(&poller->ring, head, cqe)
+    {
+        if((cqe->user_data & 3) == __URING_UD_NODE)
+            __poller_uring_drop(cqe, __poller_uring_slot(cqe->user_data), poller);
+    }
+
+    io_uring_queue_exit(&poller->ring);
+    __poller_uring_free_ops(poller);
+}
+
+#endif
+
+static inline int __poller_create_pfd(poller_t *poller)
+{
+#ifdef POLLER_IO_URING
+    if(poller->backend == POLLER_BACKEND_IO_URING)
+        return __poller_uring_create(poller);
+#endif
+    return epoll_create(1);
+}
+
+static inline int __poller_close_pfd(int fd, poller_t *poller)
+{
+#ifdef POLLER_IO_URING
+    if(poller->backend == POLLER_BACKEND_IO_URING)
+    {
+        __poller_uring_destroy(poller);
+        return 0;
+    }
+#endif
+    return close(fd);
+}
+
+static inline int __poller_add_fd(int fd, int event, void *data, poller_t *poller)
+{
+    struct epoll_event ev = {
+            .events = event,
+            .data   = {
+                    .ptr = data
+            }
+    };
+
+#ifdef POLLER_IO_URING
+    if(poller->backend == POLLER_BACKEND_IO_URING)
+        return __poller_uring_add_fd(fd, event, data, poller);
+#endif
+    return epoll_ctl(poller->pfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static inline int __poller_del_fd(int fd, int event, void *data, poller_t *poller)
+{
+#ifdef POLLER_IO_URING
+    if(poller->backend == POLLER_BACKEND_IO_URING)
+        return __poller_uring_del_fd(fd, data, poller);
+#endif
+    return epoll_ctl(poller->pfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static inline int __poller_mod_fd(int fd, int old_event, int new_event, void *data, poller_t *poller)
+{
+    struct epoll_event ev = {
+        .events  = new_event,
+        .data    = {
+            .ptr = data
+        }
+    };
+
+#ifdef POLLER_IO_URING
+    if(poller->backend == POLLER_BACKEND_IO_URING)
+        return __poller_uring_mod_fd(fd, new_event, data, poller);
+#endif
+    /* EPOLL_CTL_MOD fails with EINVAL on an EPOLLEXCLUSIVE registration,
+     * either way round, so such an fd is registered again. */
+    if((old_event | new_event) & EPOLLEXCLUSIVE)
+    {
+        if(epoll_ctl(poller->pfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+            return -1;
+
+        return epoll_ctl(poller->pfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    return epoll_ctl(poller->pfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/* Bracket a series of fd operations that may go to the kernel together. */
+static inline void __poller_ctl_batch_begin(poller_t *poller)
+{
+#ifdef POLLER_IO_URING
+    if(poller->backend == POLLER_BACKEND_IO_URING)
+        poller->ctl_batch = 1;
+#endif
+}
+
+/* Returns -1 if the batched operations could not be submitted. They stay
+ * queued in the SQ until the next submission. */
+static inline int __poller_ctl_batch_end(poller_t *poller)
+{
+#ifdef POLLER_IO_URING
+    if(poller->backend == POLLER_BACKEND_IO_URING)
+    {
+        poller->ctl_batch = 0;
+        return __poller_uring_flush(poller);
+    }
+#endif
+    return 0;
+}
+
+static inline int __poller_create_timerfd()
+{
+    return timerfd_create(CLOCK_MONOTONIC, 0);
+}
+
+static inline int __poller_close_timerfd(int fd)
+{
+    return close(fd);
+}
+
+static inline int __poller_add_timerfd(int fd, poller_t *poller)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLET,
+        .data   = {
+           .ptr = NULL
+         }
+    };
+
+#ifdef POLLER_IO_URING
+    if(poller->backend == POLLER_BACKEND_IO_URING)
+        return __poller_uring_add_fd(fd, EPOLLIN, NULL, poller);
+#endif
+    return epoll_ctl(poller->pfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static inline int __poller_set_timerfd(int fd, const struct timespec *abstime, poller_t *poller)
+{
+    struct itimerspec timer ={
+            .it_interval = {},
+            .it_value    = *abstime
+    };
+    return timerfd_settime(fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+typedef struct epoll_event __poller_event_t;
+
+/* 'timeout' is -1 to block or 0 to poll. */
+static inline int __poller_wait(__poller_event_t *events, int maxevents, int timeout,
+                                poller_t *poller)
+{
+#ifdef POLLER_IO_URING
+    if(poller->backend == POLLER_BACKEND_IO_URING)
+        return __poller_uring_wait(events, maxevents, timeout, poller);
+#endif
+    return epoll_wait(poller->pfd, events, maxevents, timeout);
+}
+
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+# if __GLIBC_PREREQ(2, 35)
+#  define POLLER_EPOLL_PWAIT2
+# endif
+#endif
+
+#ifdef POLLER_EPOLL_PWAIT2
+# define POLLER_PWAIT2
+static inline int __poller_pwait2(int pfd, __poller_event_t *events, int maxevents,
+                                  const struct timespec *timeout)
+{
+    return epoll_pwait2(pfd, events, maxevents, timeout, NULL);
+}
+#elif defined(SYS_epoll_pwait2) && defined(__LP64__)
+# define POLLER_PWAIT2
+static inline int __poller_pwait2(int pfd, __poller_event_t *events, int maxevents,
+                                  const struct timespec *timeout)
+{
+    return syscall(SYS_epoll_pwait2, pfd, events, maxevents, timeout, NULL, 0);
+}
+#endif
+
+static inline void *__poller_event_data(const __poller_event_t *event)
+{
+    return event->data.ptr;
+}
+
+#else /*BSD,macOS*/
+
+static inline int __poller_create_pfd(poller_t *poller)
+{
+    return kqueue();
+}
+
+static inline int __poller_close_pfd(int fd, poller_t *poller)
+{
+    return close(fd);
+}
+
+static inline int __poller_add_fd(int fd, int event, void *data, poller_t *poller)
+{
+    struct kevent ev;
+    EV_SET(&ev, fd, event, EV_ADD, 0, 0, data);
+    return kevent(poller->fd, &ev, 1, NULL, 0 , NULL);
+}
+
+static inline int __poller_del_fd(int fd, int event, void *data, poller_t *poller)
+{
+    struct kevent ev;
+    EV_SET(&ev, fd, event, EV_DELETE, 0, 0, NULL);
+    return kevent(poller->fd, &ev, 1, NULL, 0, NULL);
+}
+
+static inline int __poller_mod_fd(int fd, int old_event, int new_event, void *data, poller_t *poller)
+{
+    struct kevent ev[2];
+    EV_SET(&ev[0], fd, old_event, EV_DELETE, 0, 0, NULL);
+    EV_SET(&ev[0], fd, new_event, EV_ADD, 0, 0, data);
+    return kevent(poller->fd, ev, 2, NULL, 0, NULL);
+}
+
+static inline void __poller_ctl_batch_begin(poller_t *poller)
+{
+}
+
+static inline int __poller_ctl_batch_end(poller_t *poller)
+{
+    return 0;
+}
+
+static inline int __poller_create_timerfd()
+{
+    return 0;
+}
+
+static inline int __poller_close_timerfd(int fd)
+{
+    return 0;
+}
+
+static inline int __poller_add_timerfd(int fd, poller_t *poller)
+{
+    return 0;
+}
+
+static int __poller_set_timerfd(int fd, const struct timespec *abstime, poller_t *poller)
+{
+    struct timespec cutime;
+    long long nseconds;
+    struct kevent ev;
+    int flags;
+
+    if(abstime->tv_sec || abstime->tv_nsec)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &curtime);
+        nseconds = 1000000000LL * (abstime->tv_sec - curtime.tv_sec);
+        nseconds += abstime->tv_nsec - curtime.tv_nsec;
+        flags = EV_ADD;
+    }
+    else
+    {
+        nseconds = 0;
+        flags = EV_SET;
+    }
+
+    EV_SET(&ev, fd, EVFILT_TIMER, flags, NOTE_NSECONDS, nseconds, NULL);
+    return kevent(poller->pfd, &ev, 1, NULL, 0, NULL);
+}
+
+typedef struct kevent __poller_event_t;
+
+static inline int __poller_wait(__poller_event_t *events, int maxevents, int timeout,
+                                poller_t *poller)
+{
+    struct timespec ts = { 0, 0 };
+
+    return kevent(poller->pfd, NULL, 0, events, maxevents, timeout == 0 ? &ts : NULL);
+}
+
+static inline void *__poller_event_data(const __poller_event_t *event)
+{
+    return event->udata;
+}
+
+#define EPOLLIN  EVFILT_READ
+#define EPOLLOUT EVFILT_WRITE
+#define EPOLLET  0
+#define EPOLLEXCLUSIVE 0
+
+#endif
+
+/*
+ * Node slab. Only the poller thread carves nodes out of the slab: it keeps
+ * a private free list, and takes the whole 'slab_returned' stack in one
+ * exchange when that runs dry. Nodes released by other threads (results
+ * the user is done with) are pushed onto that stack lock-free. Nodes
+ * needed by other threads (poller_add() etc.) simply come from malloc().
+ * Free nodes are chained through 'res'.
+ */
+
+#define POLLER_CACHELINE    64
+#define POLLER_NODE_STRIDE  \
+    ((sizeof (struct __poller_node) + POLLER_CACHELINE - 1) & ~(POLLER_CACHELINE - 1))
+
+struct __poller_slab_chunk
+{
+    struct list_head list;
+} __attribute__((aligned(POLLER_CACHELINE)));
+
+static int __poller_slab_grow(poller_t *poller)
+{
+    struct __poller_slab_chunk *chunk;
+    struct __poller_node *node;
+    char *p;
+    size_t i;
+
+    if(posix_memalign((void **)&chunk, POLLER_CACHELINE,
+                      sizeof (struct __poller_slab_chunk) +
+                      poller->slab_nodes * POLLER_NODE_STRIDE) != 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    list_add(&chunk->list, &poller->slab_chunks);
+    p = (char *)(chunk + 1);
+    for(i = 0; i < poller->slab_nodes; i++)
+    {
+        node = (struct __poller_node *)(p + i * POLLER_NODE_STRIDE);
+        node->from_slab = 1;
+        node->res = poller->slab_free;
+        poller->slab_free = node;
+    }
+
+    return 0;
+}
+
+static struct __poller_node *__poller_alloc_node(poller_t *poller)
+{
+    struct __poller_node *node;
+
+    if(poller->slab_nodes == 0 || !__poller_in_thread(poller))
+    {
+        node = (struct __poller_node *)malloc(sizeof (struct __poller_node));
+        if(node)
+            node->from_slab = 0;
+
+        return node;
+    }
+
+    if(!poller->slab_free)
+    {
+        poller->slab_free = __atomic_exchange_n(&poller->slab_returned, NULL,
+                                                __ATOMIC_ACQUIRE);
+        if(!poller->slab_free && __poller_slab_grow(poller) < 0)
+            return NULL;
+    }
+
+    node = poller->slab_free;
+    poller->slab_free = node->res;
+    return node;
+}
+
+static void __poller_free_node(struct __poller_node *node, poller_t *poller)
+{
+    if(!node)
+        return;
+
+    if(!node->from_slab)
+        free(node);
+    else if(__poller_in_thread(poller))
+    {
+        node->res = poller->slab_free;
+        poller->slab_free = node;
+    }
+    else
+    {
+        node->res = __atomic_load_n(&poller->slab_returned, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&poller->slab_returned, &node->res, node, 1,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+}
+
+static void __poller_slab_destroy(poller_t *poller)
+{
+    struct list_head *pos, *tmp;
+
+    list_for_each_safe(pos, tmp, &poller->slab_chunks)
+        free(list_entry(pos, struct __poller_slab_chunk, list));
+}
+
+/*
+ * All results go through here. With a batch callback, results produced on
+ * the poller thread are collected and handed over together at the end of
+ * each loop iteration (or when the array fills up); results produced
+ * elsewhere, e.g. poller_del() on a stopped poller, are passed one by one.
+ */
+
+/*
+ * Most statistics are written by the poller thread only, so a relaxed
+ * store of the incremented value is enough. Counters that are also bumped
+ * in user threads use __STAT_INC_SHARED, an atomic add. Callbacks that a
+ * stopped poller runs in user threads are counted apart, in
+ * 'stopped_callbacks', so the poller thread keeps a plain increment for
+ * its own. poller_get_stats() reads every counter with a relaxed load
+ * from any thread.
+ */
+#define __STAT_ADD(var, n) \
+    __atomic_store_n(&(var), (var) + (n), __ATOMIC_RELAXED)
+#define __STAT_INC_SHARED(var) \
+    __atomic_fetch_add(&(var), 1, __ATOMIC_RELAXED)
+
+static inline void __poller_hist_add(struct poller_histogram *hist,
+                                     unsigned long long value)
+{
+    int i = value ? 64 - __builtin_clzll(value) : 0;
+
+    if(i >= POLLER_HIST_BUCKETS)
+        i = POLLER_HIST_BUCKETS - 1;
+
+    __STAT_ADD(hist->buckets[i], 1);
+    __STAT_ADD(hist->count, 1);
+    __STAT_ADD(hist->sum, value);
+}
+
+static inline long long __timespec_diff_ns(const struct timespec *end,
+                                           const struct timespec *begin)
+{
+    return (end->tv_sec - begin->tv_sec) * 1000000000LL +
+           (end->tv_nsec - begin->tv_nsec);
+}
+
+#ifdef POLLER_PROFILE
+
+/*
+ * Poller thread profiling, compiled in with -DPOLLER_PROFILE. The phases
+ * below are nested at run time, and each distinct nesting path gets its
+ * own entry that accumulates self time (children excluded) in TSC cycles
+ * (nanoseconds on other architectures). poller_profile_format() prints
+ * the paths in the folded-stack format that flamegraph.pl reads.
+ */
+
+enum
+{
+    PROF_WAIT = 1,
+    PROF_SET_TIMER,
+    PROF_SETTIME,
+    PROF_TIMEOUT,
+    PROF_TIMEOUT_LOCKED,
+    PROF_PIPE,
+    PROF_FLUSH,
+    PROF_CALLBACK,
+    PROF_APPEND,
+    PROF_SYS_READ,
+    PROF_SSL_READ,
+    PROF_SYS_WRITE,
+    PROF_SSL_WRITE,
+    PROF_OP_BASE,
+    PROF_PHASES = PROF_OP_BASE + POLLER_STATS_OPS
+};
+
+static const char *__prof_phase_names[PROF_OP_BASE] = {
+    "poller", "wait", "set_timer", "timerfd_settime", "handle_timeout",
+    "locked", "handle_pipe", "flush_results", "callback", "append",
+    "sys_read", "SSL_read", "sys_writev", "SSL_write",
+};
+
+static const char *__prof_op_names[POLLER_STATS_OPS] = {
+    "timer", "read", "write", "listen", "connect", "recvfrom",
+    "ssl_accept", "ssl_connect", "ssl_shutdown", "event", "notify",
+    "sendto", "listen_batch", "sendfile", "op14", "op15",
+};
+
+#define PROF_PATHS_MAX  256
+#define PROF_DEPTH_MAX  16
+
+struct __poller_profile
+{
+    struct
+    {
+        unsigned long long self;
+        unsigned long long calls;
+        int parent;
+        int phase;
+    } paths[PROF_PATHS_MAX];
+    int npaths;
+    int depth;
+    struct
+    {
+        int path;
+        unsigned long long start;
+        unsigned long long child;
+    } stack[PROF_DEPTH_MAX];
+    unsigned short child[PROF_PATHS_MAX][PROF_PHASES];
+};
+
+static inline unsigned long long __prof_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void __poller_prof_begin(int phase, poller_t *poller)
+{
+    struct __poller_profile *prof = poller->prof;
+    int parent;
+    int path;
+
+    if(prof->depth >= PROF_DEPTH_MAX)
+    {
+        prof->depth++;
+        return;
+    }
+
+    parent = prof->depth > 0 ? prof->stack[prof->depth - 1].path : 0;
+    path = prof->child[parent][phase];
+    if(path == 0)
+    {
+        /* Out of paths: charge the time to the parent. */
+        path = parent;
+        if(prof->npaths < PROF_PATHS_MAX)
+        {
+            path = prof->npaths;
+            prof->paths[path].parent = parent;
+            prof->paths[path].phase = phase;
+            prof->child[parent][phase] = path;
+            __atomic_store_n(&prof->npaths, path + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    prof->stack[prof->depth].path = path;
+    prof->stack[prof->depth].child = 0;
+    prof->stack[prof->depth].start = __prof_now();
+    prof->depth++;
+}
+
+static void __poller_prof_end(poller_t *poller)
+{
+    struct __poller_profile *prof = poller->prof;
+    unsigned long long elapsed;
+    int i;
+
+    if(--prof->depth >= PROF_DEPTH_MAX)
+        return;
+
+    i = prof->depth;
+    elapsed = __prof_now() - prof->stack[i].start;
+    if(elapsed > prof->stack[i].child)
+        __STAT_ADD(prof->paths[prof->stack[i].path].self, elapsed - prof->stack[i].child);
+
+    __STAT_ADD(prof->paths[prof->stack[i].path].calls, 1);
+    if(i > 0)
+        prof->stack[i - 1].child += elapsed;
+}
+
+static struct __poller_profile *__poller_prof_create(void)
+{
+    struct __poller_profile *prof;
+
+    prof = (struct __poller_profile *)calloc(1, sizeof (struct __poller_profile));
+    if(prof)
+        prof->npaths = 1;
+
+    return prof;
+}
+
+/* The profile belongs to the poller thread. Callbacks of a stopped poller
+ * run in user threads and are left out. */
+# define __PROF_BEGIN(poller, phase) \
+    do { if(__poller_in_thread(poller)) __poller_prof_begin(phase, poller); } while(0)
+# define __PROF_END(poller) \
+    do { if(__poller_in_thread(poller)) __poller_prof_end(poller); } while(0)
+#else
+# define __PROF_BEGIN(poller, phase)    ((void)0)
+# define __PROF_END(poller)             ((void)0)
+#endif
+
+static void __poller_watchdog_report(int kind, int operation, int fd, long long ns,
+                                     poller_t *poller)
+{
+    struct poller_slow_report report;
+
+    report.kind = kind;
+    report.operation = operation;
+    report.fd = fd;
+    report.duration_ns = ns;
+    poller->watchdog(&report, poller->context);
+}
+
+static void __poller_flush_results(poller_t *poller)
+{
+    struct timespec begin, end;
+    long long ns;
+
+    if(poller->nresults > 0)
+    {
+        if(poller->watchdog_ns)
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+
+        poller->batch_callback(poller->results, poller->nresults, poller->context);
+        poller->nresults = 0;
+        if(poller->watchdog_ns)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ns = __timespec_diff_ns(&end, &begin);
+            if(ns > poller->watchdog_ns)
+                __poller_watchdog_report(POLLER_SLOW_CALLBACK, -1, -1, ns, poller);
+        }
+    }
+}
+
+static void __poller_callback(struct __poller_node *node, poller_t *poller)
+{
+    struct poller_result *result = (struct poller_result *)node;
+    struct timespec begin, end;
+    int in_thread = __poller_in_thread(poller);
+    long long ns;
+    int operation;
+    int timed;
+    int fd;
+
+    if(in_thread)
+        __STAT_ADD(poller->stats.callbacks, 1);
+    else
+        __STAT_INC_SHARED(poller->stopped_callbacks);
+
+    if(!poller->batch_callback)
+    {
+        /* Callbacks of a stopped poller run in user threads: they are
+         * neither timed nor reported to the watchdog. */
+        timed = (poller->watchdog_ns || poller->stats_timing) && in_thread;
+        if(timed)
+        {
+            /* The callback owns the result once called. */
+            operation = node->data.operation;
+            fd = node->data.fd;
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+        }
+
+        __PROF_BEGIN(poller, PROF_CALLBACK);
+        poller->callback(result, poller->context);
+        __PROF_END(poller);
+        if(timed)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ns = __timespec_diff_ns(&end, &begin);
+            if(poller->stats_timing && operation >= 0 && operation < POLLER_STATS_OPS)
+                __poller_hist_add(&poller->stats.callback_ns[operation], ns);
+
+            if(poller->watchdog_ns && ns > poller->watchdog_ns)
+                __poller_watchdog_report(POLLER_SLOW_CALLBACK, operation, fd, ns, poller);
+        }
+    }
+    else if(in_thread)
+    {
+        poller->results[poller->nresults++] = result;
+        if(poller->nresults == POLLER_RESULTS_MAX)
+            __poller_flush_results(poller);
+    }
+    else
+        poller->batch_callback(&result, 1, poller->context);
+}
+
+static inline long __timeout_cmp(const struct __poller_node *node1, const struct __poller_node *node2)
+{
+    long ret = node1->timeout.tv_sec - node2->timeout.tv_sec;
+    if(ret == 0)
+    {
+        ret = node1->timeout.tv_nsec - node2->timeout.tv_nsec;
+    }
+    return ret;
+}
+
+static void __poller_tree_insert(struct __poller_node *node, poller_t *poller)
+{
+    struct rb_node **p = &poller->timeo_tree.rb_node;
+    struct rb_node *parent = NULL;
+    struct __poller_node *entry;
+
+    entry = rb_entry(poller->tree_last, struct __poller_node, rb);
+    if(!*p)
+    {
+        poller->tree_first = &node->rb;
+        poller->tree_last  = &node->rb;
+    }
+    else if(__timeout_cmp(node, entry) >= 0)
+    {
+        parent = poller->tree_last;
+        p = &parent->rb_right;
+        poller->tree_last = &node->rb;
+    }
+    else
+    {
+        do {
+            parent = *p;
+            entry = rb_entry(*p, struct __poller_node, rb);
+            if(__timeout_cmp(node,entry) < 0)
+            {
+                p = &(*p)->rb_left;
+            }
+            else
+            {
+                p = &(*p)->rb_right;
+            }
+        }while(*p);
+
+        if(p == &poller->tree_first->rb_left)
+        {
+            poller->tree_first = & node->rb;
+        }
+    }
+
+    node->in_rbtree = 1;
+    rb_link_node(&node->rb, parent, p);
+    rb_insert_color(&node->rb, &poller->timeo_tree);
+}
+
+static inline void __poller_tree_erase(struct __poller_node *node, poller_t *poller)
+{
+    if(&node->rb == poller->tree_first)
+    {
+        poller->tree_first = rb_next(&node->rb);
+    }
+
+    if(&node->rb == poller->tree_last)
+    {
+        poller->tree_last = rb_prev(&node->rb);
+    }
+
+    rb_erase(&node->rb, &poller->timeo_tree);
+    node->in_rbtree = 0;
+}
+
+/*
+ * Hierarchical timing wheel (POLLER_TIMEO_WHEEL), the classic five level
+ * layout with one millisecond ticks: 256 slots for the next 256ms, then
+ * 4 levels of 64 slots, each covering 64 times the one below. Insert and
+ * erase are a list operation on node->list; a node stays in a higher level
+ * until the wheel cascades it down. 'wheel_jiffies' is the next tick that
+ * has not been expired yet. 'wheel_first' caches __poller_wheel_first():
+ * inserts lower it, cascades and expiry make it look again. Erasing a node
+ * leaves it as is, which at worst wakes the poller once for nothing.
+ */
+
+static inline int __wheel_shift(int level)
+{
+    return WHEEL_ROOT_BITS + level * WHEEL_LEVEL_BITS;
+}
+
+static inline struct list_head *__wheel_slot(int level, unsigned long long index,
+                                             poller_t *poller)
+{
+    return &poller->wheel[level][index & WHEEL_LEVEL_MASK];
+}
+
+/* Deadlines are rounded up, so a node never expires before its timeout. */
+static inline unsigned long long __wheel_tick(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000ULL + (ts->tv_nsec + 999999) / 1000000;
+}
+
+static void __poller_wheel_insert(struct __poller_node *node, poller_t *poller)
+{
+    unsigned long long expires = __wheel_tick(&node->timeout);
+    unsigned long long delta;
+    unsigned long long first;
+    struct list_head *slot;
+    int level;
+
+    if(expires < poller->wheel_jiffies)
+        expires = poller->wheel_jiffies;
+
+    delta = expires - poller->wheel_jiffies;
+    if(delta < WHEEL_ROOT_SIZE)
+    {
+        slot = &poller->wheel_root[expires & WHEEL_ROOT_MASK];
+        first = expires;
+    }
+    else
+    {
+        if(delta > WHEEL_MAX_DELTA)
+            expires = poller->wheel_jiffies + WHEEL_MAX_DELTA;
+
+        for(level = 0; level < WHEEL_LEVELS - 1; level++)
+        {
+            if(delta < 1ULL << __wheel_shift(level + 1))
+                break;
+        }
+
+        slot = __wheel_slot(level, expires >> __wheel_shift(level), poller);
+        /* When the slot gets cascaded. */
+        first = expires >> __wheel_shift(level) << __wheel_shift(level);
+    }
+
+    list_add_tail(&node->list, slot);
+    node->in_wheel = 1;
+    poller->wheel_count++;
+    if(first < poller->wheel_first)
+        poller->wheel_first = first;
+}
+
+static inline void __poller_wheel_erase(struct __poller_node *node, poller_t *poller)
+{
+    list_del(&node->list);
+    node->in_wheel = 0;
+    poller->wheel_count--;
+}
+
+static int __poller_wheel_cascade(int level, poller_t *poller)
+{
+    unsigned long long index = poller->wheel_jiffies >> __wheel_shift(level);
+    struct __poller_node *node;
+    struct list_head *pos, *tmp;
+    LIST_HEAD(list);
+
+    list_splice_init(__wheel_slot(level, index, poller), &list);
+    poller->wheel_first_valid = 0;
+    list_for_each_safe(pos, tmp, &list)
+    {
+        node = list_entry(pos, struct __poller_node, list);
+        poller->wheel_count--;
+        __poller_wheel_insert(node, poller);
+    }
+
+    return index & WHEEL_LEVEL_MASK;
+}
+
+/* Move every node due at or before tick 'now' onto 'expired'. */
+static void __poller_wheel_expire(unsigned long long now, struct list_head *expired,
+                                  poller_t *poller)
+{
+    struct __poller_node *node;
+    struct list_head *pos, *tmp;
+    struct list_head *slot;
+    int level;
+
+    while(poller->wheel_jiffies <= now)
+    {
+        if(poller->wheel_count == 0)
+        {
+            poller->wheel_jiffies = now + 1;
+            break;
+        }
+
+        if((poller->wheel_jiffies & WHEEL_ROOT_MASK) == 0)
+        {
+            for(level = 0; level < WHEEL_LEVELS; level++)
+            {
+                if(__poller_wheel_cascade(level, poller) != 0)
+                    break;
+            }
+        }
+
+        slot = &poller->wheel_root[poller->wheel_jiffies & WHEEL_ROOT_MASK];
+        list_for_each_safe(pos, tmp, slot)
+        {
+            node = list_entry(pos, struct __poller_node, list);
+            __poller_wheel_erase(node, poller);
+            list_add_tail(&node->list, expired);
+        }
+
+        poller->wheel_jiffies++;
+    }
+
+    if(poller->wheel_first < poller->wheel_jiffies)
+        poller->wheel_first_valid = 0;
+}
+
+/*
+ * Earliest tick at which anything in the wheel may expire. For the higher
+ * levels this is the tick their slot gets cascaded, which is a lower bound:
+ * waking up there is enough to make progress.
+ */
+static unsigned long long __poller_wheel_scan(poller_t *poller)
+{
+    unsigned long long j = poller->wheel_jiffies;
+    unsigned long long best = ~0ULL;
+    unsigned long long target;
+    unsigned long long cur;
+    unsigned long long i;
+    int shift;
+    int level;
+
+    for(i = 0; i < WHEEL_ROOT_SIZE; i++)
+    {
+        if(!list_empty(&poller->wheel_root[(j + i) & WHEEL_ROOT_MASK]))
+        {
+            best = j + i;
+            break;
+        }
+    }
+
+    for(level = 0; level < WHEEL_LEVELS; level++)
+    {
+        shift = __wheel_shift(level);
+        cur = j >> shift;
+        for(i = 0; i < WHEEL_LEVEL_SIZE; i++)
+        {
+            if(list_empty(__wheel_slot(level, cur + i, poller)))
+                continue;
+
+            target = cur + i;
+            if(i == 0 && (j & ((1ULL << shift) - 1)) != 0)
+                target += WHEEL_LEVEL_SIZE;
+
+            if(target << shift < best)
+                best = target << shift;
+
+            if(i != 0)
+                break;
+        }
+    }
+
+    return best;
+}
+
+static int __poller_wheel_first(unsigned long long *first, poller_t *poller)
+{
+    if(poller->wheel_count == 0)
+    {
+        poller->wheel_first = ~0ULL;
+        poller->wheel_first_valid = 1;
+        return 0;
+    }
+
+    if(!poller->wheel_first_valid)
+    {
+        poller->wheel_first = __poller_wheel_scan(poller);
+        poller->wheel_first_valid = 1;
+    }
+
+    *first = poller->wheel_first;
+    return 1;
+}
+
+static void __poller_wheel_init(int timeo_type, poller_t *poller)
+{
+    struct timespec now;
+    int level;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    poller->timeo_type = timeo_type;
+    poller->wheel_count = 0;
+    poller->wheel_jiffies = now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+    poller->wheel_next = ~0ULL;
+    poller->wheel_first = ~0ULL;
+    poller->wheel_first_valid = 1;
+    for(i = 0; i < WHEEL_ROOT_SIZE; i++)
+        INIT_LIST_HEAD(&poller->wheel_root[i]);
+
+    for(level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for(i = 0; i < WHEEL_LEVEL_SIZE; i++)
+            INIT_LIST_HEAD(&poller->wheel[level][i]);
+    }
+}
+
+/* Empty the wheel onto 'list', for poller_stop(). */
+static void __poller_wheel_splice(struct list_head *list, poller_t *poller)
+{
+    struct __poller_node *node;
+    struct list_head *pos;
+    int level;
+    int i;
+
+    for(i = 0; i < WHEEL_ROOT_SIZE; i++)
+        list_splice_init(&poller->wheel_root[i], list);
+
+    for(level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for(i = 0; i < WHEEL_LEVEL_SIZE; i++)
+            list_splice_init(&poller->wheel[level][i], list);
+    }
+
+    list_for_each(pos, list)
+    {
+        node = list_entry(pos, struct __poller_node, list);
+        node->in_wheel = 0;
+    }
+
+    poller->wheel_count = 0;
+    poller->wheel_next = ~0ULL;
+    poller->wheel_first = ~0ULL;
+    poller->wheel_first_valid = 1;
+}
+
+static inline void __wheel_tick_to_timespec(unsigned long long tick, struct timespec *ts)
+{
+    ts->tv_sec = tick / 1000;
+    ts->tv_nsec = tick % 1000 * 1000000;
+}
+
+static inline void __poller_node_erase(struct __poller_node *node, poller_t *poller)
+{
+    if(node->in_rbtree)
+        __poller_tree_erase(node, poller);
+    else if(node->in_wheel)
+        __poller_wheel_erase(node, poller);
+    else
+        list_del(&node->list);
+}
+
+static int __poller_remove_node(struct __poller_node *node, poller_t *poller)
+{
+    int removed;
+
+    pthread_mutex_lock(&poller->mutex);
+    removed = node->removed;
+    if(!removed)
+    {
+        __poller_clear_node(node->data.fd, poller);
+
+        __poller_node_erase(node, poller);
+
+        __poller_del_fd(node->data.fd, node->event, node, poller);
+    }
+
+    pthread_mutex_unlock(&poller->mutex);
+    return removed;
+}
+
+static void __poller_complete_message(struct __poller_node *res, struct __poller_node *node,
+                                      poller_t *poller)
+{
+    res->data = node->data;
+    res->error = 0;
+    res->state = PR_ST_SUCCESS;
+    __poller_callback(res, poller);
+
+    node->data.message = NULL;
+    node->res = NULL;
+}
+
+static int __poller_append_message(const void *buf, size_t *n,struct __poller_node *node, poller_t *poller)
+{
+    poller_message_t *msg = node->data.message;
+    struct __poller_node *res;
+    int ret;
+
+    if(!msg)
+    {
+        res = __poller_alloc_node(poller);
+        if(!res)
+            return -1;
+
+        msg = node->data.create_message(node->data.context);
+        if(!msg)
+        {
+            __poller_free_node(res, poller);
+            return -1;
+        }
+
+        node->data.message = msg;
+        node->res = res;
+    }
+    else
+    {
+        res = node->res;
+    }
+
+    ret = msg->append(buf, n, msg);
+    if(ret > 0)
+        __poller_complete_message(res, node, poller);
+
+    return ret;
+}
+
+/* 'n' bytes were read straight into the buffer from msg->get_buffer(). */
+static int __poller_commit_message(size_t n, struct __poller_node *node, poller_t *poller)
+{
+    poller_message_t *msg = node->data.message;
+    int ret;
+
+    ret = msg->commit(n, msg);
+    if(ret > 0)
+        __poller_complete_message(node->res, node, poller);
+
+    return ret;
+}
+
+static int __poller_handle_ssl_error(struct __poller_node *node, int ret, poller_t *poller)
+{
+    int error = SSL_get_error(node->data.ssl, ret);
+    int event;
+
+    switch(error)
+    {
+        case SSL_ERROR_WANT_READ:
+            event = EPOLLIN | EPOLLET;
+            break;
+
+        case SSL_ERROR_WANT_WRITE:
+            event = EPOLLOUT | EPOLLET;
+            break;
+
+        default:
+            errno = -error;
+
+        case SSL_ERROR_SYSCALL:
+            return -1;
+    }
+
+    pthread_mutex_lock(&poller->mutex);
+    if(!node->removed)
+    {
+        ret = __poller_mod_fd(node->data.fd, node->event, event, node, poller);
+        if(ret >= 0)
+            node->event = event;
+    }
+    else
+    {
+        ret = 0;
+    }
+    pthread_mutex_unlock(&poller->mutex);
+
+    return ret;
+}
+
+/*
+ * kernel TLS. With poller_params.ktls, SSL_OP_ENABLE_KTLS is set on every
+ * SSL added for PD_OP_SSL_ACCEPT or PD_OP_SSL_CONNECT, and OpenSSL hands
+ * the keys to the kernel when the handshake completes, for each direction
+ * the kernel supports with the negotiated cipher. Later nodes on the same
+ * SSL record which directions took in 'ktls'. Those use plain writev(),
+ * read() and sendfile() on the socket; the rest stay on SSL_write() and
+ * SSL_read().
+ */
+
+#define POLLER_KTLS_TX  1
+#define POLLER_KTLS_RX  2
+
+static char __poller_ktls_setup(const struct poller_data *data, poller_t *poller)
+{
+    char ktls = 0;
+
+#ifdef POLLER_KTLS
+    if(!poller->ktls || !data->ssl)
+        return 0;
+
+    switch(data->operation)
+    {
+        case PD_OP_SSL_ACCEPT:
+        case PD_OP_SSL_CONNECT:
+            SSL_set_options(data->ssl, SSL_OP_ENABLE_KTLS);
+            break;
+        default:
+            if(BIO_get_ktls_send(SSL_get_wbio(data->ssl)))
+                ktls |= POLLER_KTLS_TX;
+            if(BIO_get_ktls_recv(SSL_get_rbio(data->ssl)))
+                ktls |= POLLER_KTLS_RX;
+            break;
+    }
+#endif
+
+    return ktls;
+}
+
+/* Records other than application data make read() fail with EIO; those,
+ * and whatever OpenSSL buffered before the switch, go through SSL_read(). */
+static inline int __poller_ktls_read_ok(struct __poller_node *node)
+{
+    return (node->ktls & POLLER_KTLS_RX) && !SSL_has_pending(node->data.ssl);
+}
+
+#ifdef POLLER_IO_URING
+/*
+ * PD_OP_READ through the ring: the kernel has already received into
+ * provided buffers, one per completion, in order. Each is appended as a
+ * read() into poller->buf would be, and given back, also when the node
+ * is done or gone.
+ */
+static void __poller_handle_uring_recv(struct __poller_node *node, poller_t *poller)
+{
+    struct __poller_uring_cqe *cqe;
+    int state = 1;
+    int error = 0;
+    ssize_t nleft;
+    size_t n;
+    char *p;
+    int i;
+
+    for(i = node->uring_head; i >= 0; i = cqe->next)
+    {
+        cqe = &poller->uring_cqes[i];
+        if(state > 0 && !node->removed)
+        {
+            nleft = cqe->res;
+            if(nleft > 0)
+            {
+                __STAT_ADD(poller->stats.bytes_read, nleft);
+                p = __poller_uring_buf(cqe->flags, poller);
+                __PROF_BEGIN(poller, PROF_APPEND);
+                do
+                {
+                    n = nleft;
+                    if(__poller_append_message(p, &n, node, poller) >= 0)
+                    {
+                        nleft -= n;
+                        p += n;
+                    }
+                    else
+                    {
+                        error = errno;
+                        state = -1;
+                        break;
+                    }
+                } while(nleft > 0);
+                __PROF_END(poller);
+            }
+            else if(nleft == 0)
+                state = 0;
+            else
+            {
+                error = -cqe->res;
+                state = -1;
+            }
+        }
+
+        if(cqe->flags & IORING_CQE_F_BUFFER)
+            __poller_uring_recycle(cqe->flags, poller);
+    }
+
+    if(state > 0 || node->removed)
+        return;
+
+    if(__poller_remove_node(node, poller))
+        return;
+
+    node->error = error;
+    node->state = state == 0 ? PR_ST_FINISHED : PR_ST_ERROR;
+    __poller_free_node(node->res, poller);
+    __poller_callback(node, poller);
+}
+#endif
+
+static void __poller_handle_read(struct __poller_node *node, poller_t *poller)
+{
+    poller_message_t *msg;
+    ssize_t nleft;
+    size_t size;
+    size_t n;
+    int use_ssl;
+    char *p;
+
+#ifdef POLLER_IO_URING
+    if(node->uring_op)
+    {
+        __poller_handle_uring_recv(node, poller);
+        return;
+    }
+#endif
+
+    while(1)
+    {
+        /*
+         * A message that already knows how much more it expects (typically
+         * a large body) may lend its own storage, so the bytes are not
+         * copied through poller->buf. The first bytes of every message
+         * still go through append().
+         */
+        msg = node->data.message;
+        p = NULL;
+        if(msg && poller->message_buffers && msg->get_buffer)
+        {
+            size = 0;
+            p = (char *)msg->get_buffer(&size, msg);
+        }
+
+        if(!p || size == 0)
+        {
+            msg = NULL;
+            p = poller->buf;
+            size = POLLER_BUFSIZE;
+        }
+
+        use_ssl = node->data.ssl && !__poller_ktls_read_ok(node);
+        if(!use_ssl)
+        {
+            __PROF_BEGIN(poller, PROF_SYS_READ);
+            nleft = read(node->data.fd, p, size);
+            __PROF_END(poller);
+            if(nleft < 0)
+            {
+                if(errno == EAGAIN)
+                {
+                    __STAT_ADD(poller->stats.read_eagain, 1);
+                    return;
+                }
+
+                if(errno == EIO && node->data.ssl)
+                    use_ssl = 1;
+            }
+        }
+
+        if(use_ssl)
+        {
+            __PROF_BEGIN(poller, PROF_SSL_READ);
+            nleft = SSL_read(node->data.ssl, p, size);
+            __PROF_END(poller);
+            if(nleft < 0)
+            {
+                if(__poller_handle_ssl_error(node,nleft,poller) >= 0)
+                {
+                    __STAT_ADD(poller->stats.read_eagain, 1);
+                    return;
+                }
+            }
+        }
+
+        if(nleft <= 0)
+            break;
+
+        __STAT_ADD(poller->stats.bytes_read, nleft);
+
+        __PROF_BEGIN(poller, PROF_APPEND);
+        if(msg)
+        {
+            if(__poller_commit_message(nleft, node, poller) < 0)
+                nleft = -1;
+        }
+        else
+        {
+            do
+            {
+                n = nleft;
+                if(__poller_append_message(p, &n, node, poller) >=0)
+                {
+                    nleft -= n;
+                    p += n;
+                }
+                else
+                    nleft = -1;
+            }while(nleft > 0);
+        }
+
+        __PROF_END(poller);
+
+        if(nleft < 0)
+            break;
+
+        if(node->removed)
+            return;
+    }
+
+    if(__poller_remove_node(node,poller))
+        return;
+
+    if(nleft == 0)
+    {
+        node->error = 0;
+        node->state = PR_ST_FINISHED;
+    }
+    else
+    {
+        node->error = errno;
+        node->state = PR_ST_ERROR;
+    }
+
+    __poller_free_node(node->res, poller);
+    __poller_callback(node, poller);
+}
+
+#ifndef IOV_MAX
+# ifdef UIO_MAXIOV
+#  define IOV_MAX UIO_MAXIOV
+# else
+#  define IOV_MAX 1024
+# endif
+#endif
+
+#ifdef POLLER_ZEROCOPY
+
+/*
+ * Zero-copy PD_OP_WRITE. A writev() worth of at least zerocopy_threshold
+ * bytes goes out with sendmsg(MSG_ZEROCOPY). The kernel numbers these
+ * sends per socket, from 0 when SO_ZEROCOPY is turned on, and reports
+ * ranges of released sequence numbers on the socket error queue, which
+ * wakes the node with EPOLLERR. The next number of each socket is kept
+ * in its fd table slot, as it outlives the node, together with whether
+ * SO_ZEROCOPY is known to be on or refused, so only the first large write
+ * on a socket asks the kernel. A node starts 'zc_done' and 'zc_next' at
+ * that number, so ranges left over from earlier nodes on the same socket
+ * fall below it. Releases come in order for a stream socket: 'zc_done' is
+ * one past the highest released number, and the node finishes once it
+ * reaches zc_next. Once the kernel reports that it copied anyway
+ * (loopback, no NIC support), the node stops asking.
+ */
+
+static inline int __poller_zerocopy_pending(const struct __poller_node *node)
+{
+    return (int)(node->zc_done - node->zc_next) < 0;
+}
+
+static int __poller_zerocopy_ok(struct __poller_node *node, const struct iovec *iov,
+                                int iovcnt, poller_t *poller)
+{
+    struct __poller_fd_slot *slot;
+    socklen_t optlen = sizeof (int);
+    size_t len = 0;
+    int one = 1;
+    int on = 0;
+    int i;
+
+    /* kTLS sockets do not take MSG_ZEROCOPY. */
+    if(poller->zerocopy_threshold == 0 || node->zc_off || node->data.ssl)
+        return 0;
+
+    for(i = 0; i < iovcnt && len < poller->zerocopy_threshold; i++)
+        len += iov[i].iov_len;
+
+    if(len < poller->zerocopy_threshold)
+        return 0;
+
+    if(!node->zc_on)
+    {
+        slot = __poller_node_slot(node->data.fd, poller);
+        if(slot->zc_state == 0)
+        {
+            /* A socket that is not yet on starts over from 0, even if an
+             * earlier socket with the same fd was. */
+            if(getsockopt(node->data.fd, SOL_SOCKET, SO_ZEROCOPY, &on, &optlen) < 0 || !on)
+            {
+                if(setsockopt(node->data.fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one) < 0)
+                    slot->zc_state = -1;
+                else
+                    slot->zc_seq = 0;
+            }
+
+            if(slot->zc_state == 0)
+                slot->zc_state = 1;
+        }
+
+        if(slot->zc_state < 0)
+        {
+            node->zc_off = 1;
+            return 0;
+        }
+
+        node->zc_next = slot->zc_seq;
+        node->zc_done = slot->zc_seq;
+        node->zc_on = 1;
+    }
+
+    return 1;
+}
+
+static ssize_t __poller_zerocopy_send(struct __poller_node *node, struct iovec *iov,
+                                      int iovcnt, poller_t *poller)
+{
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof (struct msghdr));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    n = sendmsg(node->data.fd, &msg, MSG_ZEROCOPY);
+    if(n > 0)
+        __poller_node_slot(node->data.fd, poller)->zc_seq = ++node->zc_next;
+    else if(n < 0 && errno == ENOBUFS)
+        n = writev(node->data.fd, iov, iovcnt);
+
+    return n;
+}
+
+static void __poller_zerocopy_reap(struct __poller_node *node)
+{
+    char control[128];
+    struct sock_extended_err *serr;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+
+    while(__poller_zerocopy_pending(node))
+    {
+        memset(&msg, 0, sizeof (struct msghdr));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if(recvmsg(node->data.fd, &msg, MSG_ERRQUEUE) < 0)
+            break;
+
+        for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if(!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            if((int)(serr->ee_data + 1 - node->zc_done) > 0)
+                node->zc_done = serr->ee_data + 1;
+
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                node->zc_off = 1;
+        }
+    }
+}
+
+#endif
+
+/*
+ * One SSL_write() for the head of an iovec array. Small iovecs would each
+ * become a TLS record of their own, with its own header, MAC and often
+ * TCP segment, so consecutive ones are gathered through poller->buf into
+ * writes of up to one full record. An SSL_write() that must be retried
+ * has to be given the same bytes again; gathering the same unsent iovecs
+ * does exactly that, and SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER lets them
+ * come from poller->buf, which other nodes use in between. The mode is set
+ * once, when the write node is created.
+ */
+
+#define POLLER_SSL_RECORD   16384
+
+static int __poller_ssl_write(SSL *ssl, const struct iovec *iov, int iovcnt,
+                              poller_t *poller)
+{
+    size_t len = 0;
+    size_t n;
+    int i;
+
+    if(iovcnt == 1 || iov->iov_len >= POLLER_SSL_RECORD || poller->ssl_gather_off)
+        return SSL_write(ssl, iov->iov_base, iov->iov_len);
+
+    for(i = 0; i < iovcnt && len < POLLER_SSL_RECORD; i++)
+    {
+        n = iov[i].iov_len;
+        if(n > POLLER_SSL_RECORD - len)
+            n = POLLER_SSL_RECORD - len;
+
+        memcpy(poller->buf + len, iov[i].iov_base, n);
+        len += n;
+    }
+
+    return SSL_write(ssl, poller->buf, len);
+}
+
+static void __poller_handle_write(struct __poller_node *node, poller_t *poller)
+{
+    struct iovec *iov = node->data.write_iov;
+    size_t count = 0;
+    ssize_t nleft;
+    int iovcnt;
+    int ret = 0;
+
+#ifdef POLLER_ZEROCOPY
+    if(__poller_zerocopy_pending(node))
+        __poller_zerocopy_reap(node);
+#endif
+
+    while(node->data.iovcnt > 0)
+    {
+        if(!node->data.ssl || (node->ktls & POLLER_KTLS_TX))
+        {
+            iovcnt = node->data.iovcnt;
+            if(iovcnt > IOV_MAX)
+                iovcnt = IOV_MAX;
+
+            __PROF_BEGIN(poller, PROF_SYS_WRITE);
+#ifdef POLLER_ZEROCOPY
+            if(__poller_zerocopy_ok(node, iov, iovcnt, poller))
+                nleft = __poller_zerocopy_send(node, iov, iovcnt, poller);
+            else
+#endif
+            nleft = writev(node->data.fd, iov, iovcnt);
+            __PROF_END(poller);
+            if(nleft < 0)
+            {
+                ret = errno == EAGAIN ? 0:-1;
+                break;
+            }
+        }
+        else if(iov->iov_len > 0)
+        {
+            __PROF_BEGIN(poller, PROF_SSL_WRITE);
+            nleft = __poller_ssl_write(node->data.ssl, iov, node->data.iovcnt, poller);
+            __PROF_END(poller);
+            if(nleft <= 0)
+            {
+                ret = __poller_handle_ssl_error(node, nleft, poller);
+                break;
+            }
+        }
+        else
+            nleft = 0;
+
+        count += nleft;
+
+        do{
+            if(nleft >= iov->iov_len)
+            {
+                nleft -= iov->iov_len;
+                iov->iov_base = (char *)iov->iov_base + iov->iov_len;
+                iov->iov_len = 0;
+                iov++;
+                node->data.iovcnt--;
+            }
+            else{
+                iov->iov_base = (char *)iov->iov_base + nleft;
+                iov->iov_len -= nleft;
+                break;
+            }
+        }while(node->data.iovcnt > 0);
+    }
 
-    if(!msg)
+    node->data.write_iov = iov;
+    __STAT_ADD(poller->stats.bytes_written, count);
+    if(node->data.iovcnt > 0 && ret >= 0)
     {
-        res = (stuct __poller_node *)malloc(sizeof (struct __poller_node));
-        if(!res)
-            return -1;
+        __STAT_ADD(poller->stats.write_eagain, 1);
+        if(count == 0)
+            return;
+        if(node->data.partial_written(count, node->data.context) >= 0)
+            return;
+    }
+#ifdef POLLER_ZEROCOPY
+    else if(ret >= 0 && __poller_zerocopy_pending(node))
+    {
+        __poller_zerocopy_reap(node);
+        if(__poller_zerocopy_pending(node))
+            return;
+    }
+#endif
 
-        msg = node->data.create_messgae(node->data.context);
-        if(!msg)
-        {
-            free(!msg);
-            return -1;
-        }
+    if(__poller_remove_node(node, poller))
+        return;
 
-        node->data.message = msg;
-        node->res = res;
+    if(node->data.iovcnt == 0)
+    {
+        node->error =0;
+        node->state = PR_ST_FINISHED;
     }
     else
     {
-        res = node->res;
+        node->error = errno;
+        node->state = PR_ST_ERROR;
     }
 
-    ret = msg->append(buf, n, msg);
-    if(ret > 0)
-    {
-        res->data = node->data;
-        res->error = 0;
-        res->state = PR_ST_SUCCESS;
-        poller->callback((struct poller_result *)res,poller->context);
+    __poller_callback(node, poller);
+}
 
-        node->data.message = NULL;
-        node->res = NULL;
-    }
+/*
+ * PD_OP_SENDTO: 'iovcnt' datagrams described by the msghdr array
+ * 'write_msg', sent as EPOLLOUT allows. On Linux a run of datagrams for
+ * the same destination whose payloads all have the size of the first
+ * (the last may be shorter) goes out as one UDP_SEGMENT (GSO) send;
+ * everything else goes through sendmmsg(). Progress is reported through
+ * partial_written() in bytes, as for PD_OP_WRITE.
+ */
 
-    return ret;
+#define POLLER_SENDTO_BATCH     64
+#define POLLER_GSO_SEGMENTS     64
+#define POLLER_GSO_MAX_BYTES    65000
+
+static size_t __poller_msg_len(const struct msghdr *msg)
+{
+    size_t len = 0;
+    size_t i;
+
+    for(i = 0; i < msg->msg_iovlen; i++)
+        len += msg->msg_iov[i].iov_len;
+
+    return len;
 }
 
-static int __poller_handle_ssl_error(struct __poller_node *node, int ret, poller_t *poller)
+#ifdef __linux__
+
+static int __poller_same_dest(const struct msghdr *a, const struct msghdr *b)
 {
-    int error = SSL_get_error(node->data.ssl, ret);
-    int event;
+    return a->msg_namelen == b->msg_namelen &&
+           memcmp(a->msg_name, b->msg_name, a->msg_namelen) == 0;
+}
 
-    switch(error)
+/* Returns the number of datagrams sent in one GSO send, 0 if the head of
+ * the queue does not form a run worth it, -1 on error. */
+static int __poller_sendto_gso(int fd, const struct msghdr *msg, int cnt,
+                               size_t *bytes)
+{
+    struct iovec iov[POLLER_GSO_SEGMENTS * 4];
+    char control[CMSG_SPACE(sizeof (uint16_t))];
+    struct cmsghdr *cmsg;
+    struct msghdr hdr;
+    size_t seg = __poller_msg_len(&msg[0]);
+    size_t total = 0;
+    size_t len;
+    int iovcnt = 0;
+    int n;
+
+    if(msg[0].msg_controllen != 0 || seg == 0)
+        return 0;
+
+    for(n = 0; n < cnt && n < POLLER_GSO_SEGMENTS; n++)
     {
-        case SSL_ERROR_WANT_READ:
-            event = EPOLLIN | EPOLLET;
+        len = __poller_msg_len(&msg[n]);
+        if(n > 0 && (!__poller_same_dest(&msg[0], &msg[n]) ||
+                     msg[n].msg_controllen != 0 || len > seg || len == 0))
             break;
 
-        case SSL_ERROR_WANT_WRITE:
-            event = EPOLLOUT | EPOLLET;
+        if(total + len > POLLER_GSO_MAX_BYTES ||
+            iovcnt + msg[n].msg_iovlen > POLLER_GSO_SEGMENTS * 4)
             break;
 
-        default:
-            error = -error;
+        memcpy(iov + iovcnt, msg[n].msg_iov, msg[n].msg_iovlen * sizeof (struct iovec));
+        iovcnt += msg[n].msg_iovlen;
+        total += len;
+        if(len < seg)
+        {
+            n++;
+            break;
+        }
+    }
 
-        case SSL_ERROR_SYSCALL:
+    if(n < 2)
+        return 0;
+
+    memset(&hdr, 0, sizeof (struct msghdr));
+    hdr.msg_name = msg[0].msg_name;
+    hdr.msg_namelen = msg[0].msg_namelen;
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = iovcnt;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof control;
+    cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof (uint16_t));
+    *(uint16_t *)CMSG_DATA(cmsg) = (uint16_t)seg;
+
+    if(sendmsg(fd, &hdr, 0) < 0)
+        return -1;
+
+    *bytes = total;
+    return n;
+}
+
+#endif
+
+/* Send from the head of the queue; returns datagrams sent or -1. */
+static int __poller_sendto_some(struct __poller_node *node, const struct msghdr *msg,
+                                int cnt, size_t *bytes)
+{
+    int fd = node->data.fd;
+#ifdef __linux__
+    struct mmsghdr mmsg[POLLER_SENDTO_BATCH];
+    int n = 0;
+    int i;
+
+    if(!node->gso_off)
+        n = __poller_sendto_gso(fd, msg, cnt, bytes);
+
+    if(n != 0)
+    {
+        if(n > 0 || errno == EAGAIN)
+            return n;
+
+        /* No GSO on this kernel, device or socket: the node stops trying.
+         * Another socket, or another route, may still take it. */
+        if(errno != EIO && errno != EINVAL && errno != ENOPROTOOPT &&
+            errno != EOPNOTSUPP)
             return -1;
+
+        node->gso_off = 1;
     }
 
-    pthread_mutex_lock(&poller->mutex);
-    if(!node->removed)
+    if(cnt > POLLER_SENDTO_BATCH)
+        cnt = POLLER_SENDTO_BATCH;
+
+    for(i = 0; i < cnt; i++)
     {
-        ret = __poller_mod_fd(node->data.fd, node->event, event, node, poller);
-        if(ret >= 0)
-            node->event = event;
+        mmsg[i].msg_hdr = msg[i];
+        mmsg[i].msg_len = 0;
+    }
+
+    n = sendmmsg(fd, mmsg, cnt, 0);
+    if(n < 0)
+        return -1;
+
+    *bytes = 0;
+    for(i = 0; i < n; i++)
+        *bytes += mmsg[i].msg_len;
+
+    return n;
+#else
+    ssize_t n = sendmsg(fd, msg, 0);
+
+    if(n < 0)
+        return -1;
+
+    *bytes = n;
+    return 1;
+#endif
+}
+
+static void __poller_handle_sendto(struct __poller_node *node, poller_t *poller)
+{
+    struct msghdr *msg = node->data.write_msg;
+    size_t count = 0;
+    size_t bytes;
+    int ret = 0;
+    int n;
+
+    while(node->data.iovcnt > 0)
+    {
+        n = __poller_sendto_some(node, msg, node->data.iovcnt, &bytes);
+        if(n < 0)
+        {
+            ret = errno == EAGAIN ? 0 : -1;
+            break;
+        }
+
+        count += bytes;
+        msg += n;
+        node->data.iovcnt -= n;
+    }
+
+    node->data.write_msg = msg;
+    __STAT_ADD(poller->stats.bytes_written, count);
+    if(node->data.iovcnt > 0 && ret >= 0)
+    {
+        __STAT_ADD(poller->stats.write_eagain, 1);
+        if(count == 0)
+            return;
+        if(node->data.partial_written(count, node->data.context) >= 0)
+            return;
+    }
+
+    if(__poller_remove_node(node, poller))
+        return;
+
+    if(node->data.iovcnt == 0)
+    {
+        node->error = 0;
+        node->state = PR_ST_FINISHED;
     }
     else
     {
-        ret = 0;
+        node->error = errno;
+        node->state = PR_ST_ERROR;
     }
-    pthread_mutex_unlock(&poller->mutex);
 
-    return ret;
+    __poller_callback(node, poller);
 }
 
-static void __poller_handler_read(struct __poller_node *node, poller_t *poller)
+/* One sendfile() call: bytes sent, or -1 with errno set. Some platforms
+ * return an error after a partial send; that is reported as progress. */
+static ssize_t __poller_sendfile(int sockfd, const struct poller_sendfile *sf)
 {
-    ssize_t nleft;
-    size_t n;
-    char *p;
+    size_t count = sf->count;
+    off_t len;
+
+    if(count > POLLER_SENDFILE_MAX)
+        count = POLLER_SENDFILE_MAX;
+
+#if defined(__linux__)
+    len = sf->offset;
+    return sendfile(sockfd, sf->fd, &len, count);
+#elif defined(__FreeBSD__)
+    len = 0;
+    if(sendfile(sf->fd, sockfd, sf->offset, count, NULL, &len, 0) < 0 && len == 0)
+        return -1;
 
-    while(1)
+    return len;
+#elif defined(__APPLE__)
+    len = count;
+    if(sendfile(sf->fd, sockfd, sf->offset, &len, NULL, 0) < 0 && len == 0)
+        return -1;
+
+    return len;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void __poller_handle_sendfile(struct __poller_node *node, poller_t *poller)
+{
+    struct poller_sendfile *sf = node->data.sendfile;
+    size_t count = 0;
+    ssize_t n;
+    int ret = 0;
+
+    while(sf->count > 0)
     {
-        p = poller->buf;
-        if(!node->data.ssl)
-        {
-            nleft = read(node->data.fd, p, POLLER_BUFSIZE);
-            if(nleft < 0)
-            {
-                if(errno == EAGAIN)
-                {
-                    return;
-                }
-            }
-        }
-        else
+        n = __poller_sendfile(node->data.fd, sf);
+        if(n <= 0)
         {
-            nleft = SSL_read(node->data.ssl, p, POLLER_BUFSIZE);
-            if(nleft < 0)
-            {
-                if(__poller_handle_ssl_error(node,nleft,poller) >= 0)
-                    return;
-            }
-        }
+            /* The file ended before 'count' bytes. */
+            if(n == 0)
+                errno = EIO;
 
-        if(nleft <= 0)
+            ret = errno == EAGAIN ? 0 : -1;
             break;
+        }
 
-        do
-        {
-            n = nleft;
-            if(__poller_append_message(p, &n, node, poller) >=0)
-            {
-                nleft -= n;
-                p += n;
-            }
-            else
-                nleft = -1;
-        }while(nleft > 0);
+        sf->offset += n;
+        sf->count -= n;
+        count += n;
+    }
 
-        if(node->removed)
+    __STAT_ADD(poller->stats.bytes_written, count);
+    if(sf->count > 0 && ret >= 0)
+    {
+        __STAT_ADD(poller->stats.write_eagain, 1);
+        if(count == 0)
+            return;
+        if(node->data.partial_written(count, node->data.context) >= 0)
             return;
     }
 
-    if(__poller_remove_node(node,poller))
+    if(__poller_remove_node(node, poller))
         return;
 
-    if(nleft == 0)
+    if(sf->count == 0)
     {
         node->error = 0;
         node->state = PR_ST_FINISHED;
@@ -476,106 +2998,166 @@ static void __poller_handler_read(struct __poller_node *node, poller_t *poller)
         node->state = PR_ST_ERROR;
     }
 
-    free(node->res);
-    poller->callback((struct poller_result *)node, poller->context);
+    __poller_callback(node, poller);
 }
 
-#ifndef TDV_MAX
-# ifdef UIO_MAXIOV
-#  define IOV_MAX UIO_MAXIOV
+/*
+ * With 'busy_poll_sockets', a socket gets its busy poll options once, when
+ * it comes into the poller: accepted by PD_OP_LISTEN(_BATCH), or added
+ * for PD_OP_CONNECT or PD_OP_RECVFROM. An added socket only gets them
+ * once its node is in the table, still under poller->mutex, so a failed
+ * add leaves the socket as it was and a node that completes at once cannot
+ * have its fd closed and reused first. Later nodes on it leave it alone.
+ * Failures (raising SO_BUSY_POLL above net.core.busy_read needs
+ * CAP_NET_ADMIN) are counted in busy_poll_errors.
+ */
+static void __poller_busy_poll_fd(int fd, poller_t *poller)
+{
+#ifdef SO_BUSY_POLL
+    int us = poller->busy_poll_ns / 1000;
+    int one = 1;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof us) < 0)
+    {
+        __STAT_INC_SHARED(poller->stats.busy_poll_errors);
+        return;
+    }
+# ifdef SO_PREFER_BUSY_POLL
+    if(setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof one) < 0)
+        __STAT_INC_SHARED(poller->stats.busy_poll_errors);
 # else
-#  define IOV_MAX 1024
+    (void)one;
 # endif
 #endif
+}
 
-static void __poller_handler_write(struct __poller_node *node, poller_t *poller)
+static inline void __poller_busy_poll_add(const struct poller_data *data, poller_t *poller)
 {
-    struct iovec *iov = node->data.wirite.iov;
-    size_t count = 0;
-    size_t nleft;
-    int iovcnt;
-    int ret;
+    if(poller->busy_poll_sockets && data->fd >= 0 &&
+        (data->operation == PD_OP_CONNECT || data->operation == PD_OP_RECVFROM))
+        __poller_busy_poll_fd(data->fd, poller);
+}
 
-    while(node->data.iovcnt > 0)
+#ifdef POLLER_IO_URING
+/*
+ * PD_OP_LISTEN and PD_OP_LISTEN_BATCH through the ring. Each accept
+ * request completes at most once per wakeup: the handler takes the peer
+ * address it got, then queues it again. PD_OP_LISTEN_BATCH hands all the
+ * connections of the wakeup to one accept_batch() call.
+ */
+static void __poller_handle_uring_accept(struct __poller_node *node, poller_t *poller)
+{
+    struct __poller_uring_accept *ua = __poller_node_slot(node->data.fd, poller)->uring_accept;
+    struct poller_accepted acc[POLLER_URING_ACCEPTS];
+    struct __poller_node *res = node->res;
+    struct __poller_uring_cqe *cqe;
+    unsigned int slots = 0;
+    int error = 0;
+    void *result;
+    int n = 0;
+    int i;
+    int k;
+
+    for(i = node->uring_head; i >= 0; i = cqe->next)
     {
-        if(!node->data.ssl)
+        cqe = &poller->uring_cqes[i];
+        k = cqe->slot - __URING_SLOT_ACCEPT;
+        slots |= 1U << k;
+        if(cqe->res >= 0)
         {
-            iovcnt = node->data.iovcnt;
-            if(iovcnt > IOV_MAX)
-                iovcnt = IOV_MAX;
+            acc[n].sockfd = cqe->res;
+            acc[n].addrlen = ua->addrlen[k];
+            memcpy(&acc[n].addr, &ua->addr[k], sizeof (struct sockaddr_storage));
+            if(poller->busy_poll_sockets)
+                __poller_busy_poll_fd(cqe->res, poller);
 
-            nleft = writev(node->data.fd, iov, iovcnt);
-            if(nleft < 0)
-            {
-                ret = errno == ENGAIN ? 0:-1;
-                break;
-            }
+            n++;
         }
-        else if(iov->iov_len > 0)
+        else if(cqe->res != -ECONNABORTED && cqe->res != -EAGAIN && cqe->res != -EINTR &&
+                 cqe->res != -EMFILE && cqe->res != -ENFILE)
+            error = -cqe->res;
+    }
+
+    pthread_mutex_lock(&poller->mutex);
+    if(!node->removed && !error)
+    {
+        for(k = 0; k < POLLER_URING_ACCEPTS; k++)
         {
-            nleft = SSL_write(node->data.ssl, iov->iov_base, iov->iov_len);
-            if(nleft <= 0)
-            {
-                ret = __poller_handle_ssl_error(node, nleft, poller);
-                break;
-            }
+            if(slots & (1U << k))
+                __poller_uring_prep_op(node, __URING_SLOT_ACCEPT + k, poller);
+        }
+    }
+
+    pthread_mutex_unlock(&poller->mutex);
+
+    i = 0;
+    while(i < n && !node->removed)
+    {
+        if(node->data.operation == PD_OP_LISTEN)
+        {
+            result = node->data.accept((const struct sockaddr *)&acc[i].addr,
+                                       acc[i].addrlen, acc[i].sockfd,
+                                       node->data.context);
+            i++;
         }
         else
-            nleft = 0;
+        {
+            result = node->data.accept_batch(acc + i, n - i, node->data.context);
+            i = n;
+        }
 
-        count += nleft;
+        if(!result)
+        {
+            error = errno;
+            break;
+        }
 
-        do{
-            if(nleft >= iov->iov_len)
-            {
-                nleft -= iov->iov_len;
-                iov->iov_base = (char *)iov->iov_base + iov_len;
-                iov->iov_len = 0;
-                iov++;
-                node->data.iovcnt--;
-            }
-            else{
-                iov->iov_base = (char *)iov->iov_base + nleft;
-                iov->iov_len -= nleft;
-                break;
-            }
-        }while(node->data.iovcnt > 0);
-    }
+        res->data = node->data;
+        res->data.result = result;
+        res->error = 0;
+        res->state = PR_ST_SUCCESS;
+        __poller_callback(res, poller);
 
-    node->data.write_iov = iov;
-    if(node->data.iovcnt > 0 && ret >= 0)
-    {
-        if(count == 0)
-            return;
-        if(node->data.partial_written(count, node->data.context) >= 0)
-            return;
+        res = __poller_alloc_node(poller);
+        node->res = res;
+        if(!res)
+        {
+            error = errno;
+            break;
+        }
     }
 
-    if(__poller_remove_node(node, poller))
-        return;
+    /* Undelivered connections. */
+    while(i < n)
+        close(acc[i++].sockfd);
 
-    if(node->data.iovcnt == 0)
-    {
-        node->error =0;
-        node->state = PR_ST_FINISHED;
-    }
-    else
-    {
-        node->error = errno;
-        node->state = PR_ST_ERROR;
-    }
+    if(!error || __poller_remove_node(node, poller))
+        return;
 
-    poller->callback((struct poller_result *)node, poller->context);
+    node->error = error;
+    node->state = PR_ST_ERROR;
+    __poller_free_node(node->res, poller);
+    __poller_callback(node, poller);
 }
+#endif
 
-static void __poller_handle_listen(struct _poller_node *node, poller_t *poller)
+static void __poller_handle_listen(struct __poller_node *node, poller_t *poller)
 {
     struct __poller_node *res = node->res;
     struct sockaddr_storage ss;
     struct sockaddr *addr = (struct sockaddr *)&ss;
     socklen_t addrlen;
+    void *result;
     int sockfd;
 
+#ifdef POLLER_IO_URING
+    if(node->uring_op)
+    {
+        __poller_handle_uring_accept(node, poller);
+        return;
+    }
+#endif
+
     while(1)
     {
         addrlen = sizeof(struct sockaddr_storage);
@@ -590,6 +3172,9 @@ static void __poller_handle_listen(struct _poller_node *node, poller_t *poller)
                 break;
         }
 
+        if(poller->busy_poll_sockets)
+            __poller_busy_poll_fd(sockfd, poller);
+
         result = node->data.accept(addr, addrlen, sockfd, node->data.context);
         if(!result)
             break;
@@ -598,9 +3183,9 @@ static void __poller_handle_listen(struct _poller_node *node, poller_t *poller)
         res->data.result = result;
         res->error = 0;
         res->state = PR_ST_SUCCESS;
-        poller->callback((struct poller_result *)res, poller->context);
+        __poller_callback(res, poller);
 
-        res = (struct __poller_node *)malloc(sizeof (struct __poller_node));
+        res = __poller_alloc_node(poller);
         node->res = res;
         if(!res)
             break;
@@ -614,8 +3199,128 @@ static void __poller_handle_listen(struct _poller_node *node, poller_t *poller)
 
     node->error = errno;
     node->state = PR_ST_ERROR;
-    free(node->res);
-    poller->callback((struct poller_result *)node, poller->context);
+    __poller_free_node(node->res, poller);
+    __poller_callback(node, poller);
+}
+
+static int __poller_accept(int fd, struct poller_accepted *acc)
+{
+    int sockfd;
+
+    acc->addrlen = sizeof (struct sockaddr_storage);
+#ifdef __linux__
+    sockfd = accept4(fd, (struct sockaddr *)&acc->addr, &acc->addrlen,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    sockfd = accept(fd, (struct sockaddr *)&acc->addr, &acc->addrlen);
+    if(sockfd >= 0)
+    {
+        if(fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) < 0 ||
+            fcntl(sockfd, F_SETFD, FD_CLOEXEC) < 0)
+        {
+            close(sockfd);
+            errno = ECONNABORTED;
+            return -1;
+        }
+    }
+#endif
+
+    acc->sockfd = sockfd;
+    return sockfd;
+}
+
+/*
+ * PD_OP_LISTEN_BATCH: accept up to 'accept_budget' connections per wakeup,
+ * handing them to accept_batch() POLLER_ACCEPT_BATCH at a time. Each call
+ * produces one result. The listen fd is level-triggered, so whatever the
+ * budget leaves in the backlog is picked up on the next wakeup. An io_uring
+ * poll only reports new readiness, so there it is polled for again.
+ */
+static void __poller_handle_listen_batch(struct __poller_node *node, poller_t *poller)
+{
+    struct poller_accepted acc[POLLER_ACCEPT_BATCH];
+    struct __poller_node *res = node->res;
+    int budget = poller->accept_budget;
+    void *result;
+    int error;
+    int n;
+
+#ifdef POLLER_IO_URING
+    if(node->uring_op)
+    {
+        __poller_handle_uring_accept(node, poller);
+        return;
+    }
+#endif
+
+    while(1)
+    {
+        n = 0;
+        error = 0;
+        while(n < POLLER_ACCEPT_BATCH && n < budget)
+        {
+            if(__poller_accept(node->data.fd, &acc[n]) >= 0)
+            {
+                if(poller->busy_poll_sockets)
+                    __poller_busy_poll_fd(acc[n].sockfd, poller);
+
+                n++;
+            }
+            else if(errno != ECONNABORTED)
+            {
+                error = errno;
+                break;
+            }
+        }
+
+        if(n > 0)
+        {
+            result = node->data.accept_batch(acc, n, node->data.context);
+            if(!result)
+                break;
+
+            res->data = node->data;
+            res->data.result = result;
+            res->error = 0;
+            res->state = PR_ST_SUCCESS;
+            __poller_callback(res, poller);
+
+            res = __poller_alloc_node(poller);
+            node->res = res;
+            if(!res)
+                break;
+
+            if(node->removed)
+                return;
+
+            budget -= n;
+        }
+
+        if(error == EAGAIN || error == EMFILE || error == ENFILE)
+            return;
+
+        if(error != 0)
+        {
+            errno = error;
+            break;
+        }
+
+        if(budget == 0)
+        {
+#ifdef POLLER_IO_URING
+            __poller_uring_repoll(node, poller);
+#endif
+            return;
+        }
+    }
+
+    if(__poller_remove_node(node, poller))
+        return;
+
+    node->error = errno;
+    node->state = PR_ST_ERROR;
+    __poller_free_node(node->res, poller);
+    __poller_callback(node, poller);
 }
 
 static void __poller_handle_connect(struct __poller_node *node, poller_t *poller)
@@ -631,7 +3336,7 @@ static void __poller_handle_connect(struct __poller_node *node, poller_t *poller
     if(__poller_remove_node(node,poller))
         return;
 
-    if(error = 0)
+    if(error == 0)
     {
         node->error = 0;
         node->state = PR_ST_FINISHED;
@@ -642,17 +3347,145 @@ static void __poller_handle_connect(struct __poller_node *node, poller_t *poller
         node->state = PR_ST_ERROR;
     }
 
-    poller->callback((struct poller_result *)node, poller->context);
+    __poller_callback(node, poller);
+}
+
+#ifdef __linux__
+
+/*
+ * recvmmsg() variant of __poller_handle_recvfrom(), used when
+ * poller_params.recv_batch > 1. The batch arrays and one 64KB buffer per
+ * datagram are allocated on first use and kept for the poller's lifetime.
+ * Each datagram is still delivered through data.recvfrom().
+ */
+
+struct __poller_dgram
+{
+    struct iovec iov;
+    struct sockaddr_storage addr;
+};
+
+static struct mmsghdr *__poller_dgram_msgs(poller_t *poller)
+{
+    int vlen = poller->recv_batch;
+    struct __poller_dgram *dgrams;
+    struct mmsghdr *msgs;
+    char *buf;
+    int i;
+
+    if(poller->dgram_msgs)
+        return (struct mmsghdr *)poller->dgram_msgs;
+
+    msgs = (struct mmsghdr *)malloc(vlen * (sizeof (struct mmsghdr) +
+                                            sizeof (struct __poller_dgram) +
+                                            POLLER_DGRAM_MAX));
+    if(!msgs)
+        return NULL;
+
+    dgrams = (struct __poller_dgram *)(msgs + vlen);
+    buf = (char *)(dgrams + vlen);
+    for(i = 0; i < vlen; i++)
+    {
+        dgrams[i].iov.iov_base = buf + i * POLLER_DGRAM_MAX;
+        dgrams[i].iov.iov_len = POLLER_DGRAM_MAX;
+        memset(&msgs[i].msg_hdr, 0, sizeof (struct msghdr));
+        msgs[i].msg_hdr.msg_name = &dgrams[i].addr;
+        msgs[i].msg_hdr.msg_iov = &dgrams[i].iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    poller->dgram_msgs = msgs;
+    return msgs;
+}
+
+static int __poller_handle_recvmmsg(struct __poller_node *node, poller_t *poller)
+{
+    struct mmsghdr *msgs = __poller_dgram_msgs(poller);
+    struct __poller_node *res = node->res;
+    struct msghdr *hdr;
+    void *result;
+    int n;
+    int i;
+
+    if(!msgs)
+        return -1;
+
+    while(1)
+    {
+        for(i = 0; i < poller->recv_batch; i++)
+            msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+
+        n = recvmmsg(node->data.fd, msgs, poller->recv_batch, 0, NULL);
+        if(n < 0)
+        {
+            if(errno == EAGAIN)
+            {
+                __STAT_ADD(poller->stats.read_eagain, 1);
+                return 0;
+            }
+            else
+                break;
+        }
+
+        for(i = 0; i < n; i++)
+        {
+            hdr = &msgs[i].msg_hdr;
+            __STAT_ADD(poller->stats.bytes_read, msgs[i].msg_len);
+            result = node->data.recvfrom((const struct sockaddr *)hdr->msg_name,
+                                         hdr->msg_namelen, hdr->msg_iov->iov_base,
+                                         msgs[i].msg_len, node->data.context);
+            if(!result)
+                break;
+
+            res->data = node->data;
+            res->data.result = result;
+            res->error = 0;
+            res->state = PR_ST_SUCCESS;
+            __poller_callback(res, poller);
+
+            res = __poller_alloc_node(poller);
+            node->res = res;
+            if(!res)
+                break;
+
+            if(node->removed)
+                return 0;
+        }
+
+        if(i < n)
+            break;
+
+        /* A short batch drained the socket; new datagrams raise a new edge. */
+        if(n < poller->recv_batch)
+            return 0;
+    }
+
+    if(__poller_remove_node(node, poller))
+        return 0;
+
+    node->error = errno;
+    node->state = PR_ST_ERROR;
+    __poller_free_node(node->res, poller);
+    __poller_callback(node, poller);
+    return 0;
 }
 
-static void __poller_handle_recvfrom(struct __poller_node *node, poller_t poller)
+#endif
+
+static void __poller_handle_recvfrom(struct __poller_node *node, poller_t *poller)
 {
     struct __poller_node *res = node->res;
     struct sockaddr_storage ss;
     struct sockaddr *addr = (struct sockaddr *)&ss;
     socklen_t addrlen;
+    void *result;
     ssize_t n;
 
+#ifdef __linux__
+    if(poller->recv_batch > 1 && __poller_handle_recvmmsg(node, poller) >= 0)
+        return;
+#endif
+
     while(1)
     {
         addrlen = sizeof(struct sockaddr_storage);
@@ -660,11 +3493,16 @@ static void __poller_handle_recvfrom(struct __poller_node *node, poller_t poller
         if(n < 0)
         {
             if(errno == EAGAIN)
+            {
+                __STAT_ADD(poller->stats.read_eagain, 1);
                 return;
+            }
             else
                 break;
         }
 
+        __STAT_ADD(poller->stats.bytes_read, n);
+
         result = node->data.recvfrom(addr, addrlen, poller->buf, n, node->data.context);
 
         if(!result)
@@ -674,9 +3512,9 @@ static void __poller_handle_recvfrom(struct __poller_node *node, poller_t poller
         res->data.result = result;
         res->error = 0;
         res->state = PR_ST_SUCCESS;
-        poller->callback((struct poller_result *)res, poller->context);
+        __poller_callback(res, poller);
 
-        res = (struct __poller_node *)malloc(sizeof (struct __poller_node));
+        res = __poller_alloc_node(poller);
         node->res = res;
         if(!res)
             break;
@@ -690,8 +3528,8 @@ static void __poller_handle_recvfrom(struct __poller_node *node, poller_t poller
 
     node->error = errno;
     node->state = PR_ST_ERROR;
-    free(node->res);
-    poller->callback((struct poller_result *)node, poller->context);
+    __poller_free_node(node->res, poller);
+    __poller_callback(node, poller);
 }
 
 static void __poller_handle_ssl_accept(struct __poller_node *node, poller_t *poller)
@@ -719,7 +3557,7 @@ static void __poller_handle_ssl_accept(struct __poller_node *node, poller_t *pol
         node->state = PR_ST_ERROR;
     }
 
-    poller->callback((struct poller_result *)node, poller->context);
+    __poller_callback(node, poller);
 }
 
 static void __poller_handle_ssl_connect(struct __poller_node *node, poller_t *poller)
@@ -749,7 +3587,7 @@ static void __poller_handle_ssl_connect(struct __poller_node *node, poller_t *po
         node->state = PR_ST_ERROR;
     }
 
-    poller->callback((struct poller_result *)node, poller->context);
+    __poller_callback(node, poller);
 }
 
 static void __poller_handle_ssl_shutdown(struct __poller_node *node, poller_t *poller)
@@ -777,20 +3615,20 @@ static void __poller_handle_ssl_shutdown(struct __poller_node *node, poller_t *p
         node->state = PR_ST_ERROR;
     }
 
-    poller->callback((struct poller_result *)node, poller->context);
+    __poller_callback(node, poller);
 }
 
 static void __poller_handle_event(struct __poller_node *node, poller_t *poller)
 {
-    struct _poller_node *res = node->res;
-    unsighed long long cnt = 0;
-    unsighed long long value;
+    struct __poller_node *res = node->res;
+    unsigned long long cnt = 0;
+    unsigned long long value;
     void *result;
     ssize_t n;
 
     while(1)
     {
-        n = read(node->data.fd, &value, sizeof(unsighed long long));
+        n = read(node->data.fd, &value, sizeof(unsigned long long));
         if(n == sizeof(unsigned  long long))
         {
             cnt += value;
@@ -821,9 +3659,9 @@ static void __poller_handle_event(struct __poller_node *node, poller_t *poller)
             res->data.result = result;
             res->error = 0;
             res->state = PR_ST_SUCCESS;
-            poller->callback((struct poller_result *)res, poller->context);
+            __poller_callback(res, poller);
 
-            res = (struct __poller_node *)malloc(sizeof (struct __poller_node));
+            res = __poller_alloc_node(poller);
             node->res = res;
             if(!res)
                 break;
@@ -835,7 +3673,7 @@ static void __poller_handle_event(struct __poller_node *node, poller_t *poller)
 
     if(cnt != 0)
     {
-        write(node->data.fd, &cnt, sizeof(unsighed long long));
+        write(node->data.fd, &cnt, sizeof(unsigned long long));
     }
 
     if(__poller_remove_node(node,poller))
@@ -843,8 +3681,8 @@ static void __poller_handle_event(struct __poller_node *node, poller_t *poller)
 
     node->error = errno;
     node->state = PR_ST_ERROR;
-    free(node->res);
-    poller->callback((struct poller_result *)node, poller->context);
+    __poller_free_node(node->res, poller);
+    __poller_callback(node, poller);
 }
 
 static void __poller_handle_notify(struct __poller_node *node, poller_t *poller)
@@ -866,9 +3704,9 @@ static void __poller_handle_notify(struct __poller_node *node, poller_t *poller)
             res->data.result = result;
             res->error = 0;
             res->state = PR_ST_SUCCESS;
-            poller->callback((struct poller_result *)res, poller->context);
+            __poller_callback(res, poller);
 
-            res = (struct __poller_node *)malloc(sizeof (struct __poller_node));
+            res = __poller_alloc_node(poller);
             node->res = res;
             if(!res)
                 break;
@@ -902,39 +3740,185 @@ static void __poller_handle_notify(struct __poller_node *node, poller_t *poller)
         node->state = PR_ST_ERROR;
     }
 
-    free(node->res);
-    poller->callback((struct poller_result*)node, poller->context);
+    __poller_free_node(node->res, poller);
+    __poller_callback(node, poller);
+}
+
+#ifdef POLLER_IO_URING
+/* The poll of the node could not be armed or updated. */
+static void __poller_handle_uring_error(struct __poller_node *node, poller_t *poller)
+{
+    if(__poller_remove_node(node, poller))
+        return;
+
+    node->error = node->uring_error;
+    node->state = PR_ST_ERROR;
+    __poller_free_node(node->res, poller);
+    __poller_callback(node, poller);
+}
+#endif
+
+/*
+ * Nodes removed by poller_del(), poller_mod() and poller_del_timer() reach
+ * the poller thread through 'pipe_queue', a lock-free LIFO linked through
+ * node->list.next. Only the producer that finds the queue empty signals
+ * the wakeup fd (an eventfd on Linux, a pipe elsewhere), so a burst of
+ * deletions costs one syscall. The consumer resets the wakeup fd before
+ * taking the queue, so a push it misses always signals again.
+ */
+
+static void __poller_pipe_wake(poller_t *poller)
+{
+#ifdef __linux__
+    unsigned long long one = 1;
+
+    write(poller->pipe_wr, &one, sizeof (unsigned long long));
+#else
+    char one = 1;
+
+    write(poller->pipe_wr, &one, 1);
+#endif
+}
+
+static void __poller_pipe_push(struct __poller_node *node, poller_t *poller)
+{
+    struct list_head *head = __atomic_load_n(&poller->pipe_queue, __ATOMIC_RELAXED);
+
+    do
+    {
+        node->list.next = head;
+    } while(!__atomic_compare_exchange_n(&poller->pipe_queue, &head, &node->list, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if(!head)
+        __poller_pipe_wake(poller);
 }
 
 static int __poller_handle_pipe(poller_t *poller)
 {
-    struct __poller_node *node = (struct __poller_node **)poller->buf;
-    int stop = 0;
-    int n;
-    int i;
+    struct list_head *pos = NULL;
+    struct list_head *head;
+    struct list_head *next;
+    struct __poller_node *node;
 
-    n = read(poller->pipe_rd, node, POLLER_BUFSIZE) / sizeof (void *);
-    for(i = 0; i < n; i++)
+    while(read(poller->pipe_rd, poller->buf, POLLER_BUFSIZE) > 0)
+        ;
+
+    head = __atomic_exchange_n(&poller->pipe_queue, NULL, __ATOMIC_ACQUIRE);
+    while(head)
+    {
+        next = head->next;
+        head->next = pos;
+        pos = head;
+        head = next;
+    }
+
+    while(pos)
+    {
+        next = pos->next;
+        node = list_entry(pos, struct __poller_node, list);
+        __STAT_INC_SHARED(poller->stats.pipe_nodes);
+        __poller_free_node(node->res, poller);
+        __poller_callback(node, poller);
+        pos = next;
+    }
+
+    return __atomic_load_n(&poller->pipe_stop, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Called with poller->mutex held. 'timer_armed' is the deadline the timer
+ * currently fires at, zero when none, so an unchanged deadline costs no
+ * syscall. In deadline mode nothing is armed: the poller thread passes
+ * 'wait_deadline' to epoll_pwait2(), and another thread that brings the
+ * deadline forward wakes it up to pick the new one.
+ */
+static void __poller_arm_timer(const struct timespec *abstime, poller_t *poller)
+{
+    if(abstime->tv_sec == poller->timer_armed.tv_sec &&
+        abstime->tv_nsec == poller->timer_armed.tv_nsec)
+        return;
+
+    poller->timer_armed = *abstime;
+    if(!poller->timer_deadline)
+    {
+        __PROF_BEGIN(poller, PROF_SETTIME);
+        __poller_set_timerfd(poller->timerfd, abstime, poller);
+        __PROF_END(poller);
+    }
+    else if(__poller_in_thread(poller))
+        poller->wait_deadline = *abstime;
+    else if(!poller->stopped)
+        __poller_pipe_wake(poller);
+}
+
+/* Called by the poller thread with poller->mutex held. */
+static void __poller_set_timer_locked(poller_t *poller)
+{
+    struct __poller_node *node = NULL;
+    struct __poller_node *first;
+    struct timespec abstime;
+    unsigned long long tick;
+
+    if(poller->timeo_type == POLLER_TIMEO_WHEEL)
+    {
+        if(__poller_wheel_first(&tick, poller))
+            __wheel_tick_to_timespec(tick, &abstime);
+        else
+        {
+            tick = ~0ULL;
+            abstime.tv_sec = 0;
+            abstime.tv_nsec = 0;
+        }
+
+        poller->wheel_next = tick;
+    }
+    else
     {
-        if(node[i])
+        if(!list_empty(&poller->timeo_list))
+        {
+            node = list_entry(poller->timeo_list.next, struct __poller_node, list);
+        }
+
+        if(poller->tree_first)
         {
-            free(node[i]->res);
-            poller->callback((struct poller_result *)node[i], poller->context);
+            first = rb_entry(poller->tree_first, struct __poller_node, rb);
+            if(!node || __timeout_cmp(first, node) < 0)
+                node = first;
+        }
+
+        if(node)
+        {
+            abstime = node->timeout;
         }
         else
-            stop = 1;
+        {
+            abstime.tv_sec = 0;
+            abstime.tv_nsec = 0;
+        }
     }
 
-    return stop;
+    __poller_arm_timer(&abstime, poller);
+    poller->wait_deadline = poller->timer_armed;
+}
+
+static void __poller_set_timer(poller_t *poller)
+{
+    pthread_mutex_lock(&poller->mutex);
+    __poller_set_timer_locked(poller);
+    pthread_mutex_unlock(&poller->mutex);
 }
 
 static void __poller_handle_timeout(const struct __poller_node *time_node, poller_t *poller)
 {
     struct __poller_node *node;
     struct list_head *pos, *tmp;
+    long long late;
 
     LIST_HEAD(timeo_list);
+    LIST_HEAD(wheel_list);
 
+    __PROF_BEGIN(poller, PROF_TIMEOUT_LOCKED);
     pthread_mutex_lock(&poller->mutex);
     list_for_each_safe(pos, tmp, &poller->timeo_list)
     {
@@ -946,8 +3930,8 @@ static void __poller_handle_timeout(const struct __poller_node *time_node, polle
 
         if(node->data.fd >= 0)
         {
-            poller->nodes[node->data.fd] = NULL;
-            __poller_del_fd(node->data.fd, node->event, poller);
+            __poller_clear_node(node->data.fd, poller);
+            __poller_del_fd(node->data.fd, node->event, node, poller);
         }
         else
         {
@@ -967,8 +3951,8 @@ static void __poller_handle_timeout(const struct __poller_node *time_node, polle
 
         if(node->data.fd >= 0)
         {
-            poller->nodes[node->data.fd] = NULL;
-            __poller_del_fd(node->data.fd, node->event, poller);
+            __poller_clear_node(node->data.fd, poller);
+            __poller_del_fd(node->data.fd, node->event, node, poller);
         }
         else
         {
@@ -982,59 +3966,145 @@ static void __poller_handle_timeout(const struct __poller_node *time_node, polle
         {
             poller->tree_last = NULL;
         }
+    }
 
-        pthread_mutex_unlock(&poller->mutex);
-        list_for_each_safe(pos, tmp, &timeo_list)
+    if(poller->timeo_type == POLLER_TIMEO_WHEEL)
+    {
+        __poller_wheel_expire(time_node->timeout.tv_sec * 1000ULL +
+                              time_node->timeout.tv_nsec / 1000000,
+                              &wheel_list, poller);
+        list_for_each_safe(pos, tmp, &wheel_list)
         {
             node = list_entry(pos, struct __poller_node, list);
-            if(node->data.fd >=0)
+            if(node->data.fd >= 0)
             {
-                node->error = ETIMEDOUT;
-                node->state = PR_ST_ERROR;
+                __poller_clear_node(node->data.fd, poller);
+                __poller_del_fd(node->data.fd, node->event, node, poller);
             }
             else
             {
-                node->error = 0;
-                node->state = PR_ST_FINISHED;
+                node->removed = 1;
             }
 
-            free(node->res);
-            poller->callback((struct poller_result *)node, poller->context);
+            list_move_tail(pos, &timeo_list);
         }
     }
-}
-
-static void __poller_set_timer(poller_t *poller)
-{
-    struct __poller_node *node = NULL;
-    struct __poller_node *first;
-    struct timespec abstime;
 
-    pthread_mutex_lock(&poller->mutex);
-    if(!list_empty(&poller->timeo_list))
+    /* A deadline that has passed has fired, or is about to. */
+    if((poller->timer_armed.tv_sec || poller->timer_armed.tv_nsec) &&
+        __timespec_diff_ns(&time_node->timeout, &poller->timer_armed) >= 0)
     {
-        node = list_entry(poller->timeo_list.next, struct __poller_node, list);
+        poller->timer_armed.tv_sec = 0;
+        poller->timer_armed.tv_nsec = 0;
     }
 
-    if(poller->tree_first)
+    __poller_set_timer_locked(poller);
+    pthread_mutex_unlock(&poller->mutex);
+    __PROF_END(poller);
+    list_for_each_safe(pos, tmp, &timeo_list)
     {
-        first = rb_entry(poller->tree_first, struct __poller_node, rb);
-        if(!node || _timeout_cmp(first,node) < 0)
-            node = first;
+        node = list_entry(pos, struct __poller_node, list);
+        late = __timespec_diff_ns(&time_node->timeout, &node->timeout);
+        __poller_hist_add(&poller->stats.timer_late_us, late > 0 ? late / 1000 : 0);
+        __STAT_ADD(poller->stats.timeouts, 1);
+        if(node->data.fd >=0)
+        {
+            node->error = ETIMEDOUT;
+            node->state = PR_ST_ERROR;
+        }
+        else
+        {
+            node->error = 0;
+            node->state = PR_ST_FINISHED;
+        }
+
+        __poller_free_node(node->res, poller);
+        __poller_callback(node, poller);
     }
+}
 
-    if(node)
+/* Blocks until an event or, in deadline mode, until 'wait_deadline'. */
+static int __poller_block(__poller_event_t *events, int maxevents, poller_t *poller)
+{
+#ifdef POLLER_PWAIT2
+    struct timespec ts;
+    long long ns;
+    int nevents;
+
+    if(poller->timer_deadline &&
+        (poller->wait_deadline.tv_sec || poller->wait_deadline.tv_nsec))
     {
-        abstime = node->timeout;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ns = __timespec_diff_ns(&poller->wait_deadline, &ts);
+        if(ns < 0)
+            ns = 0;
+
+        ts.tv_sec = ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        nevents = __poller_pwait2(poller->pfd, events, maxevents, &ts);
+        if(nevents >= 0 || errno != ENOSYS)
+            return nevents;
+
+        /* Older kernel: go back to the timerfd for good. */
+        pthread_mutex_lock(&poller->mutex);
+        poller->timer_deadline = 0;
+        __poller_set_timerfd(poller->timerfd, &poller->timer_armed, poller);
+        pthread_mutex_unlock(&poller->mutex);
     }
-    else
+#endif
+
+    return __poller_wait(events, maxevents, -1, poller);
+}
+
+#define POLLER_SPIN_MIN_NS  1000
+
+/*
+ * Adaptive busy polling: poll without blocking for up to 'spin_ns' before
+ * blocking. A spin that finds nothing halves the next one, down to
+ * blocking straight away when idle. Events found while spinning, or a
+ * blocking wait that returns within the full window (load is back),
+ * restore the full 'busy_poll_ns'.
+ */
+static int __poller_busy_wait(__poller_event_t *events, int maxevents, poller_t *poller)
+{
+    struct timespec begin, now;
+    int nevents;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if(poller->spin_ns > 0)
     {
-        abstime.tv_sec = 0;
-        abstime.tv_nsec = 0;
+        do
+        {
+            nevents = __poller_wait(events, maxevents, 0, poller);
+            if(nevents != 0)
+            {
+                if(nevents > 0)
+                {
+                    __STAT_ADD(poller->stats.spin_hits, 1);
+                    poller->spin_ns = poller->busy_poll_ns;
+                }
+
+                return nevents;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        } while(__timespec_diff_ns(&now, &begin) < poller->spin_ns);
+
+        __STAT_ADD(poller->stats.spin_misses, 1);
+        poller->spin_ns /= 2;
+        if(poller->spin_ns < POLLER_SPIN_MIN_NS)
+            poller->spin_ns = 0;
+
+        begin = now;
     }
 
-    __poller_set_timerfd(poller->timerfd, &abstime, poller);
-    pthread_mutex_unlock(&poller->mutex);
+    __STAT_ADD(poller->stats.blocks, 1);
+    nevents = __poller_block(events, maxevents, poller);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(__timespec_diff_ns(&now, &begin) < poller->busy_poll_ns)
+        poller->spin_ns = poller->busy_poll_ns;
+
+    return nevents;
 }
 
 static void *__poller_thread_routine(void *arg)
@@ -1043,15 +4113,43 @@ static void *__poller_thread_routine(void *arg)
     __poller_event_t events[POLLER_EVENTS_MAX];
     struct __poller_node time_node;
     struct __poller_node *node;
+    struct timespec begin, end;
     int has_pipe_event;
+    long long ns;
     int nevents;
+    int ret;
+    int op;
+    int fd;
     int i;
 
+    /* poller_start() sets 'tid' and 'stopped' with the mutex held, and
+     * __poller_in_thread() has to see them. */
+    pthread_mutex_lock(&poller->mutex);
+    pthread_mutex_unlock(&poller->mutex);
+
+    /* From here on __poller_handle_timeout() rearms at the end of every
+     * iteration, and inserts arm an earlier deadline themselves. */
+    __PROF_BEGIN(poller, PROF_SET_TIMER);
+    __poller_set_timer(poller);
+    __PROF_END(poller);
     while(1)
     {
-        __poller_set_timer(poller);
-        nevents = __poller_wait(events, POLLER_EVENTS_MAX, poller);
+        __PROF_BEGIN(poller, PROF_WAIT);
+        if(poller->busy_poll_ns)
+            nevents = __poller_busy_wait(events, POLLER_EVENTS_MAX, poller);
+        else
+            nevents = __poller_block(events, POLLER_EVENTS_MAX, poller);
+        __PROF_END(poller);
         clock_gettime(CLOCK_MONOTONIC, &time_node.timeout);
+        poller->now = time_node.timeout;
+        if(nevents >= 0)
+        {
+            __STAT_ADD(poller->stats.wakeups, 1);
+            __STAT_ADD(poller->stats.events, nevents);
+            __poller_hist_add(&poller->stats.nevents, nevents);
+        }
+
+        begin = time_node.timeout;
         has_pipe_event = 0;
         for(i = 0; i < nevents; i++)
         {
@@ -1065,7 +4163,20 @@ static void *__poller_thread_routine(void *arg)
                 continue;
             }
 
-            switch(node->data.operation)
+#ifdef POLLER_IO_URING
+            if(node->uring_error)
+            {
+                __poller_handle_uring_error(node, poller);
+                continue;
+            }
+#endif
+
+            /* The handler may free the node. */
+            op = node->data.operation;
+            fd = node->data.fd;
+            __PROF_BEGIN(poller, PROF_OP_BASE +
+                                 (op < POLLER_STATS_OPS ? op : POLLER_STATS_OPS - 1));
+            switch(op)
             {
                 case PD_OP_READ:
                     __poller_handle_read(node, poller);
@@ -1097,49 +4208,132 @@ static void *__poller_thread_routine(void *arg)
                 case PD_OP_NOTIFY:
                     __poller_handle_notify(node, poller);
                     break;
+                case PD_OP_SENDTO:
+                    __poller_handle_sendto(node, poller);
+                    break;
+                case PD_OP_LISTEN_BATCH:
+                    __poller_handle_listen_batch(node, poller);
+                    break;
+                case PD_OP_SENDFILE:
+                    __poller_handle_sendfile(node, poller);
+                    break;
+            }
+
+            __PROF_END(poller);
+
+            /* Events of one wakeup run back to back, so each one is timed
+             * from the end of the previous one. */
+            if(poller->stats_timing || poller->watchdog_ns)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                ns = __timespec_diff_ns(&end, &begin);
+                if(poller->stats_timing && op < POLLER_STATS_OPS)
+                    __poller_hist_add(&poller->stats.handle_ns[op], ns);
+
+                begin = end;
+                if(poller->watchdog_ns && ns > poller->watchdog_ns)
+                {
+                    __poller_watchdog_report(POLLER_SLOW_EVENT, op, fd, ns, poller);
+                    clock_gettime(CLOCK_MONOTONIC, &begin);
+                }
             }
         }
 
         if(has_pipe_event)
         {
-            if(__poller_handle_pipe(poller))
+            __PROF_BEGIN(poller, PROF_PIPE);
+            ret = __poller_handle_pipe(poller);
+            __PROF_END(poller);
+            if(ret)
             {
                 break;
             }
         }
 
+        __PROF_BEGIN(poller, PROF_TIMEOUT);
         __poller_handle_timeout(&time_node, poller);
+        __PROF_END(poller);
+        if(poller->batch_callback)
+        {
+            __PROF_BEGIN(poller, PROF_FLUSH);
+            __poller_flush_results(poller);
+            __PROF_END(poller);
+        }
+
+        if(poller->stats_timing || poller->watchdog_ns)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ns = __timespec_diff_ns(&end, &time_node.timeout);
+            if(poller->stats_timing)
+                __poller_hist_add(&poller->stats.loop_lag_us, ns > 0 ? ns / 1000 : 0);
+
+            if(poller->watchdog_ns && ns > poller->watchdog_ns)
+                __poller_watchdog_report(POLLER_SLOW_LOOP, -1, -1, ns, poller);
+        }
     }
 
+    if(poller->batch_callback)
+        __poller_flush_results(poller);
+
     return NULL;
 }
 
 static int __poller_open_pipe(poller_t *poller)
 {
+#ifdef __linux__
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(efd >= 0)
+    {
+        if(__poller_add_fd(efd, EPOLLIN, (void *)1, poller) >= 0)
+        {
+            poller->pipe_rd = efd;
+            poller->pipe_wr = efd;
+            poller->pipe_queue = NULL;
+            poller->pipe_stop = 0;
+            return 0;
+        }
+
+        close(efd);
+    }
+#else
     int pipefd[2];
 
     if(pipe(pipefd) >= 0)
     {
-        if(__poller_add_fd(pipefd[0], EPOLLIN, (void *)1, poller) >= 0)
+        if(fcntl(pipefd[0], F_SETFL, O_NONBLOCK) >= 0 &&
+            fcntl(pipefd[1], F_SETFL, O_NONBLOCK) >= 0 &&
+            __poller_add_fd(pipefd[0], EPOLLIN, (void *)1, poller) >= 0)
         {
             poller->pipe_rd = pipefd[0];
             poller->pipe_wr = pipefd[1];
+            poller->pipe_queue = NULL;
+            poller->pipe_stop = 0;
             return 0;
         }
 
         close(pipefd[0]);
         close(pipefd[1]);
     }
+#endif
 
     return -1;
 }
 
+static void __poller_close_pipe(poller_t *poller)
+{
+    if(poller->pipe_wr != poller->pipe_rd)
+        close(poller->pipe_wr);
+
+    close(poller->pipe_rd);
+}
+
 static int __poller_create_timer(poller_t *poller)
 {
-    int timerfd = __poller_cteate();
+    int timerfd = __poller_create_timerfd();
     if(timerfd >= 0)
     {
-        if(__poller_add_timefd(timerfd, poller) >= 0)
+        if(__poller_add_timerfd(timerfd, poller) >= 0)
         {
             poller->timerfd = timerfd;
             return 0;
@@ -1151,15 +4345,41 @@ static int __poller_create_timer(poller_t *poller)
     return -1;
 }
 
-poller_t *__poller_create(void **nodes_buf, const struct poller_params *params)
+poller_t *__poller_create(const struct poller_params *params)
 {
-    poller_t *poller = (poller_t *)malloc(sizeof(poller_t));
+    poller_t *poller;
     int ret;
 
+    switch(params->backend)
+    {
+        case POLLER_BACKEND_DEFAULT:
+#ifdef POLLER_IO_URING
+        case POLLER_BACKEND_IO_URING:
+#endif
+            break;
+        default:
+            errno = EOPNOTSUPP;
+            return NULL;
+    }
+
+    if(params->timeo_type != POLLER_TIMEO_RBTREE &&
+        params->timeo_type != POLLER_TIMEO_WHEEL)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    poller = (poller_t *)malloc(sizeof(poller_t));
     if(!poller)
         return NULL;
 
-    poller->pfd = __poller_creat_pfd();
+    poller->backend = params->backend;
+    poller->listen_exclusive = params->listen_exclusive;
+#ifdef POLLER_IO_URING
+    poller->uring_ops = params->backend == POLLER_BACKEND_IO_URING && params->uring_ops;
+#endif
+    poller->stopped = 1;
+    poller->pfd = __poller_create_pfd(poller);
     if(poller->pfd >= 0)
     {
         if(__poller_create_timer(poller) >= 0)
@@ -1167,9 +4387,11 @@ poller_t *__poller_create(void **nodes_buf, const struct poller_params *params)
             ret = pthread_mutex_init(&poller->mutex, NULL);
             if(ret == 0)
             {
-                poller->nodes = (struct __poller_node **)nodes_buf;
+                poller->fd_dir = NULL;
                 poller->max_open_files = params->max_open_files;
                 poller->callback = params->callback;
+                poller->batch_callback = params->batch_callback;
+                poller->nresults = 0;
                 poller->context  = params->context;
 
                 poller->timeo_tree.rb_node = NULL;
@@ -1177,52 +4399,114 @@ poller_t *__poller_create(void **nodes_buf, const struct poller_params *params)
                 poller->tree_last  = NULL;
                 INIT_LIST_HEAD(&poller->timeo_list);
                 INIT_LIST_HEAD(&poller->no_timeo_list);
+                __poller_wheel_init(params->timeo_type, poller);
+                poller->slab_nodes = params->slab_nodes;
+                poller->slab_free = NULL;
+                poller->slab_returned = NULL;
+                INIT_LIST_HEAD(&poller->slab_chunks);
+                poller->recv_batch = params->recv_batch;
+                if(poller->recv_batch > POLLER_RECV_BATCH_MAX)
+                    poller->recv_batch = POLLER_RECV_BATCH_MAX;
+                poller->accept_budget = params->accept_budget;
+                if(poller->accept_budget <= 0)
+                    poller->accept_budget = POLLER_ACCEPT_BATCH;
+                poller->zerocopy_threshold = params->zerocopy_threshold;
+                poller->ktls = params->ktls;
+                poller->ssl_gather_off = params->ssl_gather_off;
+                poller->dgram_msgs = NULL;
+                poller->stats_timing = params->stats_timing;
+                poller->message_buffers = params->message_buffers;
+                poller->busy_poll_ns = 0;
+                if(params->busy_poll_us > 0)
+                    poller->busy_poll_ns = params->busy_poll_us * 1000LL;
+                poller->spin_ns = poller->busy_poll_ns;
+                poller->busy_poll_sockets = params->busy_poll_sockets;
+                poller->timer_deadline = 0;
+#ifdef POLLER_PWAIT2
+                if(poller->backend == POLLER_BACKEND_DEFAULT)
+                    poller->timer_deadline = params->timer_deadline;
+#endif
+                poller->timer_armed.tv_sec = 0;
+                poller->timer_armed.tv_nsec = 0;
+                poller->wait_deadline = poller->timer_armed;
+                poller->clock_source = params->clock_source;
+                poller->timeo_granularity_ns = 0;
+                if(params->timeo_granularity_us > 0)
+                    poller->timeo_granularity_ns = params->timeo_granularity_us * 1000LL;
+                clock_gettime(CLOCK_MONOTONIC, &poller->now);
+                poller->watchdog = params->watchdog;
+                poller->watchdog_ns = 0;
+                if(params->watchdog && params->watchdog_us > 0)
+                    poller->watchdog_ns = params->watchdog_us * 1000LL;
+                memset(&poller->stats, 0, sizeof (struct poller_stats));
+                poller->stopped_callbacks = 0;
+                if(__poller_fd_dir_grow(params->max_open_files, poller) >= 0)
+                {
+#ifdef POLLER_PROFILE
+                    poller->prof = __poller_prof_create();
+                    if(poller->prof)
+#endif
+                    return poller;
 
-                poller->stopped = 1;
-                return poller;
+#ifdef POLLER_PROFILE
+                    __poller_fd_dir_destroy(poller);
+#endif
+                }
+
+                ret = errno;
+                pthread_mutex_destroy(&poller->mutex);
             }
 
             errno = ret;
-            __poller_close_timerfd(poller_timerfd);
+            __poller_close_timerfd(poller->timerfd);
         }
-        __poller_close_pfd(poller->pfd);
+        __poller_close_pfd(poller->pfd, poller);
     }
 
     free(poller);
     return NULL;
 }
 
-poller_t *poller_create(const struct poller_params *params)
-{
-    void **nodes_buf = (void **)calloc(params->max_open_files, sizeof(void *));
-    poller_t *poller;
-
-    if(nodes_buf)
-    {
-        poller = __poller_create(nodes_buf, params);
-        if(poller)
-            return poller;
-        
-        free(nodes_buf);
-    }
-
-    return NULL;
-}
-
 void __poller_destroy(poller_t *poller)
 {
+    /* First, so that no request of a ring is left to write to memory
+     * freed below. */
+    __poller_close_pfd(poller->pfd, poller);
+    __poller_fd_dir_destroy(poller);
+    __poller_slab_destroy(poller);
+    free(poller->dgram_msgs);
+#ifdef POLLER_PROFILE
+    free(poller->prof);
+#endif
     pthread_mutex_destroy(&poller->mutex);
     __poller_close_timerfd(poller->timerfd);
-    __poller_close_pfd(poller->pfd);
     free(poller);
 }
 
+poller_t *poller_create(const struct poller_params *params)
+{
+    return __poller_create(params);
+}
+
 void poller_destroy(poller_t *poller)
 {
-    free(poller->nodes);
     __poller_destroy(poller);
 }
 
+/* Raises or lowers the fd limit. It is checked when an fd is added only,
+ * so lowering it leaves fds above it in place until they are deleted. */
+int poller_set_max_open_files(size_t max_open_files, poller_t *poller)
+{
+    int ret;
+
+    pthread_mutex_lock(&poller->mutex);
+    ret = __poller_fd_dir_grow(max_open_files, poller);
+    if(ret >= 0)
+        __atomic_store_n(&poller->max_open_files, max_open_files, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&poller->mutex);
+    return ret;
+}
+
 int poller_start(poller_t *poller)
 {
     pthread_t tid;
@@ -1240,8 +4524,7 @@ int poller_start(poller_t *poller)
         else
         {
             errno = ret;
-            close(poller->pipe_wr);
-            close(poller->pipe_rd);
+            __poller_close_pipe(poller);
         }
     }
 
@@ -1249,9 +4532,51 @@ int poller_start(poller_t *poller)
     return -poller->stopped;
 }
 
+int poller_bind_cpu(int cpu, poller_t *poller)
+{
+#ifdef __linux__
+    cpu_set_t cpuset;
+    int ret;
+
+    if(cpu < 0 || cpu >= CPU_SETSIZE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    ret = pthread_setaffinity_np(poller->tid, sizeof (cpu_set_t), &cpuset);
+    if(ret == 0)
+        return 0;
+
+    errno = ret;
+#else
+    errno = ENOSYS;
+#endif
+    return -1;
+}
+
 static void __poller_insert_node(struct __poller_node *node, poller_t *poller)
 {
     struct __poller_node *end;
+    struct timespec abstime;
+    unsigned long long tick;
+
+    if(poller->timeo_type == POLLER_TIMEO_WHEEL)
+    {
+        __poller_wheel_insert(node, poller);
+        tick = __wheel_tick(&node->timeout);
+        if(tick < poller->wheel_next)
+        {
+            poller->wheel_next = tick;
+            __wheel_tick_to_timespec(tick, &abstime);
+            __poller_arm_timer(&abstime, poller);
+        }
+
+        return;
+    }
+
     end = list_entry(poller->timeo_list.prev, struct __poller_node, list);
     if(list_empty(&poller->timeo_list))
     {
@@ -1275,13 +4600,14 @@ static void __poller_insert_node(struct __poller_node *node, poller_t *poller)
 
     if(!poller->tree_first || __timeout_cmp(node , end) < 0)
     {
-        __poller_set_timerfd(poller->timerfd, &node->timeout, poller);
+        __poller_arm_timer(&node->timeout, poller);
     }
 }
 
-static void __poller_node_set_timeout(int timeout, struct __poller_node *node)
+static void __poller_node_set_timeout(int timeout, struct __poller_node *node,
+                                      poller_t *poller)
 {
-    clock_gettime(CLOCK_MONOTONIC, &node->timeout);
+    __poller_now(&node->timeout, poller);
     node->timeout.tv_sec += timeout / 1000;
     node->timeout.tv_nsec += timeout % 1000 * 1000000;
     if(node->timeout.tv_nsec >= 1000000000)
@@ -1289,9 +4615,12 @@ static void __poller_node_set_timeout(int timeout, struct __poller_node *node)
         node->timeout.tv_nsec -= 1000000000;
         node->timeout.tv_sec++;
     }
+
+    __poller_round_deadline(&node->timeout, poller);
 }
 
-static int __poller_data_get_event(int *event, const struct poller_data *data)
+static int __poller_data_get_event(int *event, const struct poller_data *data,
+                                   poller_t *poller)
 {
     switch(data->operation)
     {
@@ -1302,7 +4631,10 @@ static int __poller_data_get_event(int *event, const struct poller_data *data)
             *event = EPOLLOUT | EPOLLET;
             return 0;
         case PD_OP_LISTEN:
+        case PD_OP_LISTEN_BATCH:
             *event = EPOLLIN;
+            if(poller->listen_exclusive)
+                *event |= EPOLLEXCLUSIVE;
             return 1;
         case PD_OP_CONNECT:
             *event = EPOLLOUT | EPOLLET;
@@ -1313,7 +4645,10 @@ static int __poller_data_get_event(int *event, const struct poller_data *data)
         case PD_OP_SSL_ACCEPT:
             *event = EPOLLIN | EPOLLET;
             return 0;
-        case PO_OP_SSL_SHUTDOWN:
+        case PD_OP_SSL_CONNECT:
+            *event = EPOLLOUT | EPOLLET;
+            return 0;
+        case PD_OP_SSL_SHUTDOWN:
             *event = EPOLLOUT | EPOLLET;
             return 0;
         case PD_OP_EVENT:
@@ -1322,147 +4657,413 @@ static int __poller_data_get_event(int *event, const struct poller_data *data)
         case PD_OP_NOTIFY:
             *event = EPOLLIN | EPOLLET;
             return 1;
+        case PD_OP_SENDTO:
+            *event = EPOLLOUT | EPOLLET;
+            return 0;
+        case PD_OP_SENDFILE:
+            /* The file bytes never pass through user space to encrypt,
+             * so over TLS this needs kTLS in the send direction. */
+            if(data->ssl && !(__poller_ktls_setup(data, poller) & POLLER_KTLS_TX))
+            {
+                errno = EINVAL;
+                return -1;
+            }
+
+            *event = EPOLLOUT | EPOLLET;
+            return 0;
         default:
             errno = EINVAL;
             return -1;
     }
 }
 
-static struct __poller_node *__poller_new_node(const struct poller_data *data, int timeout, poller_t *poller)
+/* The fd limit is checked when an fd is added only. */
+static inline int __poller_check_fd(int fd, poller_t *poller)
+{
+    if((size_t)fd >= __atomic_load_n(&poller->max_open_files, __ATOMIC_RELAXED))
+    {
+        errno = fd < 0 ? EBADF : EMFILE;
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct __poller_node *__poller_new_node(const struct poller_data *data, int timeout, poller_t *poller)
+{
+    struct __poller_node *res = NULL;
+    struct __poller_node *node;
+    int need_res;
+    int event;
+
+    if(data->fd < 0)
+    {
+        errno = EBADF;
+        return NULL;
+    }
+
+    need_res = __poller_data_get_event(&event, data, poller);
+    if(need_res < 0)
+    {
+        return NULL;
+    }
+
+    if(need_res)
+    {
+        res = __poller_alloc_node(poller);
+        if(!res)
+            return NULL;
+    }
+
+    node = __poller_alloc_node(poller);
+    if(!node)
+    {
+        __poller_free_node(res, poller);
+        return NULL;
+    }
+
+    node->data = *data;
+    node->event = event;
+    node->in_rbtree = 0;
+    node->in_wheel = 0;
+    node->removed = 0;
+    node->res = res;
+    node->uring_error = 0;
+    node->uring_op = 0;
+    node->zc_next = 0;
+    node->zc_done = 0;
+    node->zc_on = 0;
+    node->zc_off = 0;
+    node->ktls = __poller_ktls_setup(data, poller);
+    node->gso_off = 0;
+    if(data->operation == PD_OP_WRITE && data->ssl && !poller->ssl_gather_off)
+        SSL_set_mode(data->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    if(timeout >= 0)
+    {
+        __poller_node_set_timeout(timeout, node, poller);
+    }
+
+    return node;
+}
+
+/* The three below are called with poller->mutex held. */
+
+static int __poller_add_node(struct __poller_node *node, int timeout, poller_t *poller)
+{
+    int fd = node->data.fd;
+    struct __poller_fd_slot *slot = __poller_node_slot_alloc(fd, poller);
+
+    if(!slot)
+        return -1;
+
+    if(slot->node)
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+#ifdef POLLER_ZEROCOPY
+    /* Possibly a new socket on a reused fd. Reset before the fd is armed,
+     * as the poller thread may write as soon as it is. */
+    slot->zc_state = 0;
+#endif
+    if(__poller_add_fd(fd, node->event, node, poller) < 0)
+        return -1;
+
+    if(timeout >= 0)
+    {
+        __poller_insert_node(node, poller);
+    }
+    else
+    {
+        list_add_tail(&node->list, &poller->no_timeo_list);
+    }
+
+    slot->node = node;
+    return 0;
+}
+
+/* Returns the replaced node, or NULL if 'fd' has no node. When the poller
+ * is running, that node is already on its way to the poller thread. */
+static struct __poller_node *__poller_del_node(int fd, poller_t *poller)
+{
+    struct __poller_node *node = __poller_get_node(fd, poller);
+
+    if(!node)
+    {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    __poller_clear_node(fd, poller);
+
+    __poller_node_erase(node, poller);
+
+    __poller_del_fd(fd, node->event, node, poller);
+
+    node->error = 0;
+    node->state = PR_ST_DELETED;
+    if(!poller->stopped)
+    {
+        node->removed = 1;
+        __poller_pipe_push(node, poller);
+    }
+
+    return node;
+}
+
+static struct __poller_node *__poller_mod_node(struct __poller_node *node, int timeout,
+                                               poller_t *poller)
 {
-    struct __poller_node *res = NULL;
-    struct __poller_node *node;
-    int need_res;
-    int event;
+    int fd = node->data.fd;
+    struct __poller_fd_slot *slot = __poller_node_slot(fd, poller);
+    struct __poller_node *orig = slot ? slot->node : NULL;
 
-    if((size_t)data->fd >= poller->max_open_files)
+    if(!orig)
     {
-        errno = data->fd < ? EBADF : EMFILE;
+        errno = ENOENT;
         return NULL;
     }
 
-    need_res = __poller_data_get_event(&event, data);
-    if(need_res < 0)
-    {
+    if(__poller_mod_fd(fd, orig->event, node->event, node, poller) < 0)
         return NULL;
-    }
 
-    if(need_res)
-    {
-        res = (struct __poller_node *)malloc(sizeof(struct __poller_node));
-        if(!res)
-            return NULL;
-    }
+    __poller_node_erase(orig, poller);
 
-    node = (struct __poller_node *)malloc(sizeof (struct __poller_node));
-    if(!node)
+    orig->error = 0;
+    orig->state = PR_ST_MODIFIED;
+    if(!poller->stopped)
     {
-        free(res);
-        return NULL;
+        orig->removed = 1;
+        __poller_pipe_push(orig, poller);
     }
 
-    node->data = *data;
-    node->event = event;
-    node->in_rbtree = 0;
-    node->removed = 0;
-    node->res = res;
     if(timeout >= 0)
     {
-        __poller_node_set_timeout(timeout, node);
+        __poller_insert_node(node, poller);
+    }
+    else
+    {
+        list_add_tail(&node->list, &poller->no_timeo_list);
     }
 
-    return node;
+    slot->node = node;
+    return orig;
 }
 
 int poller_add(const struct poller_data *data, int timeout, poller_t *poller)
 {
     struct __poller_node *node;
+    int ret;
+
+    if(__poller_check_fd(data->fd, poller) < 0)
+        return -1;
+
     node = __poller_new_node(data, timeout, poller);
     if(!node)
         return -1;
 
     pthread_mutex_lock(&poller->mutex);
-    if(!poller->nodes[data->fd])
-    {
-        if(__poller_add_fd(data->fd, node->event, node, poller) >= 0)
-        {
-            if(timeout >= 0)
-            {
-                __Poller_insert_node(node, poller);
-            }
-            else
-            {
-                list_add_tail(&node->list, &poller->node_time_list);
-            }
-            poller->nodes[data->fd] = node;
-            node = NULL;
-        }
-    }
-    else
-    {
-        errno = EEXIST;
-    }
+    ret = __poller_add_node(node, timeout, poller);
+    if(ret >= 0)
+        __poller_busy_poll_add(data, poller);
 
     pthread_mutex_unlock(&poller->mutex);
-    if(node == NULL)
+    if(ret >= 0)
     {
         return 0;
     }
 
-    free(node->res);
-    free(node);
+    __poller_free_node(node->res, poller);
+    __poller_free_node(node, poller);
     return -1;
 }
 
-int poller_del(int fd, poller_t *poller)
+void poller_free_result(struct poller_result *result, poller_t *poller)
 {
-    struct __poller_node *node;
-    int stopped = 0;
+    __poller_free_node((struct __poller_node *)result, poller);
+}
+
+void poller_get_stats(struct poller_stats *stats, poller_t *poller)
+{
+    const unsigned long long *src = (const unsigned long long *)&poller->stats;
+    unsigned long long *dst = (unsigned long long *)stats;
+    size_t i;
+
+    for(i = 0; i < sizeof (struct poller_stats) / sizeof (unsigned long long); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+    stats->callbacks += __atomic_load_n(&poller->stopped_callbacks, __ATOMIC_RELAXED);
+}
+
+static size_t __stats_append(char *buf, size_t size, size_t len, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf + (len < size ? len : size), len < size ? size - len : 0, fmt, ap);
+    va_end(ap);
+    return n > 0 ? len + n : len;
+}
+
+static size_t __stats_append_hist(char *buf, size_t size, size_t len, const char *name,
+                                  const char *label, const struct poller_histogram *hist)
+{
+    const char *sep = *label ? "," : "";
+    unsigned long long cum = 0;
+    int last;
+    int i;
 
-    if((size_t)fd >= poller->max_open_filen)
+    for(last = POLLER_HIST_BUCKETS - 1; last > 0 && hist->buckets[last] == 0; last--)
+        ;
+
+    for(i = 0; i <= last && i < POLLER_HIST_BUCKETS - 1; i++)
     {
-        errno = fd < 0 ? EBADF : EMFILE;
-        return -1;
+        cum += hist->buckets[i];
+        len = __stats_append(buf, size, len, "%s_bucket{%s%sle=\"%llu\"} %llu\n",
+                             name, label, sep, (1ULL << i) - 1, cum);
     }
 
-    pthread_mutex_lock(&poller->mutex);
-    node = poller->nodes[fd];
-    if(node)
+    len = __stats_append(buf, size, len, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+                         name, label, sep, hist->count);
+    len = __stats_append(buf, size, len, "%s_sum%s%s%s %llu\n", name,
+                         *label ? "{" : "", label, *label ? "}" : "", hist->sum);
+    len = __stats_append(buf, size, len, "%s_count%s%s%s %llu\n", name,
+                         *label ? "{" : "", label, *label ? "}" : "", hist->count);
+    return len;
+}
+
+/* Prometheus text format. Returns the full length like snprintf(); the
+ * output is truncated (and still terminated) if 'size' is too small. */
+int poller_format_stats(const struct poller_stats *stats, char *buf, size_t size)
+{
+    const struct {
+        const char *name;
+        unsigned long long value;
+    } counters[] = {
+        { "poller_wakeups_total",       stats->wakeups          },
+        { "poller_events_total",        stats->events           },
+        { "poller_callbacks_total",     stats->callbacks        },
+        { "poller_timeouts_total",      stats->timeouts         },
+        { "poller_pipe_nodes_total",    stats->pipe_nodes       },
+        { "poller_read_bytes_total",    stats->bytes_read       },
+        { "poller_written_bytes_total", stats->bytes_written    },
+        { "poller_read_eagain_total",   stats->read_eagain      },
+        { "poller_write_eagain_total",  stats->write_eagain     },
+        { "poller_spin_hits_total",     stats->spin_hits        },
+        { "poller_spin_misses_total",   stats->spin_misses      },
+        { "poller_blocks_total",        stats->blocks           },
+        { "poller_busy_poll_errors_total", stats->busy_poll_errors },
+    };
+    char label[32];
+    size_t len = 0;
+    size_t i;
+
+    if(size > 0)
+        buf[0] = '\0';
+
+    for(i = 0; i < sizeof counters / sizeof counters[0]; i++)
+        len = __stats_append(buf, size, len, "%s %llu\n", counters[i].name, counters[i].value);
+
+    len = __stats_append_hist(buf, size, len, "poller_events_per_wakeup", "", &stats->nevents);
+    len = __stats_append_hist(buf, size, len, "poller_timer_late_us", "", &stats->timer_late_us);
+    len = __stats_append_hist(buf, size, len, "poller_loop_lag_us", "", &stats->loop_lag_us);
+    for(i = 0; i < POLLER_STATS_OPS; i++)
     {
-        poller->nodes[fd] = NULL;
+        if(stats->handle_ns[i].count == 0)
+            continue;
 
-        if(node->in_rbtree)
-        {
-            __poller_tree_erase(node, poller);
-        }
-        else
-        {
-            list_del(&node->list);
-        }
+        snprintf(label, sizeof label, "op=\"%d\"", (int)i);
+        len = __stats_append_hist(buf, size, len, "poller_handle_ns", label,
+                                  &stats->handle_ns[i]);
+    }
 
-        __poller_del_fd(fd, node->event, poller);
+    for(i = 0; i < POLLER_STATS_OPS; i++)
+    {
+        if(stats->callback_ns[i].count == 0)
+            continue;
 
-        node->error = 0;
-        node->state = PR_ST_DELETED;
-        stopped = poller->stopped;
+        snprintf(label, sizeof label, "op=\"%d\"", (int)i);
+        len = __stats_append_hist(buf, size, len, "poller_callback_ns", label,
+                                  &stats->callback_ns[i]);
+    }
 
-        if(!stopped)
+    return len < INT_MAX ? (int)len : INT_MAX;
+}
+
+#ifdef POLLER_PROFILE
+
+int poller_profile_format(char *buf, size_t size, poller_t *poller)
+{
+    struct __poller_profile *prof = poller->prof;
+    int npaths = __atomic_load_n(&prof->npaths, __ATOMIC_ACQUIRE);
+    int frames[PROF_DEPTH_MAX + 1];
+    unsigned long long self;
+    size_t len = 0;
+    int depth;
+    int path;
+    int i;
+
+    if(size > 0)
+        buf[0] = '\0';
+
+    for(i = 1; i < npaths; i++)
+    {
+        self = __atomic_load_n(&prof->paths[i].self, __ATOMIC_RELAXED);
+        if(self == 0)
+            continue;
+
+        depth = 0;
+        for(path = i; path != 0 && depth <= PROF_DEPTH_MAX; path = prof->paths[path].parent)
+            frames[depth++] = prof->paths[path].phase;
+
+        len = __stats_append(buf, size, len, "poller");
+        while(depth > 0)
         {
-            node->removed = 1;
-            write(poller->pipe_wr, &node, sizeof (void *));
+            path = frames[--depth];
+            len = __stats_append(buf, size, len, ";%s", path >= PROF_OP_BASE ?
+                                 __prof_op_names[path - PROF_OP_BASE] :
+                                 __prof_phase_names[path]);
         }
+
+        len = __stats_append(buf, size, len, " %llu\n", self);
     }
-    else
+
+    return len < INT_MAX ? (int)len : INT_MAX;
+}
+
+#else
+
+int poller_profile_format(char *buf, size_t size, poller_t *poller)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+int poller_del(int fd, poller_t *poller)
+{
+    struct __poller_node *node;
+    int stopped;
+
+    if(fd < 0)
     {
-        errno = ENOENT;
+        errno = EBADF;
+        return -1;
     }
 
+    pthread_mutex_lock(&poller->mutex);
+    node = __poller_del_node(fd, poller);
+    stopped = poller->stopped;
     pthread_mutex_unlock(&poller->mutex);
 
-    if(stopped)
+    if(node && stopped)
     {
-        free(node->res);
-        poller->callback((struct poller_result *) node, poller->context);
+        __poller_free_node(node->res, poller);
+        __poller_callback(node, poller);
     }
 
     return -!node;
@@ -1472,7 +5073,7 @@ int poller_mod(const struct poller_data *data, int timeout, poller_t *poller)
 {
     struct __poller_node *node;
     struct __poller_node *orig;
-    int stopped = 0;
+    int stopped;
 
     node = __poller_new_node(data, timeout, poller);
     if(!node)
@@ -1481,63 +5082,244 @@ int poller_mod(const struct poller_data *data, int timeout, poller_t *poller)
     }
 
     pthread_mutex_lock(&poller->mutex);
-    orig = poller->nodes[data->fd];
+    orig = __poller_mod_node(node, timeout, poller);
+    stopped = poller->stopped;
+    pthread_mutex_unlock(&poller->mutex);
+
     if(orig)
     {
-        if(__poller_mod_fd(data->fd, orig->event, node->event, node, poller) >= 0)
+        if(stopped)
         {
-            if(orig->in_rbtree)
-            {
-                __poller_tree_erase(orig, poller);
-            }
-            else
-            {
-                list_del(&orig->list);
-            }
+            __poller_free_node(orig->res, poller);
+            __poller_callback(orig, poller);
+        }
 
-            orig->error = 0;
-            orig->state = PR_ST_MODIFIED;
-            stopped = poler->stopped;
-            if(!stopped)
-            {
-                orig->removed = 1;
-                write(poller->pipe_wr, &orig, sizeof (void *));
-            }
+        return 0;
+    }
 
-            if(timeout >= 0)
-            {
-                __poller_insert_node(node, poller);
-            }
-            else
-            {
-                list_add_tail(&node->list, &poller->no_timeo_list);
-            }
+    __poller_free_node(node->res, poller);
+    __poller_free_node(node, poller);
+    return -1;
+}
+
+/*
+ * Batched versions of poller_add(), poller_mod() and poller_del(). All
+ * entries are handled under one acquisition of poller->mutex, and with the
+ * io_uring backend their SQEs go out in one submission. 'errors[i]' gets 0
+ * or the errno of entry i ('errors' may be NULL). The return value is the
+ * number of entries that succeeded, or -1 if nothing could be attempted or
+ * the final submission failed. In the latter case the entries that were
+ * applied stay in effect, are submitted again by the poller thread and get
+ * the errno of the failure in 'errors'.
+ */
+
+#define POLLER_BATCH_STACK  64
 
-            poller->nodes[data->fd] = node;
-            node = NULL;
+static struct __poller_node **__poller_batch_array(int n, struct __poller_node **stack)
+{
+    if(n <= POLLER_BATCH_STACK)
+        return stack;
+
+    return (struct __poller_node **)malloc(n * sizeof (void *));
+}
+
+static void __poller_batch_finish(struct __poller_node **nodes, int n,
+                                  struct __poller_node **stack, poller_t *poller)
+{
+    int i;
+
+    for(i = 0; i < n; i++)
+    {
+        if(nodes[i])
+        {
+            __poller_free_node(nodes[i]->res, poller);
+            __poller_free_node(nodes[i], poller);
         }
     }
-    else
+
+    if(nodes != stack)
+        free(nodes);
+}
+
+static inline void __poller_batch_error(int *errors, int i, int error)
+{
+    if(errors)
+        errors[i] = error;
+}
+
+/* The entries that were applied keep their place in the poller, but their
+ * submission failed: they get its errno, and the poller thread is woken up
+ * to submit them again. */
+static int __poller_batch_end_error(int *errors, int n, poller_t *poller)
+{
+    int error = errno;
+    int i;
+
+    if(errors)
     {
-        errno = ENOENT;
+        for(i = 0; i < n; i++)
+        {
+            if(errors[i] == 0)
+                errors[i] = error;
+        }
+    }
+
+    if(!poller->stopped)
+        __poller_pipe_wake(poller);
+
+    errno = error;
+    return -1;
+}
+
+int poller_add_batch(const struct poller_data *data, const int *timeout, int n,
+                     int *errors, poller_t *poller)
+{
+    struct __poller_node *stack[POLLER_BATCH_STACK];
+    struct __poller_node **nodes = __poller_batch_array(n, stack);
+    int count = 0;
+    int i;
+
+    if(!nodes)
+        return -1;
+
+    for(i = 0; i < n; i++)
+    {
+        nodes[i] = NULL;
+        if(__poller_check_fd(data[i].fd, poller) >= 0)
+            nodes[i] = __poller_new_node(&data[i], timeout[i], poller);
+
+        if(!nodes[i])
+            __poller_batch_error(errors, i, errno);
+    }
+
+    pthread_mutex_lock(&poller->mutex);
+    __poller_ctl_batch_begin(poller);
+    for(i = 0; i < n; i++)
+    {
+        if(!nodes[i])
+            continue;
+
+        if(__poller_add_node(nodes[i], timeout[i], poller) >= 0)
+        {
+            __poller_busy_poll_add(&data[i], poller);
+            nodes[i] = NULL;
+            __poller_batch_error(errors, i, 0);
+            count++;
+        }
+        else
+            __poller_batch_error(errors, i, errno);
     }
 
+    if(__poller_ctl_batch_end(poller) < 0)
+        count = __poller_batch_end_error(errors, n, poller);
+
     pthread_mutex_unlock(&poller->mutex);
 
-    if(stopped)
+    __poller_batch_finish(nodes, n, stack, poller);
+    return count;
+}
+
+int poller_mod_batch(const struct poller_data *data, const int *timeout, int n,
+                     int *errors, poller_t *poller)
+{
+    struct __poller_node *stack[POLLER_BATCH_STACK];
+    struct __poller_node **nodes = __poller_batch_array(n, stack);
+    struct __poller_node *orig;
+    struct list_head *pos, *tmp;
+    LIST_HEAD(orig_list);
+    int count = 0;
+    int i;
+
+    if(!nodes)
+        return -1;
+
+    for(i = 0; i < n; i++)
     {
-        free(orig_res);
-        poller->callback((struct poller_result *)orig, poller->context);
+        nodes[i] = __poller_new_node(&data[i], timeout[i], poller);
+        if(!nodes[i])
+            __poller_batch_error(errors, i, errno);
     }
 
-    if(node == NULL)
+    pthread_mutex_lock(&poller->mutex);
+    __poller_ctl_batch_begin(poller);
+    for(i = 0; i < n; i++)
     {
-        return 0;
+        if(!nodes[i])
+            continue;
+
+        orig = __poller_mod_node(nodes[i], timeout[i], poller);
+        if(orig)
+        {
+            if(poller->stopped)
+                list_add_tail(&orig->list, &orig_list);
+
+            nodes[i] = NULL;
+            __poller_batch_error(errors, i, 0);
+            count++;
+        }
+        else
+            __poller_batch_error(errors, i, errno);
     }
 
-    free(node->res);
-    free(node);
-    return -1;
+    if(__poller_ctl_batch_end(poller) < 0)
+        count = __poller_batch_end_error(errors, n, poller);
+
+    pthread_mutex_unlock(&poller->mutex);
+
+    list_for_each_safe(pos, tmp, &orig_list)
+    {
+        orig = list_entry(pos, struct __poller_node, list);
+        __poller_free_node(orig->res, poller);
+        __poller_callback(orig, poller);
+    }
+
+    __poller_batch_finish(nodes, n, stack, poller);
+    return count;
+}
+
+int poller_del_batch(const int *fd, int n, int *errors, poller_t *poller)
+{
+    struct __poller_node *node;
+    struct list_head *pos, *tmp;
+    LIST_HEAD(node_list);
+    int count = 0;
+    int i;
+
+    pthread_mutex_lock(&poller->mutex);
+    __poller_ctl_batch_begin(poller);
+    for(i = 0; i < n; i++)
+    {
+        node = NULL;
+        if(fd[i] >= 0)
+            node = __poller_del_node(fd[i], poller);
+        else
+            errno = EBADF;
+
+        if(node)
+        {
+            if(poller->stopped)
+                list_add_tail(&node->list, &node_list);
+
+            __poller_batch_error(errors, i, 0);
+            count++;
+        }
+        else
+            __poller_batch_error(errors, i, errno);
+    }
+
+    if(__poller_ctl_batch_end(poller) < 0)
+        count = __poller_batch_end_error(errors, n, poller);
+
+    pthread_mutex_unlock(&poller->mutex);
+
+    list_for_each_safe(pos, tmp, &node_list)
+    {
+        node = list_entry(pos, struct __poller_node, list);
+        __poller_free_node(node->res, poller);
+        __poller_callback(node, poller);
+    }
+
+    return count;
 }
 
 int poller_set_timeout(int fd, int timeout, poller_t *poller)
@@ -1545,29 +5327,22 @@ int poller_set_timeout(int fd, int timeout, poller_t *poller)
     struct __poller_node time_node;
     struct __poller_node *node;
 
-    if((size_t)fd >= poller->max_open_files)
+    if(fd < 0)
     {
-        errno = fd < 0? EBADF : EMFILE;
+        errno = EBADF;
         return -1;
     }
 
     if(timeout >= 0)
     {
-        __poller_node_set_timeout(timeout. &time_node);
+        __poller_node_set_timeout(timeout, &time_node, poller);
     }
 
     pthread_mutex_lock(&poller->mutex);
-    node = poller->nodes[fd];
+    node = __poller_get_node(fd, poller);
     if(node)
     {
-        if(node->in_rbtree)
-        {
-            __poller_tree_erase(node, poller);
-        }
-        else
-        {
-            list_del(&node->list);
-        }
+        __poller_node_erase(node, poller);
 
         if(timeout >= 0)
         {
@@ -1584,7 +5359,7 @@ int poller_set_timeout(int fd, int timeout, poller_t *poller)
         errno = ENOENT;
     }
     pthread_mutex_unlock(&poller->mutex);
-    return = -!node;
+    return -!node;
 }
 
 int poller_add_timer(const struct timespec *value, void *context, void **timer, poller_t *poller)
@@ -1596,7 +5371,7 @@ int poller_add_timer(const struct timespec *value, void *context, void **timer,
         return -1;
     }
 
-    node = (struct __poller_node *)malloc(sizeof(__poller_node));
+    node = __poller_alloc_node(poller);
     if(node)
     {
         memset(&node->data, 0, sizeof(struct poller_data));
@@ -1604,12 +5379,13 @@ int poller_add_timer(const struct timespec *value, void *context, void **timer,
         node->data.fd = -1;
         node->data.context = context;
         node->in_rbtree = 0;
+        node->in_wheel = 0;
         node->removed = 0;
         node->res = NULL;
 
         if(value->tv_sec >= 0)
         {
-            clock_gettime(CLOCK_MONOTONIC, &node->timeout);
+            __poller_now(&node->timeout, poller);
             node->timeout.tv_sec += value->tv_sec;
             node->timeout.tv_nsec += value->tv_nsec;
             if(node->timeout.tv_nsec >= 1000000000)
@@ -1617,6 +5393,8 @@ int poller_add_timer(const struct timespec *value, void *context, void **timer,
                 node->timeout.tv_sec++;
                 node->timeout.tv_nsec -= 1000000000;
             }
+
+            __poller_round_deadline(&node->timeout, poller);
         }
 
         *timer = node;
@@ -1644,21 +5422,14 @@ int poller_del_timer(void *timer, poller_t *poller)
     if(!node->removed)
     {
         node->removed = 1;
-        if(node->in_rbtree)
-        {
-            __poller_tree_erase(node, poller);
-        }
-        else
-        {
-            list_del(&node->list);
-        }
+        __poller_node_erase(node, poller);
 
         node->error = 0;
         node->state = PR_ST_DELETED;
         stopped = poller->stopped;
         if(!stopped)
         {
-            write(poller->pipe_wr, &node, sizeof (void *));
+            __poller_pipe_push(node, poller);
         }
     }
     else
@@ -1671,7 +5442,7 @@ int poller_del_timer(void *timer, poller_t *poller)
 
     if(stopped)
     {
-        poller->callback((struct poller_result *)node, poller->context);
+        __poller_callback(node, poller);
     }
 
     return -!node;
@@ -1682,27 +5453,27 @@ void poller_stop(poller_t *poller)
     struct __poller_node *node;
     struct list_head *pos, *tmp;
     LIST_HEAD(node_list);
-    void *p = NULL;
 
-    write(poller->pipe_wr, &p, sizeof(void *));
+    __atomic_store_n(&poller->pipe_stop, 1, __ATOMIC_RELEASE);
+    __poller_pipe_wake(poller);
     pthread_join(poller->tid, NULL);
     poller->stopped = 1;
 
     pthread_mutex_lock(&poller->mutex);
-    close(poller->pipe_wr);
     __poller_handle_pipe(poller);
-    close(poller->pipe_fd);
+    __poller_close_pipe(poller);
 
     poller->tree_first = NULL;
     poller->tree_last = NULL;
 
-    while(poller->timeo_list.rb_node)
+    while(poller->timeo_tree.rb_node)
     {
         node = rb_entry(poller->timeo_tree.rb_node, struct __poller_node, rb);
         rb_erase(&node->rb, &poller->timeo_tree);
         list_add(&node->list, &node_list);
     }
 
+    __poller_wheel_splice(&node_list, poller);
     list_splice_init(&poller->timeo_list, &node_list);
     list_splice_init(&poller->no_timeo_list, &node_list);
     list_for_each(pos, &node_list)
@@ -1710,8 +5481,8 @@ void poller_stop(poller_t *poller)
         node = list_entry(pos, struct __poller_node, list);
         if(node->data.fd >= 0)
         {
-            poller->nodes[node->data.fd] = NULL;
-            __poller_del_fd(node->data.fd, node->event, poller);
+            __poller_clear_node(node->data.fd, poller);
+            __poller_del_fd(node->data.fd, node->event, node, poller);
         }
         else
         {
@@ -1720,12 +5491,12 @@ void poller_stop(poller_t *poller)
     }
 
     pthread_mutex_unlock(&poller->mutex);
-    list_for_each_safe(pos, tmp, &node_list);
+    list_for_each_safe(pos, tmp, &node_list)
     {
         node = list_entry(pos, struct __poller_node, list);
         node->error = 0;
         node->state = PR_ST_STOPPED;
-        free(node->res);
-        poller->callback((struct poller_result *)node, poller->context);
+        __poller_free_node(node->res, poller);
+        __poller_callback(node, poller);
     }
 }
\ No newline at end of file
@@ -7,29 +7,58 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <openssl/ssl.h>
 
 typedef struct __poller poller_t;
 typedef struct __poller_message poller_message_t;
 
 struct __poller_message{
     int (*append)(const void *, size_t *, poller_message_t *);
+    /* Only looked at with poller_params.message_buffers, and then both
+     * must be set or NULL. Once a message has received its first bytes
+     * through append(), get_buffer() may return storage for the poller to
+     * read into directly, no larger than what the message still expects,
+     * or NULL (or a size of 0) to keep using append(). commit() is then
+     * told how many bytes arrived there and returns like append(). */
+    void *(*get_buffer)(size_t *, poller_message_t *);
+    int (*commit)(size_t, poller_message_t *);
     char data[0];
 };
 
+/* Sockets accepted by PD_OP_LISTEN_BATCH are non-blocking and close-on-exec. */
+struct poller_accepted
+{
+    int sockfd;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+};
+
+/* PD_OP_SENDFILE source. 'offset' and 'count' advance as bytes are sent. */
+struct poller_sendfile
+{
+    int fd;
+    off_t offset;
+    size_t count;
+};
+
 struct poller_data{
 #define PD_OP_TIMER         0
 #define PD_OP_READ          1
 #define PD_OP_WRITE         2
 #define PD_OP_LISTEN        3
 #define PD_OP_CONNECT       4
-#defien PD_OP_RECVFROM      5
-#defien PD_OP_SSL_READ      PD_OP_READ
-#defien PD_OP_SSL_WRITE     PD_OP_WRITE
+#define PD_OP_RECVFROM      5
+#define PD_OP_SSL_READ      PD_OP_READ
+#define PD_OP_SSL_WRITE     PD_OP_WRITE
 #define PD_OP_SSL_ACCEPT    6
 #define PD_OP_SSL_CONNECT   7
 #define PD_OP_SSL_SHUTDOWN  8
 #define PD_OP_EVENT         9
 #define PD_OP_NOTIFY        10
+#define PD_OP_SENDTO        11  /* iovcnt datagrams in write_msg */
+#define PD_OP_LISTEN_BATCH  12  /* accepted sockets go to accept_batch() */
+#define PD_OP_SENDFILE      13  /* 'count' bytes of sendfile->fd to fd */
     short operation;
     unsigned short iovcnt;
     int fd;
@@ -38,14 +67,17 @@ struct poller_data{
       poller_message_t *(*create_message)(void *);
       int (*partial_written)(size_t,void *);
       void *(*accept)(const struct sockaddr *, socklen_t, int, void *);
-      void *(recvfrom)(const struct sockaddr *, socklen_t, const void *, size_t, void *);
+      void *(*accept_batch)(const struct poller_accepted *, int, void *);
+      void *(*recvfrom)(const struct sockaddr *, socklen_t, const void *, size_t, void *);
       void *(*event)(void *);
-      void *(notify)(void *, void *);
+      void *(*notify)(void *, void *);
     };
     void *context;
     union{
         poller_message_t *message;
         struct iovec *write_iov;
+        struct msghdr *write_msg;
+        struct poller_sendfile *sendfile;
         void *result;
     };
 };
@@ -60,14 +92,134 @@ struct poller_result
 #define PR_ST_STOPPED  5
     int state;
     int error;
-    sturct poller_data data;
+    struct poller_data data;
+};
+
+/* Bucket 0 counts zeros, bucket i counts values in [2^(i-1), 2^i). */
+#define POLLER_HIST_BUCKETS 32
+struct poller_histogram
+{
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long buckets[POLLER_HIST_BUCKETS];
+};
+
+#define POLLER_STATS_OPS    16
+struct poller_stats
+{
+    unsigned long long wakeups;         /* returns from the backend wait */
+    unsigned long long events;
+    unsigned long long callbacks;       /* results delivered */
+    unsigned long long timeouts;        /* nodes and timers expired */
+    unsigned long long pipe_nodes;      /* deletions handed over by other threads */
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long long read_eagain;
+    unsigned long long write_eagain;
+    unsigned long long spin_hits;       /* busy polling: waits ended by spinning */
+    unsigned long long spin_misses;     /* spins that found nothing */
+    unsigned long long blocks;          /* blocking waits after a spin (or instead) */
+    unsigned long long busy_poll_errors;    /* busy_poll_sockets options refused */
+    struct poller_histogram nevents;    /* events per wakeup */
+    struct poller_histogram timer_late_us;
+    struct poller_histogram loop_lag_us;    /* wakeup to the next wait, with stats_timing */
+    /* Nanoseconds spent handling one event, by PD_OP_*, callbacks included,
+     * and spent in one callback() on the poller thread, by the PD_OP_* of
+     * its result (batch_callback() is not timed). Only filled in with
+     * poller_params.stats_timing. */
+    struct poller_histogram handle_ns[POLLER_STATS_OPS];
+    struct poller_histogram callback_ns[POLLER_STATS_OPS];
+};
+
+struct poller_slow_report
+{
+#define POLLER_SLOW_CALLBACK    0   /* one call of callback() or batch_callback() */
+#define POLLER_SLOW_EVENT       1   /* handling of one event, user hooks included */
+#define POLLER_SLOW_LOOP        2   /* one loop iteration, wakeup to the next wait */
+    int kind;
+    int operation;                  /* PD_OP_*, or -1 */
+    int fd;                         /* or -1 */
+    long long duration_ns;
 };
 
 struct poller_params
 {
+#define POLLER_BACKEND_DEFAULT  0   /* epoll or kqueue */
+#define POLLER_BACKEND_IO_URING 1   /* needs POLLER_IO_URING and liburing */
+#define POLLER_TIMEO_RBTREE     0
+#define POLLER_TIMEO_WHEEL      1   /* O(1) timeouts with 1ms resolution */
+#define POLLER_CLOCK_PRECISE    0   /* CLOCK_MONOTONIC */
+#define POLLER_CLOCK_COARSE     1   /* CLOCK_MONOTONIC_COARSE, may lag one kernel tick */
+#define POLLER_CLOCK_CACHED     2   /* poller thread: time of the last wakeup; others: coarse */
+    /* poller_add() rejects fds from here up with EMFILE, until raised with
+     * poller_set_max_open_files(). Table pages are allocated on first use. */
     size_t max_open_files;
     void (*callback)(struct poller_result *, void *);
     void *context;
+    /* If set, replaces 'callback': results gathered over one loop iteration
+     * are delivered together. */
+    void (*batch_callback)(struct poller_result **, int, void *);
+    int backend;
+    /* EPOLLEXCLUSIVE on PD_OP_LISTEN fds. Has no effect with kqueue or
+     * the io_uring backend. */
+    int listen_exclusive;
+    /* Nodes per slab chunk, 0 to use malloc only. When non-zero, every
+     * result passed to the callback must go back via poller_free_result()
+     * on the poller that delivered it, before that poller is destroyed.
+     * Ignored by poller_group_create(). */
+    size_t slab_nodes;
+    int timeo_type;
+    int recv_batch;                 /* datagrams per recvmmsg(), Linux only */
+    int accept_budget;              /* PD_OP_LISTEN_BATCH accepts per wakeup, 0 for 64 */
+    /* Linux only, 0 to disable. PD_OP_WRITE sends of at least this many
+     * bytes use MSG_ZEROCOPY, and the final result waits until the kernel
+     * has released the pages, so the iovec buffers must stay untouched
+     * until then, even after partial_written(). After PR_ST_ERROR the
+     * kernel may hold them until the socket is closed. */
+    size_t zerocopy_threshold;
+    /* Ask OpenSSL for kernel TLS on PD_OP_SSL_ACCEPT/PD_OP_SSL_CONNECT.
+     * Connections that get it read and write with plain syscalls, and
+     * PD_OP_SENDFILE works on them. Needs OpenSSL 3 built with kTLS. */
+    int ktls;
+    /* TLS PD_OP_WRITE: one SSL_write() per iovec, without gathering small
+     * iovecs into record-sized writes. Unless set, adding a TLS PD_OP_WRITE
+     * node sets SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER on its SSL for good. */
+    int ssl_gather_off;
+    int stats_timing;               /* clock reads per event and callback, for *_ns */
+    int message_buffers;            /* messages set get_buffer() and commit() */
+    /* Watchdog, 0 to disable. Anything on the poller thread above
+     * 'watchdog_us' is reported to watchdog() there, with 'context' as
+     * above. Callbacks that a stopped poller runs in the calling thread
+     * are not watched. */
+    long watchdog_us;
+    void (*watchdog)(const struct poller_slow_report *, void *);
+    /* Busy polling, 0 to disable. The poller thread spins on non-blocking
+     * waits for up to this long before it blocks, spinning less while idle.
+     * With 'busy_poll_sockets', sockets also get SO_BUSY_POLL (and
+     * SO_PREFER_BUSY_POLL where available) with the same budget, once:
+     * when accepted by the poller, or added for PD_OP_CONNECT or
+     * PD_OP_RECVFROM. */
+    long busy_poll_us;
+    int busy_poll_sockets;
+    /* Linux epoll backend: wait on the nearest deadline with epoll_pwait2()
+     * and leave the timerfd unarmed. Ignored where unavailable. */
+    int timer_deadline;
+    /* Clock that timeouts passed to poller_add(), poller_mod(),
+     * poller_set_timeout() and poller_add_timer() count from. With a
+     * non-zero 'timeo_granularity_us', deadlines are rounded up to a
+     * multiple of it, so nearby ones expire together and share a timer
+     * arm. A coarse or cached clock can be behind by up to a tick or one
+     * loop iteration, and a timeout may fire early by as much. */
+    int clock_source;
+    long timeo_granularity_us;
+    /* io_uring backend: PD_OP_READ sockets without SSL receive through the
+     * ring, with a multishot recv into buffers the poller provides, and
+     * listen fds keep a few accepts queued there, so the poller thread
+     * makes no syscall per read or accept. Reads with 'message_buffers'
+     * still poll. Ignored where the kernel has no provided buffer rings
+     * (before Linux 5.19). Bytes already received for a PD_OP_READ node
+     * that is deleted or modified are dropped, not left in the socket. */
+    int uring_ops;
 };
 
 #ifdef __cplusplus
@@ -75,23 +227,28 @@ extern "C"
 {
 #endif
 
-    poller_t *poller_create(const struct poller_params *params);
-    int poller_start(poller_t *poller);
-    int poller_add(const struct pollar_data *data, int timeout, poller_t *poller);
-    int poller_del(int fd, poller_t *poller);
-    int poller_mod(const struct poller_data *data, int timeout, poller_t *poller);
-
-};
-
 poller_t *poller_create(const struct poller_params *params);
 int poller_start(poller_t *poller);
+int poller_bind_cpu(int cpu, poller_t *poller);
+int poller_set_max_open_files(size_t max_open_files, poller_t *poller);
 int poller_add(const struct poller_data *data, int timeout, poller_t *poller);
 int poller_del(int fd, poller_t *poller);
 int poller_mod(const struct poller_data *data, int timeout, poller_t *poller);
+int poller_add_batch(const struct poller_data *data, const int *timeout, int n,
+                     int *errors, poller_t *poller);
+int poller_mod_batch(const struct poller_data *data, const int *timeout, int n,
+                     int *errors, poller_t *poller);
+int poller_del_batch(const int *fd, int n, int *errors, poller_t *poller);
+void poller_free_result(struct poller_result *result, poller_t *poller);
+void poller_get_stats(struct poller_stats *stats, poller_t *poller);
+int poller_format_stats(const struct poller_stats *stats, char *buf, size_t size);
+/* Folded stacks of poller thread time, for a build with -DPOLLER_PROFILE.
+ * Otherwise returns -1 with errno ENOSYS. */
+int poller_profile_format(char *buf, size_t size, poller_t *poller);
 int poller_set_timeout(int fd, int timeout, poller_t *poller);
-int poller_add_timer(const struct timespace *value, void *context, void **timer, poller_t *poller);
-int poller_del_time(void *timer, poller_t *poller);
-void poller_stop(void *timer, poller_t *poller);
+int poller_add_timer(const struct timespec *value, void *context, void **timer, poller_t *poller);
+int poller_del_timer(void *timer, poller_t *poller);
+void poller_stop(poller_t *poller);
 void poller_destroy(poller_t *poller);
 
 #ifdef __cplusplus
@@ -0,0 +1,348 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "poller_framing.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__) && defined(__SSE2__))
+# include <immintrin.h>
+# define POLLER_FRAMING_X86
+#endif
+
+#define POLLER_FRAME_MIN_CAPACITY   256
+
+/*
+ * Pattern search. A vector of candidates is the AND of one equality mask
+ * per pattern byte, each taken from a load shifted by that byte's offset,
+ * so a match is found in one pass whatever the pattern length. The vector
+ * loops stop while a full shifted load still fits and return where the
+ * scalar loop has to take over.
+ */
+
+static const char *__poller_find_scalar(const char *p, const char *end,
+                                        const char *pat, int len)
+{
+    while(end - p >= len)
+    {
+        p = (const char *)memchr(p, pat[0], end - p - len + 1);
+        if(!p)
+            return NULL;
+
+        if(memcmp(p + 1, pat + 1, len - 1) == 0)
+            return p;
+
+        p++;
+    }
+
+    return NULL;
+}
+
+#ifdef POLLER_FRAMING_X86
+
+static const char *__poller_find_sse2(const char *p, const char *end,
+                                      const char *pat, int len,
+                                      const char **resume)
+{
+    __m128i c[4];
+    unsigned int mask;
+    int i;
+
+    for(i = 0; i < len; i++)
+        c[i] = _mm_set1_epi8(pat[i]);
+
+    while(end - p >= 16 + len - 1)
+    {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), c[0]));
+        for(i = 1; i < len && mask; i++)
+            mask &= _mm_movemask_epi8(_mm_cmpeq_epi8(
+                        _mm_loadu_si128((const __m128i *)(p + i)), c[i]));
+
+        if(mask)
+            return p + __builtin_ctz(mask);
+
+        p += 16;
+    }
+
+    *resume = p;
+    return NULL;
+}
+
+__attribute__((target("avx2")))
+static const char *__poller_find_avx2(const char *p, const char *end,
+                                      const char *pat, int len,
+                                      const char **resume)
+{
+    __m256i c[4];
+    unsigned int mask;
+    int i;
+
+    for(i = 0; i < len; i++)
+        c[i] = _mm256_set1_epi8(pat[i]);
+
+    while(end - p >= 32 + len - 1)
+    {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i *)p), c[0]));
+        for(i = 1; i < len && mask; i++)
+            mask &= _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                        _mm256_loadu_si256((const __m256i *)(p + i)), c[i]));
+
+        if(mask)
+            return p + __builtin_ctz(mask);
+
+        p += 32;
+    }
+
+    *resume = p;
+    return NULL;
+}
+
+#endif
+
+const void *poller_find_delim(const void *buf, size_t n, const char *delim, int len)
+{
+    const char *p = (const char *)buf;
+    const char *end = p + n;
+#ifdef POLLER_FRAMING_X86
+    const char *found;
+#endif
+
+    if(len < 1 || len > 4)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+#ifdef POLLER_FRAMING_X86
+    if(n >= (size_t)(16 + len - 1))
+    {
+        if(__builtin_cpu_supports("avx2"))
+            found = __poller_find_avx2(p, end, delim, len, &p);
+        else
+            found = __poller_find_sse2(p, end, delim, len, &p);
+
+        if(found)
+            return found;
+    }
+#endif
+
+    if(len == 1)
+        return memchr(p, delim[0], end - p);
+
+    return __poller_find_scalar(p, end, delim, len);
+}
+
+const void *poller_find_crlf(const void *buf, size_t n)
+{
+    return poller_find_delim(buf, n, "\r\n", 2);
+}
+
+const void *poller_find_http_header_end(const void *buf, size_t n)
+{
+    const char *p = (const char *)poller_find_delim(buf, n, "\r\n\r\n", 4);
+
+    return p ? p + 4 : NULL;
+}
+
+static int __poller_frame_reserve(size_t size, struct poller_frame_message *msg)
+{
+    size_t capacity = msg->capacity;
+    void *buf;
+
+    if(size <= capacity)
+        return 0;
+
+    if(size > msg->max_size)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if(capacity < POLLER_FRAME_MIN_CAPACITY)
+        capacity = POLLER_FRAME_MIN_CAPACITY;
+
+    while(capacity < size)
+        capacity *= 2;
+
+    if(capacity > msg->max_size)
+        capacity = msg->max_size;
+
+    buf = realloc(msg->buf, capacity);
+    if(!buf)
+        return -1;
+
+    msg->buf = (char *)buf;
+    msg->capacity = capacity;
+    return 0;
+}
+
+static int __poller_frame_copy(const void *buf, size_t n, struct poller_frame_message *msg)
+{
+    if(__poller_frame_reserve(msg->size + n, msg) < 0)
+        return -1;
+
+    memcpy(msg->buf + msg->size, buf, n);
+    msg->size += n;
+    return 0;
+}
+
+/*
+ * Only the new bytes are searched. A delimiter split across two reads is
+ * caught by searching the few bytes around the seam first.
+ */
+int poller_frame_append_delim(const void *buf, size_t *n, poller_message_t *msg)
+{
+    struct poller_frame_message *frame = (struct poller_frame_message *)msg;
+    int len = frame->delim_len;
+    const char *p = (const char *)buf;
+    const char *found;
+    char seam[6];
+    size_t head;
+    size_t tail;
+
+    if(frame->size > 0 && len > 1)
+    {
+        tail = frame->size < (size_t)len - 1 ? frame->size : (size_t)len - 1;
+        head = *n < (size_t)len - 1 ? *n : (size_t)len - 1;
+        memcpy(seam, frame->buf + frame->size - tail, tail);
+        memcpy(seam + tail, p, head);
+        found = __poller_find_scalar(seam, seam + tail + head, frame->delim, len);
+        if(found)
+        {
+            *n = found - seam + len - tail;
+            return __poller_frame_copy(p, *n, frame) < 0 ? -1 : 1;
+        }
+    }
+
+    found = (const char *)poller_find_delim(p, *n, frame->delim, len);
+    if(found)
+    {
+        *n = found - p + len;
+        return __poller_frame_copy(p, *n, frame) < 0 ? -1 : 1;
+    }
+
+    return __poller_frame_copy(p, *n, frame);
+}
+
+int poller_frame_append_length(const void *buf, size_t *n, poller_message_t *msg)
+{
+    struct poller_frame_message *frame = (struct poller_frame_message *)msg;
+    const unsigned char *prefix;
+    unsigned long long len = 0;
+    size_t want;
+    int i;
+
+    if(frame->frame_size == 0)
+    {
+        want = frame->len_size - frame->size;
+        if(*n < want)
+            return __poller_frame_copy(buf, *n, frame);
+
+        if(__poller_frame_copy(buf, want, frame) < 0)
+            return -1;
+
+        prefix = (const unsigned char *)frame->buf;
+        for(i = 0; i < frame->len_size; i++)
+            len = len << 8 | prefix[i];
+
+        if(len > frame->max_size - frame->len_size)
+        {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        frame->frame_size = frame->len_size + len;
+        if(__poller_frame_reserve(frame->frame_size, frame) < 0)
+            return -1;
+    }
+    else
+        want = 0;
+
+    if(*n - want > frame->frame_size - frame->size)
+        *n = want + frame->frame_size - frame->size;
+
+    if(__poller_frame_copy((const char *)buf + want, *n - want, frame) < 0)
+        return -1;
+
+    return frame->size == frame->frame_size;
+}
+
+void *poller_frame_get_buffer(size_t *n, poller_message_t *msg)
+{
+    struct poller_frame_message *frame = (struct poller_frame_message *)msg;
+
+    if(frame->frame_size == 0 || frame->size == frame->frame_size)
+        return NULL;
+
+    *n = frame->frame_size - frame->size;
+    return frame->buf + frame->size;
+}
+
+int poller_frame_commit(size_t n, poller_message_t *msg)
+{
+    struct poller_frame_message *frame = (struct poller_frame_message *)msg;
+
+    frame->size += n;
+    return frame->size == frame->frame_size;
+}
+
+static void __poller_frame_init(size_t max_size, struct poller_frame_message *msg)
+{
+    msg->base.append = poller_frame_append_delim;
+    msg->base.get_buffer = NULL;
+    msg->base.commit = NULL;
+    msg->buf = NULL;
+    msg->size = 0;
+    msg->capacity = 0;
+    msg->max_size = max_size;
+    msg->frame_size = 0;
+    msg->len_size = 0;
+    msg->delim_len = 0;
+}
+
+int poller_frame_init_delim(const char *delim, int len, size_t max_size,
+                            struct poller_frame_message *msg)
+{
+    if(len < 1 || len > 4)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    __poller_frame_init(max_size, msg);
+    memcpy(msg->delim, delim, len);
+    msg->delim_len = len;
+    return 0;
+}
+
+int poller_frame_init_line(size_t max_size, struct poller_frame_message *msg)
+{
+    return poller_frame_init_delim("\r\n", 2, max_size, msg);
+}
+
+int poller_frame_init_http_header(size_t max_size, struct poller_frame_message *msg)
+{
+    return poller_frame_init_delim("\r\n\r\n", 4, max_size, msg);
+}
+
+int poller_frame_init_length(int len_size, size_t max_size,
+                             struct poller_frame_message *msg)
+{
+    if((len_size != 1 && len_size != 2 && len_size != 4 && len_size != 8) ||
+        max_size < (size_t)len_size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    __poller_frame_init(max_size, msg);
+    msg->base.append = poller_frame_append_length;
+    msg->base.get_buffer = poller_frame_get_buffer;
+    msg->base.commit = poller_frame_commit;
+    msg->len_size = len_size;
+    return 0;
+}
+
+void poller_frame_deinit(struct poller_frame_message *msg)
+{
+    free(msg->buf);
+}
@@ -0,0 +1,67 @@
+#ifndef _POLLER_FRAMING_H_
+#define _POLLER_FRAMING_H_
+
+#include <stddef.h>
+#include "poller.h"
+
+/*
+ * Framing helpers for poller_message_t. A poller_frame_message collects
+ * one frame into 'buf' and its append() returns 1 at the frame boundary,
+ * consuming only the bytes of that frame, so pipelined frames that arrive
+ * in one read are split across consecutive messages by the poller.
+ *
+ * Delimited frames end with a pattern of 1 to 4 bytes, included in 'buf':
+ * a CRLF line, the CRLF CRLF that ends an HTTP/1.x header block, a NUL,
+ * and so on. An HTTP body, if any, is left to the next message. Length
+ * prefixed frames start with a 1, 2, 4 or 8 byte big-endian payload
+ * length; 'buf' holds the prefix followed by the payload, and once the
+ * prefix is in, the payload is read straight into 'buf' through
+ * get_buffer() and commit() if the poller has message_buffers set.
+ *
+ * A frame that would exceed 'max_size' fails with EMSGSIZE.
+ *
+ * Searches use AVX2 where the CPU has it, SSE2 on other x86 and libc
+ * memchr() elsewhere.
+ */
+
+struct poller_frame_message
+{
+    poller_message_t base;
+    char *buf;
+    size_t size;
+    size_t capacity;
+    size_t max_size;
+    size_t frame_size;      /* length prefixed: prefix plus payload, once known */
+    int len_size;
+    int delim_len;
+    char delim[4];
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+const void *poller_find_delim(const void *buf, size_t n, const char *delim, int len);
+const void *poller_find_crlf(const void *buf, size_t n);
+/* Returns the first byte after the CRLF CRLF, or NULL. */
+const void *poller_find_http_header_end(const void *buf, size_t n);
+
+int poller_frame_init_delim(const char *delim, int len, size_t max_size,
+                            struct poller_frame_message *msg);
+int poller_frame_init_line(size_t max_size, struct poller_frame_message *msg);
+int poller_frame_init_http_header(size_t max_size, struct poller_frame_message *msg);
+int poller_frame_init_length(int len_size, size_t max_size,
+                             struct poller_frame_message *msg);
+void poller_frame_deinit(struct poller_frame_message *msg);
+
+int poller_frame_append_delim(const void *buf, size_t *n, poller_message_t *msg);
+int poller_frame_append_length(const void *buf, size_t *n, poller_message_t *msg);
+void *poller_frame_get_buffer(size_t *n, poller_message_t *msg);
+int poller_frame_commit(size_t n, poller_message_t *msg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_POLLER_FRAMING_H_
@@ -0,0 +1,222 @@
+#ifdef __linux__
+# ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+# endif
+#include <sched.h>
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "poller.h"
+#include "poller_group.h"
+
+struct __poller_group
+{
+    size_t nshards;
+    poller_t *pollers[1];
+};
+
+static inline poller_t *__poller_group_route(int fd, poller_group_t *group)
+{
+    return group->pollers[(unsigned int)fd % group->nshards];
+}
+
+poller_group_t *poller_group_create(size_t nshards, const struct poller_params *params)
+{
+    struct poller_params shard_params = *params;
+    poller_group_t *group;
+    size_t size;
+    size_t i;
+
+    if(nshards == 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size = offsetof(poller_group_t, pollers) + nshards * sizeof (void *);
+    group = (poller_group_t *)malloc(size);
+    if(!group)
+        return NULL;
+
+    shard_params.listen_exclusive = 1;
+    /* A slab result must go back to the shard that allocated it, which a
+     * group callback cannot tell: listen fds are in every shard. */
+    shard_params.slab_nodes = 0;
+    for(i = 0; i < nshards; i++)
+    {
+        group->pollers[i] = poller_create(&shard_params);
+        if(!group->pollers[i])
+            break;
+    }
+
+    if(i == nshards)
+    {
+        group->nshards = nshards;
+        return group;
+    }
+
+    while(i > 0)
+        poller_destroy(group->pollers[--i]);
+
+    free(group);
+    return NULL;
+}
+
+/* Shard i goes to the i-th CPU this process is allowed to run on. */
+static void __poller_group_bind(poller_group_t *group)
+{
+#ifdef __linux__
+    cpu_set_t cpuset;
+    int cpus[CPU_SETSIZE];
+    int ncpus = 0;
+    size_t i;
+    int cpu;
+
+    if(sched_getaffinity(0, sizeof (cpu_set_t), &cpuset) < 0)
+        return;
+
+    for(cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if(CPU_ISSET(cpu, &cpuset))
+            cpus[ncpus++] = cpu;
+    }
+
+    for(i = 0; i < group->nshards && ncpus > 0; i++)
+        poller_bind_cpu(cpus[i % ncpus], group->pollers[i]);
+#endif
+}
+
+int poller_group_start(poller_group_t *group)
+{
+    size_t i;
+
+    for(i = 0; i < group->nshards; i++)
+    {
+        if(poller_start(group->pollers[i]) < 0)
+            break;
+    }
+
+    if(i == group->nshards)
+    {
+        __poller_group_bind(group);
+        return 0;
+    }
+
+    while(i > 0)
+        poller_stop(group->pollers[--i]);
+
+    return -1;
+}
+
+size_t poller_group_size(const poller_group_t *group)
+{
+    return group->nshards;
+}
+
+poller_t *poller_group_get(size_t index, poller_group_t *group)
+{
+    return group->pollers[index % group->nshards];
+}
+
+int poller_group_add(const struct poller_data *data, int timeout, poller_group_t *group)
+{
+    return poller_add(data, timeout, __poller_group_route(data->fd, group));
+}
+
+int poller_group_del(int fd, poller_group_t *group)
+{
+    return poller_del(fd, __poller_group_route(fd, group));
+}
+
+int poller_group_mod(const struct poller_data *data, int timeout, poller_group_t *group)
+{
+    return poller_mod(data, timeout, __poller_group_route(data->fd, group));
+}
+
+int poller_group_set_timeout(int fd, int timeout, poller_group_t *group)
+{
+    return poller_set_timeout(fd, timeout, __poller_group_route(fd, group));
+}
+
+int poller_group_set_max_open_files(size_t max_open_files, poller_group_t *group)
+{
+    int ret = 0;
+    size_t i;
+
+    for(i = 0; i < group->nshards; i++)
+    {
+        if(poller_set_max_open_files(max_open_files, group->pollers[i]) < 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+int poller_group_add_listen(const struct poller_data *data, int timeout, poller_group_t *group)
+{
+    size_t i;
+
+    if(data->operation != PD_OP_LISTEN && data->operation != PD_OP_LISTEN_BATCH)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(i = 0; i < group->nshards; i++)
+    {
+        if(poller_add(data, timeout, group->pollers[i]) < 0)
+            break;
+    }
+
+    if(i == group->nshards)
+        return 0;
+
+    while(i > 0)
+        poller_del(data->fd, group->pollers[--i]);
+
+    return -1;
+}
+
+int poller_group_del_listen(int fd, poller_group_t *group)
+{
+    int ret = -1;
+    size_t i;
+
+    for(i = 0; i < group->nshards; i++)
+    {
+        if(poller_del(fd, group->pollers[i]) >= 0)
+            ret = 0;
+    }
+
+    return ret;
+}
+
+int poller_group_add_timer(const struct timespec *value, void *context, void **timer,
+                           size_t index, poller_group_t *group)
+{
+    return poller_add_timer(value, context, timer, poller_group_get(index, group));
+}
+
+int poller_group_del_timer(void *timer, size_t index, poller_group_t *group)
+{
+    return poller_del_timer(timer, poller_group_get(index, group));
+}
+
+void poller_group_stop(poller_group_t *group)
+{
+    size_t i;
+
+    for(i = 0; i < group->nshards; i++)
+        poller_stop(group->pollers[i]);
+}
+
+void poller_group_destroy(poller_group_t *group)
+{
+    size_t i;
+
+    for(i = 0; i < group->nshards; i++)
+        poller_destroy(group->pollers[i]);
+
+    free(group);
+}
@@ -0,0 +1,53 @@
+#ifndef _POLLER_GROUP_H_
+#define _POLLER_GROUP_H_
+
+#include <stddef.h>
+#include "poller.h"
+
+/*
+ * A poller group runs one poller (one thread) per shard. Plain fds are
+ * routed to a shard by fd hash, so poller_group_del/mod/set_timeout find
+ * them again without any lookup table: fd goes to poller_group_get(fd).
+ * A caller that wants to pick the shard itself uses poller_group_get()
+ * and the plain poller_* API.
+ *
+ * A listening fd added with poller_group_add_listen() is registered in
+ * every shard with EPOLLEXCLUSIVE, so each connection wakes one shard only
+ * (with epoll; kqueue and io_uring shards are all woken).
+ * With SO_REUSEPORT, open one listening socket per shard instead and add
+ * socket i to poller_group_get(i, group). Either way a listen fd delivers
+ * its final result once per shard it was added to.
+ *
+ * Shards do not use the node slab: 'slab_nodes' in the params is ignored,
+ * so a result can be freed with poller_free_result() on any shard.
+ */
+
+typedef struct __poller_group poller_group_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+poller_group_t *poller_group_create(size_t nshards, const struct poller_params *params);
+int poller_group_start(poller_group_t *group);
+size_t poller_group_size(const poller_group_t *group);
+poller_t *poller_group_get(size_t index, poller_group_t *group);
+int poller_group_add(const struct poller_data *data, int timeout, poller_group_t *group);
+int poller_group_del(int fd, poller_group_t *group);
+int poller_group_mod(const struct poller_data *data, int timeout, poller_group_t *group);
+int poller_group_set_timeout(int fd, int timeout, poller_group_t *group);
+int poller_group_set_max_open_files(size_t max_open_files, poller_group_t *group);
+int poller_group_add_listen(const struct poller_data *data, int timeout, poller_group_t *group);
+int poller_group_del_listen(int fd, poller_group_t *group);
+int poller_group_add_timer(const struct timespec *value, void *context, void **timer,
+                           size_t index, poller_group_t *group);
+int poller_group_del_timer(void *timer, size_t index, poller_group_t *group);
+void poller_group_stop(poller_group_t *group);
+void poller_group_destroy(poller_group_t *group);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_POLLER_GROUP_H_
@@ -0,0 +1,56 @@
+#ifndef _LINUX_RBTREE_H
+#define _LINUX_RBTREE_H
+
+/*
+ * Red-black tree with the Linux kernel interface. Nodes are embedded in
+ * the user's structure; searching and linking a new node is done by the
+ * caller, followed by rb_link_node() and rb_insert_color().
+ */
+
+struct rb_node
+{
+    struct rb_node *rb_parent;
+    struct rb_node *rb_right;
+    struct rb_node *rb_left;
+    char rb_color;
+#define RB_RED      0
+#define RB_BLACK    1
+};
+
+struct rb_root
+{
+    struct rb_node *rb_node;
+};
+
+#define RB_ROOT (struct rb_root){ (struct rb_node *)0, }
+
+#define rb_entry(ptr, type, member) \
+    ((type *)((char *)(ptr)-(unsigned long)(&((type *)0)->member)))
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+void rb_erase(struct rb_node *node, struct rb_root *root);
+
+struct rb_node *rb_next(struct rb_node *node);
+struct rb_node *rb_prev(struct rb_node *node);
+struct rb_node *rb_first(struct rb_root *root);
+struct rb_node *rb_last(struct rb_root *root);
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+                                struct rb_node **link)
+{
+    node->rb_parent = parent;
+    node->rb_color = RB_RED;
+    node->rb_left = node->rb_right = (struct rb_node *)0;
+    *link = node;
+}
+
+#endif //_LINUX_RBTREE_H
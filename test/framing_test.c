@@ -0,0 +1,397 @@
+// Framing helpers: pattern search at every vector lane boundary, and
+// frames split across reads the way the poller's read loop splits them.
+//
+//   ctest -R framing_test
+//
+// The SSE2 and AVX2 searches are also called directly, so both are
+// checked whichever one poller_find_delim() picks on this CPU.
+//
+#include <stdio.h>
+#include "../src/kernel/poller_framing.c"
+
+#define TEST_BUF    160
+
+static int __test_failed;
+
+#define CHECK(cond) \
+    do { \
+        if(!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            __test_failed = 1; \
+            return; \
+        } \
+    } while(0)
+
+static const char *__test_naive(const char *p, size_t n, const char *pat, int len)
+{
+    size_t i;
+
+    for(i = 0; i + len <= n; i++)
+    {
+        if(memcmp(p + i, pat, len) == 0)
+            return p + i;
+    }
+
+    return NULL;
+}
+
+typedef const char *(*__test_find_t)(const char *, size_t, const char *, int);
+
+static const char *__test_find(const char *p, size_t n, const char *pat, int len)
+{
+    return (const char *)poller_find_delim(p, n, pat, len);
+}
+
+#ifdef POLLER_FRAMING_X86
+
+/* The vector loops leave the tail to the scalar one, as poller_find_delim() does. */
+static const char *__test_find_sse2(const char *p, size_t n, const char *pat, int len)
+{
+    const char *end = p + n;
+    const char *found;
+
+    found = __poller_find_sse2(p, end, pat, len, &p);
+    return found ? found : __poller_find_scalar(p, end, pat, len);
+}
+
+static const char *__test_find_avx2(const char *p, size_t n, const char *pat, int len)
+{
+    const char *end = p + n;
+    const char *found;
+
+    found = __poller_find_avx2(p, end, pat, len, &p);
+    return found ? found : __poller_find_scalar(p, end, pat, len);
+}
+
+#endif
+
+/*
+ * Each pattern at every offset of every buffer length up to TEST_BUF, so
+ * that it straddles each 16 and 32 byte lane boundary, in a filler of the
+ * pattern with its last byte changed, to leave near misses everywhere.
+ */
+static void __test_search(__test_find_t find)
+{
+    static const char *pats[] = { "\n", "\r\n", "\r\n\0", "\r\n\r\n" };
+    static const int lens[] = { 1, 2, 3, 4 };
+    char buf[TEST_BUF];
+    const char *want;
+    const char *got;
+    size_t n;
+    size_t off;
+    size_t i;
+    int k;
+
+    for(k = 0; k < 4; k++)
+    {
+        for(n = 0; n <= TEST_BUF; n++)
+        {
+            for(off = 0; off + lens[k] <= n; off++)
+            {
+                for(i = 0; i < n; i++)
+                    buf[i] = i % lens[k] == (size_t)lens[k] - 1 ? 'x' : pats[k][i % lens[k]];
+
+                memcpy(buf + off, pats[k], lens[k]);
+                want = __test_naive(buf, n, pats[k], lens[k]);
+                got = find(buf, n, pats[k], lens[k]);
+                CHECK(want == got);
+            }
+
+            for(i = 0; i < n; i++)
+                buf[i] = 'x';
+
+            CHECK(find(buf, n, pats[k], lens[k]) == NULL);
+        }
+    }
+}
+
+static void test_search(void)
+{
+    __test_search(__test_find);
+#ifdef POLLER_FRAMING_X86
+    __test_search(__test_find_sse2);
+    if(__builtin_cpu_supports("avx2"))
+        __test_search(__test_find_avx2);
+#endif
+}
+
+/*
+ * The poller's read loop: each read goes to append(), a completed message
+ * takes only its own bytes and the rest starts the next message. With
+ * 'buffers', a message that has a buffer to lend gets the next read there
+ * instead, no larger than the buffer.
+ */
+struct __test_stream
+{
+    const char *data;
+    size_t size;
+    size_t pos;
+    char frames[64][256];
+    size_t frame_sizes[64];
+    int nframes;
+};
+
+static int __test_new(struct poller_frame_message *msg, int len_size)
+{
+    if(len_size)
+        return poller_frame_init_length(len_size, 200, msg);
+
+    return poller_frame_init_http_header(200, msg);
+}
+
+static void __test_done(struct __test_stream *s, struct poller_frame_message *msg)
+{
+    memcpy(s->frames[s->nframes], msg->buf, msg->size);
+    s->frame_sizes[s->nframes++] = msg->size;
+    poller_frame_deinit(msg);
+}
+
+static int __test_read(struct __test_stream *s, const size_t *chunks, int nchunks,
+                       int len_size, int buffers)
+{
+    struct poller_frame_message msg;
+    int active = 0;
+    size_t left;
+    size_t take;
+    size_t size;
+    size_t n;
+    void *p;
+    int ret;
+    int c;
+
+    for(c = 0; c < nchunks; c++)
+    {
+        left = chunks[c];
+        while(left > 0)
+        {
+            size = 0;
+            p = NULL;
+            if(active && buffers)
+                p = msg.base.get_buffer ? msg.base.get_buffer(&size, &msg.base) : NULL;
+
+            if(p && size > 0)
+            {
+                take = left < size ? left : size;
+                memcpy(p, s->data + s->pos, take);
+                s->pos += take;
+                left -= take;
+                ret = msg.base.commit(take, &msg.base);
+            }
+            else
+            {
+                if(!active && __test_new(&msg, len_size) < 0)
+                    return -1;
+
+                active = 1;
+                n = left;
+                ret = msg.base.append(s->data + s->pos, &n, &msg.base);
+                if(ret >= 0 && n > left)
+                    return -1;
+
+                s->pos += n;
+                left -= n;
+            }
+
+            if(ret < 0)
+            {
+                poller_frame_deinit(&msg);
+                return -1;
+            }
+
+            if(ret > 0)
+            {
+                __test_done(s, &msg);
+                active = 0;
+            }
+        }
+    }
+
+    if(active)
+        poller_frame_deinit(&msg);
+
+    return active;
+}
+
+/* Splits of 'data' into 1, 2 and 3 reads at every pair of points, and byte by byte. */
+static void __test_splits(const char *data, size_t size, const char *const *frames,
+                          const size_t *sizes, int nframes, int len_size, int buffers)
+{
+    struct __test_stream s;
+    size_t chunks[TEST_BUF];
+    size_t a, b;
+    int nchunks;
+    int i;
+
+    for(a = 0; a <= size; a++)
+    {
+        for(b = a; b <= size; b++)
+        {
+            memset(&s, 0, sizeof s);
+            s.data = data;
+            s.size = size;
+            nchunks = 0;
+            if(a > 0)
+                chunks[nchunks++] = a;
+            if(b > a)
+                chunks[nchunks++] = b - a;
+            if(size > b)
+                chunks[nchunks++] = size - b;
+
+            CHECK(__test_read(&s, chunks, nchunks, len_size, buffers) == 0);
+            CHECK(s.pos == size);
+            CHECK(s.nframes == nframes);
+            for(i = 0; i < nframes; i++)
+            {
+                CHECK(s.frame_sizes[i] == sizes[i]);
+                CHECK(memcmp(s.frames[i], frames[i], sizes[i]) == 0);
+            }
+        }
+    }
+
+    memset(&s, 0, sizeof s);
+    s.data = data;
+    s.size = size;
+    for(a = 0; a < size; a++)
+        chunks[a] = 1;
+
+    CHECK(__test_read(&s, chunks, (int)size, len_size, buffers) == 0);
+    CHECK(s.nframes == nframes);
+}
+
+/* Pipelined header blocks, the delimiter split at every point between reads. */
+static void test_delim_split(void)
+{
+    static const char *const frames[] = {
+        "GET / HTTP/1.1\r\n\r\n",
+        "\r\n\r\n",
+        "GET /a HTTP/1.1\r\nHost: x\r\n\r\n",
+        "X\r\n\r\r\n\r\n",
+    };
+    char data[TEST_BUF];
+    size_t sizes[4];
+    size_t size = 0;
+    int i;
+
+    for(i = 0; i < 4; i++)
+    {
+        sizes[i] = strlen(frames[i]);
+        memcpy(data + size, frames[i], sizes[i]);
+        size += sizes[i];
+    }
+
+    __test_splits(data, size, frames, sizes, 4, 0, 0);
+}
+
+/* A delimiter that ends exactly at, or straddles, each lane boundary of one read. */
+static void test_delim_lanes(void)
+{
+    static const size_t bounds[] = { 16, 32, 48, 64, 96, 128 };
+    struct __test_stream s;
+    char frame[TEST_BUF];
+    size_t chunk;
+    size_t size;
+    int b;
+    int d;
+
+    for(b = 0; b < 6; b++)
+    {
+        for(d = -4; d <= 3; d++)
+        {
+            size = bounds[b] + d;
+            memset(frame, 'a', size);
+            memcpy(frame + size - 4, "\r\n\r\n", 4);
+            frame[size - 6] = '\r';
+
+            memset(&s, 0, sizeof s);
+            s.data = frame;
+            s.size = size;
+            chunk = size;
+            CHECK(__test_read(&s, &chunk, 1, 0, 0) == 0);
+            CHECK(s.nframes == 1 && s.frame_sizes[0] == size);
+        }
+    }
+}
+
+static size_t __test_put_length(char *p, const char *payload, size_t len, int len_size)
+{
+    int i;
+
+    for(i = 0; i < len_size; i++)
+        p[i] = (char)(len >> (len_size - 1 - i) * 8);
+
+    memcpy(p + len_size, payload, len);
+    return len_size + len;
+}
+
+/* Length prefixes split across reads, with and without lent buffers. */
+static void test_length_split(void)
+{
+    static const char *const payloads[] = { "hello", "", "a longer payload, 33 bytes long." };
+    static const int len_sizes[] = { 1, 2, 4, 8 };
+    char frames[3][64];
+    const char *framep[3];
+    char data[TEST_BUF];
+    size_t sizes[3];
+    size_t size;
+    int k;
+    int i;
+
+    for(k = 0; k < 4; k++)
+    {
+        size = 0;
+        for(i = 0; i < 3; i++)
+        {
+            sizes[i] = __test_put_length(frames[i], payloads[i], strlen(payloads[i]),
+                                         len_sizes[k]);
+            framep[i] = frames[i];
+            memcpy(data + size, frames[i], sizes[i]);
+            size += sizes[i];
+        }
+
+        __test_splits(data, size, framep, sizes, 3, len_sizes[k], 0);
+        __test_splits(data, size, framep, sizes, 3, len_sizes[k], 1);
+    }
+}
+
+static void test_limits(void)
+{
+    struct __test_stream s;
+    char data[2 * TEST_BUF];
+    size_t size;
+
+    /* A prefix over max_size fails as soon as it is complete. */
+    memset(&s, 0, sizeof s);
+    data[0] = 0;
+    data[1] = (char)250;
+    s.data = data;
+    s.size = 2;
+    size = 2;
+    errno = 0;
+    CHECK(__test_read(&s, &size, 1, 2, 1) < 0 && errno == EMSGSIZE);
+
+    /* A delimited frame fails once it grows past max_size (200). */
+    memset(&s, 0, sizeof s);
+    memset(data, 'a', sizeof data);
+    s.data = data;
+    s.size = sizeof data;
+    size = TEST_BUF;
+    CHECK(__test_read(&s, &size, 1, 0, 0) == 1);
+
+    memset(&s, 0, sizeof s);
+    s.data = data;
+    s.size = sizeof data;
+    size = sizeof data;
+    errno = 0;
+    CHECK(__test_read(&s, &size, 1, 0, 0) < 0 && errno == EMSGSIZE);
+}
+
+int main(void)
+{
+    test_search();
+    test_delim_split();
+    test_delim_lanes();
+    test_length_split();
+    test_limits();
+    return __test_failed;
+}
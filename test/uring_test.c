@@ -0,0 +1,502 @@
+// io_uring backend: listen fds left ready by the accept budget, and with
+// uring_ops, reads and accepts through the ring, with their fallbacks.
+//
+//   cmake -DPOLLER_IO_URING=ON ... && ctest -R uring_test
+//
+// Every case runs with and without uring_ops. Sockets are on loopback or
+// socket pairs. Where the kernel has no io_uring the test is skipped.
+//
+#include "../src/kernel/poller.c"
+#include <dirent.h>
+#include "poller_framing.h"
+
+#define TEST_CONNS      24
+#define TEST_FRAME_MAX  (1 << 20)
+
+static int __test_failed;
+
+#define CHECK(cond) \
+    do { \
+        if(!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            __test_failed = 1; \
+            return; \
+        } \
+    } while(0)
+
+struct __test_state
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int accepted;
+    int fds[TEST_CONNS];
+    struct sockaddr_in peers[TEST_CONNS];
+    int frames;
+    size_t frame_bytes;
+    int bad_frames;
+    int states[PR_ST_STOPPED + 1];
+};
+
+static struct __test_state st = {
+    .mutex  = PTHREAD_MUTEX_INITIALIZER,
+    .cond   = PTHREAD_COND_INITIALIZER,
+};
+
+static void __test_reset(void)
+{
+    pthread_mutex_lock(&st.mutex);
+    st.accepted = 0;
+    st.frames = 0;
+    st.frame_bytes = 0;
+    st.bad_frames = 0;
+    memset(st.states, 0, sizeof st.states);
+    pthread_mutex_unlock(&st.mutex);
+}
+
+/* Waits up to 5 seconds for '*counter' to reach 'value'. */
+static int __test_wait(int *counter, int value)
+{
+    struct timespec abstime;
+    int ret = 0;
+
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_sec += 5;
+    pthread_mutex_lock(&st.mutex);
+    while(*counter < value && ret == 0)
+        ret = pthread_cond_timedwait(&st.cond, &st.mutex, &abstime);
+
+    ret = *counter >= value ? 0 : -1;
+    pthread_mutex_unlock(&st.mutex);
+    return ret;
+}
+
+static void __test_accepted(int sockfd, const void *addr, socklen_t addrlen)
+{
+    pthread_mutex_lock(&st.mutex);
+    if(st.accepted < TEST_CONNS && addrlen == sizeof (struct sockaddr_in))
+    {
+        st.fds[st.accepted] = sockfd;
+        memcpy(&st.peers[st.accepted++], addr, addrlen);
+    }
+    else
+        close(sockfd);
+
+    pthread_cond_broadcast(&st.cond);
+    pthread_mutex_unlock(&st.mutex);
+}
+
+static void *__test_accept(const struct sockaddr *addr, socklen_t addrlen,
+                           int sockfd, void *context)
+{
+    __test_accepted(sockfd, addr, addrlen);
+    return (void *)1;
+}
+
+static void *__test_accept_batch(const struct poller_accepted *acc, int n, void *context)
+{
+    int i;
+
+    for(i = 0; i < n; i++)
+        __test_accepted(acc[i].sockfd, &acc[i].addr, acc[i].addrlen);
+
+    return (void *)1;
+}
+
+static poller_message_t *__test_create_message(void *context)
+{
+    struct poller_frame_message *msg;
+
+    msg = (struct poller_frame_message *)malloc(sizeof (struct poller_frame_message));
+    if(msg && poller_frame_init_length(4, TEST_FRAME_MAX, msg) < 0)
+    {
+        free(msg);
+        msg = NULL;
+    }
+
+    return msg ? &msg->base : NULL;
+}
+
+static void __test_callback(struct poller_result *res, void *context)
+{
+    struct poller_frame_message *msg;
+    size_t i;
+    int bad = 0;
+
+    if(res->data.operation == PD_OP_READ && res->state == PR_ST_SUCCESS)
+    {
+        msg = (struct poller_frame_message *)res->data.message;
+        for(i = 4; i < msg->size; i++)
+        {
+            if(msg->buf[i] != (char)('a' + (i - 4) % 26))
+                bad = 1;
+        }
+
+        pthread_mutex_lock(&st.mutex);
+        st.frames++;
+        st.frame_bytes += msg->size - 4;
+        st.bad_frames += bad;
+        pthread_mutex_unlock(&st.mutex);
+        poller_frame_deinit(msg);
+        free(msg);
+    }
+
+    pthread_mutex_lock(&st.mutex);
+    st.states[res->state]++;
+    pthread_cond_broadcast(&st.cond);
+    pthread_mutex_unlock(&st.mutex);
+    free(res);
+}
+
+static poller_t *__test_create(int uring_ops, int accept_budget)
+{
+    struct poller_params params = {
+        .max_open_files = 1024,
+        .callback       = __test_callback,
+        .backend        = POLLER_BACKEND_IO_URING,
+        .accept_budget  = accept_budget,
+        .uring_ops      = uring_ops,
+    };
+    poller_t *poller = poller_create(&params);
+
+    if(poller && poller_start(poller) < 0)
+    {
+        poller_destroy(poller);
+        poller = NULL;
+    }
+
+    return poller;
+}
+
+static void __test_destroy(poller_t *poller)
+{
+    poller_stop(poller);
+    poller_destroy(poller);
+}
+
+/* The op mode 'fd' was registered with, or -1 if it has no node. */
+static int __test_uring_op(int fd, poller_t *poller)
+{
+    struct __poller_node *node;
+    int op = -1;
+
+    pthread_mutex_lock(&poller->mutex);
+    node = __poller_get_node(fd, poller);
+    if(node)
+        op = node->uring_op;
+
+    pthread_mutex_unlock(&poller->mutex);
+    return op;
+}
+
+static int __test_listen(struct sockaddr_in *addr)
+{
+    socklen_t addrlen = sizeof (struct sockaddr_in);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    memset(addr, 0, sizeof (struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(fd >= 0 && (bind(fd, (struct sockaddr *)addr, addrlen) < 0 ||
+                   listen(fd, 128) < 0 ||
+                   getsockname(fd, (struct sockaddr *)addr, &addrlen) < 0))
+    {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Connections queued before the listen node is added, more than one
+ * wakeup's budget. All of them are accepted, with their own peer address,
+ * and PD_OP_LISTEN_BATCH sockets are non-blocking.
+ */
+static void __test_accepts(int operation, int uring_ops, int budget)
+{
+    poller_t *poller = __test_create(uring_ops, budget);
+    struct sockaddr_in addr;
+    struct sockaddr_in local[TEST_CONNS];
+    socklen_t addrlen;
+    struct poller_data data;
+    int cfd[TEST_CONNS];
+    int lfd = __test_listen(&addr);
+    int found;
+    int i;
+    int j;
+
+    CHECK(poller && lfd >= 0);
+    __test_reset();
+    for(i = 0; i < TEST_CONNS; i++)
+    {
+        cfd[i] = socket(AF_INET, SOCK_STREAM, 0);
+        CHECK(connect(cfd[i], (struct sockaddr *)&addr, sizeof addr) == 0);
+        addrlen = sizeof (struct sockaddr_in);
+        CHECK(getsockname(cfd[i], (struct sockaddr *)&local[i], &addrlen) == 0);
+    }
+
+    memset(&data, 0, sizeof data);
+    data.operation = operation;
+    data.fd = lfd;
+    if(operation == PD_OP_LISTEN)
+        data.accept = __test_accept;
+    else
+        data.accept_batch = __test_accept_batch;
+
+    CHECK(poller_add(&data, -1, poller) == 0);
+    if(poller->uring_ops)
+        CHECK(__test_uring_op(lfd, poller) == __URING_OP_ACCEPT);
+    else
+        CHECK(__test_uring_op(lfd, poller) == 0);
+
+    CHECK(__test_wait(&st.accepted, TEST_CONNS) == 0);
+    for(i = 0; i < TEST_CONNS; i++)
+    {
+        found = 0;
+        for(j = 0; j < TEST_CONNS; j++)
+        {
+            if(st.peers[j].sin_port == local[i].sin_port)
+                found++;
+        }
+
+        CHECK(found == 1);
+        if(operation == PD_OP_LISTEN_BATCH)
+            CHECK(fcntl(st.fds[i], F_GETFL) & O_NONBLOCK);
+    }
+
+    CHECK(poller_del(lfd, poller) == 0);
+    CHECK(__test_wait(&st.states[PR_ST_DELETED], 1) == 0);
+    __test_destroy(poller);
+    for(i = 0; i < TEST_CONNS; i++)
+    {
+        close(st.fds[i]);
+        close(cfd[i]);
+    }
+
+    close(lfd);
+}
+
+static void test_accepts(void)
+{
+    int ops;
+
+    for(ops = 0; ops < 2; ops++)
+    {
+        __test_accepts(PD_OP_LISTEN_BATCH, ops, 1);
+        __test_accepts(PD_OP_LISTEN_BATCH, ops, 0);
+        __test_accepts(PD_OP_LISTEN, ops, 0);
+    }
+}
+
+struct __test_writer
+{
+    int fd;
+    const size_t *sizes;
+    int n;
+    size_t total;
+};
+
+static size_t __test_put_frame(char *p, size_t size)
+{
+    size_t i;
+
+    p[0] = (char)(size >> 24);
+    p[1] = (char)(size >> 16);
+    p[2] = (char)(size >> 8);
+    p[3] = (char)size;
+    for(i = 0; i < size; i++)
+        p[4 + i] = (char)('a' + i % 26);
+
+    return 4 + size;
+}
+
+/* Writes the frames back to back in uneven chunks, then closes. */
+static void *__test_write_frames(void *arg)
+{
+    struct __test_writer *w = (struct __test_writer *)arg;
+    size_t len = 0;
+    size_t off;
+    size_t n;
+    char *buf;
+    int i;
+
+    buf = (char *)malloc(w->total + 4 * w->n);
+    for(i = 0; i < w->n; i++)
+        len += __test_put_frame(buf + len, w->sizes[i]);
+
+    for(off = 0, i = 0; off < len; off += n, i++)
+    {
+        n = (i * 7919) % 40000 + 1;
+        if(n > len - off)
+            n = len - off;
+
+        if(write(w->fd, buf + off, n) != (ssize_t)n)
+            break;
+    }
+
+    free(buf);
+    close(w->fd);
+    return NULL;
+}
+
+/* Frames across buffer boundaries on a stream socket, then EOF. */
+static void __test_recv(int uring_ops)
+{
+    static const size_t sizes[] = {
+        0, 1, 100, 16380, 16384, 16385, 50000, 3, 300000, 0, 70000, 9
+    };
+    struct __test_writer w = { .sizes = sizes, .n = 12 };
+    poller_t *poller = __test_create(uring_ops, 0);
+    struct poller_data data;
+    pthread_t tid;
+    int sv[2];
+    int i;
+
+    CHECK(poller);
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    CHECK(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+    __test_reset();
+    for(i = 0; i < w.n; i++)
+        w.total += sizes[i];
+
+    memset(&data, 0, sizeof data);
+    data.operation = PD_OP_READ;
+    data.fd = sv[0];
+    data.create_message = __test_create_message;
+    CHECK(poller_add(&data, -1, poller) == 0);
+    CHECK(__test_uring_op(sv[0], poller) == (poller->uring_ops ? __URING_OP_RECV : 0));
+
+    w.fd = sv[1];
+    CHECK(pthread_create(&tid, NULL, __test_write_frames, &w) == 0);
+    CHECK(__test_wait(&st.states[PR_ST_FINISHED], 1) == 0);
+    pthread_join(tid, NULL);
+    CHECK(st.frames == w.n);
+    CHECK(st.frame_bytes == w.total);
+    CHECK(st.bad_frames == 0);
+    CHECK(st.states[PR_ST_ERROR] == 0);
+    __test_destroy(poller);
+    close(sv[0]);
+}
+
+/* A pipe is not a socket: the node goes back to polling. */
+static void __test_pipe(int uring_ops)
+{
+    static const size_t sizes[] = { 5, 20000, 0 };
+    struct __test_writer w = { .sizes = sizes, .n = 3, .total = 20005 };
+    poller_t *poller = __test_create(uring_ops, 0);
+    struct poller_data data;
+    pthread_t tid;
+    int fds[2];
+
+    CHECK(poller);
+    CHECK(pipe2(fds, O_NONBLOCK) == 0);
+    CHECK(fcntl(fds[1], F_SETFL, 0) == 0);
+    __test_reset();
+    memset(&data, 0, sizeof data);
+    data.operation = PD_OP_READ;
+    data.fd = fds[0];
+    data.create_message = __test_create_message;
+    CHECK(poller_add(&data, -1, poller) == 0);
+
+    w.fd = fds[1];
+    CHECK(pthread_create(&tid, NULL, __test_write_frames, &w) == 0);
+    CHECK(__test_wait(&st.states[PR_ST_FINISHED], 1) == 0);
+    pthread_join(tid, NULL);
+    CHECK(st.frames == 3);
+    CHECK(st.frame_bytes == w.total);
+    CHECK(st.bad_frames == 0);
+    __test_destroy(poller);
+    close(fds[0]);
+}
+
+/* A read node replaced by another one, which keeps receiving, then deleted. */
+static void __test_mod(int uring_ops)
+{
+    poller_t *poller = __test_create(uring_ops, 0);
+    struct poller_data data;
+    char frame[64];
+    size_t len;
+    int sv[2];
+
+    CHECK(poller);
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    CHECK(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+    __test_reset();
+    memset(&data, 0, sizeof data);
+    data.operation = PD_OP_READ;
+    data.fd = sv[0];
+    data.create_message = __test_create_message;
+    CHECK(poller_add(&data, -1, poller) == 0);
+
+    len = __test_put_frame(frame, 50);
+    CHECK(write(sv[1], frame, len) == (ssize_t)len);
+    CHECK(__test_wait(&st.frames, 1) == 0);
+
+    CHECK(poller_mod(&data, -1, poller) == 0);
+    CHECK(__test_wait(&st.states[PR_ST_MODIFIED], 1) == 0);
+    CHECK(write(sv[1], frame, len) == (ssize_t)len);
+    CHECK(__test_wait(&st.frames, 2) == 0);
+
+    CHECK(poller_del(sv[0], poller) == 0);
+    CHECK(__test_wait(&st.states[PR_ST_DELETED], 1) == 0);
+    CHECK(write(sv[1], frame, len) == (ssize_t)len);
+    usleep(50000);
+    CHECK(st.frames == 2);
+    __test_destroy(poller);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void test_reads(void)
+{
+    int ops;
+
+    for(ops = 0; ops < 2; ops++)
+    {
+        __test_recv(ops);
+        __test_pipe(ops);
+        __test_mod(ops);
+    }
+}
+
+static int __test_count_fds(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    int n = 0;
+
+    if(!dir)
+        return -1;
+
+    while(readdir(dir))
+        n++;
+
+    closedir(dir);
+    return n;
+}
+
+int main(void)
+{
+    poller_t *poller = __test_create(0, 0);
+    int nfds;
+
+    if(!poller)
+    {
+        fprintf(stderr, "io_uring unavailable, skipped\n");
+        return 0;
+    }
+
+    __test_destroy(poller);
+    nfds = __test_count_fds();
+    test_accepts();
+    test_reads();
+
+    /* Sockets accepted for nodes already gone are closed too. */
+    if(__test_count_fds() != nfds)
+    {
+        fprintf(stderr, "fds leaked: %d before, %d after\n", nfds, __test_count_fds());
+        __test_failed = 1;
+    }
+
+    return __test_failed;
+}
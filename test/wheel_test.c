@@ -0,0 +1,319 @@
+// Timing wheel: expiry order across level boundaries, cascades, and the
+// cached earliest tick.
+//
+//   ctest -R wheel_test
+//
+// The wheel is driven directly, with made-up ticks, so deadlines far up
+// the levels are reached without waiting for them. A last test runs real
+// timers through a started poller across the first cascade (256ms).
+//
+#include "../src/kernel/poller.c"
+
+static int __test_failed;
+
+#define CHECK(cond) \
+    do { \
+        if(!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            __test_failed = 1; \
+            return; \
+        } \
+    } while(0)
+
+static void __test_callback(struct poller_result *res, void *context)
+{
+    free(res);
+}
+
+static poller_t *__test_create(unsigned long long jiffies)
+{
+    struct poller_params params = {
+        .max_open_files = 16,
+        .callback       = __test_callback,
+        .timeo_type     = POLLER_TIMEO_WHEEL,
+    };
+    poller_t *poller = poller_create(&params);
+
+    if(poller)
+        poller->wheel_jiffies = jiffies;
+
+    return poller;
+}
+
+static struct __poller_node *__test_node(unsigned long long tick)
+{
+    struct __poller_node *node;
+
+    node = (struct __poller_node *)calloc(1, sizeof (struct __poller_node));
+    if(node)
+    {
+        __wheel_tick_to_timespec(tick, &node->timeout);
+        node->data.fd = -1;
+    }
+
+    return node;
+}
+
+static int __test_cmp(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Wake up at each tick __poller_wheel_first() gives, as the poller thread
+ * does, and check that every node expires exactly at its deadline, in
+ * deadline order, and that the cached tick is never later than a full scan.
+ */
+static void __test_expire_all(unsigned long long *ticks, size_t n, poller_t *poller)
+{
+    struct __poller_node *node;
+    struct list_head *pos, *tmp;
+    unsigned long long first;
+    size_t done = 0;
+    LIST_HEAD(expired);
+
+    qsort(ticks, n, sizeof (unsigned long long), __test_cmp);
+    while(__poller_wheel_first(&first, poller))
+    {
+        CHECK(first <= __poller_wheel_scan(poller));
+        CHECK(done < n && first <= ticks[done]);
+        CHECK(first >= poller->wheel_jiffies);
+
+        __poller_wheel_expire(first, &expired, poller);
+        list_for_each_safe(pos, tmp, &expired)
+        {
+            node = list_entry(pos, struct __poller_node, list);
+            CHECK(done < n && __wheel_tick(&node->timeout) == ticks[done]);
+            CHECK(ticks[done] == first);
+            list_del(pos);
+            free(node);
+            done++;
+        }
+    }
+
+    CHECK(done == n);
+    CHECK(poller->wheel_count == 0);
+}
+
+static void __test_insert(unsigned long long *ticks, size_t n, poller_t *poller)
+{
+    struct __poller_node *node;
+    size_t i;
+
+    for(i = 0; i < n; i++)
+    {
+        node = __test_node(ticks[i]);
+        CHECK(node);
+        __poller_wheel_insert(node, poller);
+    }
+}
+
+/* Deadlines on both sides of the first tick of each level. */
+static void test_level_boundaries(void)
+{
+    unsigned long long base = 1000003;
+    unsigned long long ticks[64];
+    poller_t *poller = __test_create(base);
+    size_t n = 0;
+    int level;
+    int d;
+
+    CHECK(poller);
+    for(d = -1; d <= 1; d++)
+        ticks[n++] = base + WHEEL_ROOT_SIZE + d;
+
+    for(level = 1; level < WHEEL_LEVELS; level++)
+    {
+        for(d = -1; d <= 1; d++)
+            ticks[n++] = base + (1ULL << __wheel_shift(level)) + d;
+    }
+
+    ticks[n++] = base;
+    ticks[n++] = base + 1;
+
+    __test_insert(ticks, n, poller);
+    __test_expire_all(ticks, n, poller);
+    poller_destroy(poller);
+}
+
+/* Deadlines at each end of one slot of each level are cascaded apart. */
+static void test_cascade(void)
+{
+    unsigned long long base = 1ULL << 30;
+    unsigned long long ticks[32];
+    poller_t *poller = __test_create(base);
+    unsigned long long slot;
+    size_t n = 0;
+    int level;
+
+    CHECK(poller);
+    for(level = 0; level < WHEEL_LEVELS - 1; level++)
+    {
+        /* The second slot of the level: cascaded once the wheel reaches it. */
+        slot = base + (2ULL << __wheel_shift(level));
+        ticks[n++] = slot;
+        ticks[n++] = slot + 1;
+        ticks[n++] = slot + (1ULL << __wheel_shift(level)) - 1;
+    }
+
+    __test_insert(ticks, n, poller);
+    __test_expire_all(ticks, n, poller);
+    poller_destroy(poller);
+}
+
+/* Random deadlines, some inserted while the wheel is already turning. */
+static void test_random(void)
+{
+    unsigned long long base = 5000000;
+    unsigned long long ticks[2048];
+    unsigned long long all[4096];
+    poller_t *poller = __test_create(base);
+    unsigned int seed = 1;
+    size_t n = 0;
+    size_t i;
+    LIST_HEAD(expired);
+
+    CHECK(poller);
+    for(i = 0; i < 2048; i++)
+        ticks[i] = base + (unsigned long long)rand_r(&seed) % (1ULL << 22);
+
+    __test_insert(ticks, 2048, poller);
+    memcpy(all, ticks, sizeof ticks);
+    n = 2048;
+
+    /* Nothing is due before the first deadline, so nothing expires. */
+    qsort(ticks, 2048, sizeof (unsigned long long), __test_cmp);
+    __poller_wheel_expire(ticks[0] - 1, &expired, poller);
+    CHECK(list_empty(&expired));
+
+    for(i = 0; i < 2048; i++)
+        all[n++] = poller->wheel_jiffies + (unsigned long long)rand_r(&seed) % (1ULL << 22);
+
+    __test_insert(all + 2048, 2048, poller);
+    __test_expire_all(all, n, poller);
+    poller_destroy(poller);
+}
+
+/* An erased node can leave the cached tick early, but never late. */
+static void test_erase(void)
+{
+    unsigned long long base = 7000000;
+    unsigned long long ticks[3] = { base + 10, base + 300, base + 70000 };
+    struct __poller_node *early = __test_node(base + 5);
+    poller_t *poller = __test_create(base);
+    unsigned long long first;
+
+    CHECK(poller && early);
+    __test_insert(ticks, 3, poller);
+    __poller_wheel_insert(early, poller);
+    CHECK(__poller_wheel_first(&first, poller) && first == base + 5);
+
+    __poller_wheel_erase(early, poller);
+    free(early);
+    CHECK(__poller_wheel_first(&first, poller) && first <= base + 10);
+
+    __test_expire_all(ticks, 3, poller);
+    CHECK(!__poller_wheel_first(&first, poller));
+    poller_destroy(poller);
+}
+
+struct __test_timers
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct timespec start;
+    long due_ms[4];
+    long late_ms[4];
+    int order[4];
+    int count;
+};
+
+static long __test_elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void __test_timer_callback(struct poller_result *res, void *context)
+{
+    struct __test_timers *timers = (struct __test_timers *)context;
+    int i = (int)(long)res->data.context;
+
+    pthread_mutex_lock(&timers->mutex);
+    timers->late_ms[i] = __test_elapsed_ms(&timers->start) - timers->due_ms[i];
+    timers->order[timers->count++] = i;
+    pthread_cond_signal(&timers->cond);
+    pthread_mutex_unlock(&timers->mutex);
+    free(res);
+}
+
+/* Real timers on both sides of the first cascade, added latest first. */
+static void test_poller_timers(void)
+{
+    struct __test_timers timers = {
+        .mutex      = PTHREAD_MUTEX_INITIALIZER,
+        .cond       = PTHREAD_COND_INITIALIZER,
+        .due_ms     = { 20, 250, 300, 600 },
+    };
+    struct poller_params params = {
+        .max_open_files = 16,
+        .callback       = __test_timer_callback,
+        .context        = &timers,
+        .timeo_type     = POLLER_TIMEO_WHEEL,
+    };
+    poller_t *poller = poller_create(&params);
+    struct timespec value;
+    void *timer;
+    int expired;
+    int i;
+
+    CHECK(poller);
+    CHECK(poller_start(poller) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &timers.start);
+    for(i = 3; i >= 0; i--)
+    {
+        value.tv_sec = timers.due_ms[i] / 1000;
+        value.tv_nsec = timers.due_ms[i] % 1000 * 1000000;
+        CHECK(poller_add_timer(&value, (void *)(long)i, &timer, poller) == 0);
+    }
+
+    /* Whatever has not expired by then is delivered by poller_stop(). */
+    clock_gettime(CLOCK_REALTIME, &value);
+    value.tv_sec += 5;
+    pthread_mutex_lock(&timers.mutex);
+    while(timers.count < 4)
+    {
+        if(pthread_cond_timedwait(&timers.cond, &timers.mutex, &value) != 0)
+            break;
+    }
+
+    expired = timers.count;
+    pthread_mutex_unlock(&timers.mutex);
+
+    poller_stop(poller);
+    poller_destroy(poller);
+    CHECK(expired == 4);
+    for(i = 0; i < 4; i++)
+    {
+        CHECK(timers.order[i] == i);
+        CHECK(timers.late_ms[i] >= 0);
+        CHECK(timers.late_ms[i] < 100);
+    }
+}
+
+int main(void)
+{
+    test_level_boundaries();
+    test_cascade();
+    test_random();
+    test_erase();
+    test_poller_timers();
+    return __test_failed;
+}